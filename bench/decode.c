@@ -0,0 +1,180 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <loader.h>
+#include <png.h>
+#include <thread-pool.h>
+
+/* Decodes a PNG the way the viewer used to, through stdio and
+ * png_read_png, and with the loader from the mapped file and from a pipe.
+ * Each decode runs in its own process, once with the file dropped from the
+ * page cache and once with it cached, and prints its time and the read
+ * system calls it made. */
+
+#define REPEATS 3
+
+static const char *path;
+
+static double now_seconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/* Read system calls of this process so far. */
+static uint64_t read_calls(void) {
+  FILE *file = fopen("/proc/self/io", "r");
+  assert(file != NULL);
+  char line[64];
+  uint64_t calls = 0;
+  while (fgets(line, sizeof(line), file) != NULL) {
+    if (sscanf(line, "syscr: %lu", &calls) == 1) {
+      break;
+    }
+  }
+  fclose(file);
+  return calls;
+}
+
+/* Decoders return the read calls they made that didn't read the file. */
+static uint64_t decode_stdio(void) {
+  FILE *file = fopen(path, "r");
+  assert(file != NULL);
+  png_structp png =
+      png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+  assert(png != NULL);
+  png_infop info = png_create_info_struct(png);
+  assert(info != NULL);
+  png_init_io(png, file);
+  png_set_filler(png, 0xFF, PNG_FILLER_AFTER);
+  png_read_png(png, info,
+               PNG_TRANSFORM_SCALE_16 | PNG_TRANSFORM_GRAY_TO_RGB |
+                   PNG_TRANSFORM_EXPAND | PNG_TRANSFORM_BGR,
+               NULL);
+  png_destroy_read_struct(&png, &info, NULL);
+  fclose(file);
+  return 0;
+}
+
+static uint64_t decode_loader(const char *loader_path) {
+  thread_pool_init();
+  struct png_header header;
+  loader_probe(loader_path, &header);
+  loader_start(false, false, 1);
+  loader_wait_open();
+  uint32_t first_row;
+  uint32_t last_row;
+  /* Every poll reads the eventfd of the loader. */
+  uint64_t polls = 0;
+  while (png_decoding) {
+    struct pollfd pollfd = {loader_get_fd(), POLLIN, 0};
+    poll(&pollfd, 1, -1);
+    loader_poll(&first_row, &last_row);
+    polls++;
+  }
+  return polls;
+}
+
+static uint64_t decode_mapped(void) { return decode_loader(path); }
+
+/* Feeds the file to stdin from another process. */
+static uint64_t decode_pipe(void) {
+  int fds[2];
+  int error = pipe(fds);
+  assert(error == 0);
+  if (fork() == 0) {
+    close(fds[0]);
+    int fd = open(path, O_RDONLY);
+    assert(fd != -1);
+    char buffer[1 << 16];
+    ssize_t size;
+    while ((size = read(fd, buffer, sizeof(buffer))) > 0) {
+      ssize_t written = write(fds[1], buffer, size);
+      assert(written == size);
+    }
+    _exit(0);
+  }
+  close(fds[1]);
+  dup2(fds[0], STDIN_FILENO);
+  close(fds[0]);
+  return decode_loader("-");
+}
+
+/* Drops the pages of the file from the page cache, or reads all of them
+ * into it. */
+static void prepare_cache(bool cold) {
+  int fd = open(path, O_RDONLY);
+  assert(fd != -1);
+  if (cold) {
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  } else {
+    char buffer[1 << 16];
+    while (read(fd, buffer, sizeof(buffer)) > 0) {
+    }
+  }
+  close(fd);
+}
+
+/* Runs decode in a child process, which reports its time and read calls
+ * through a pipe. */
+static void measure(const char *name, uint64_t (*decode)(void), bool cold) {
+  double best = 0;
+  uint64_t calls = 0;
+  for (uint32_t i = 0; i < REPEATS; i++) {
+    prepare_cache(cold);
+    int fds[2];
+    int error = pipe(fds);
+    assert(error == 0);
+    pid_t child = fork();
+    assert(child != -1);
+    if (child == 0) {
+      close(fds[0]);
+      uint64_t calls_before = read_calls();
+      double start = now_seconds();
+      uint64_t other_calls = decode();
+      double seconds = now_seconds() - start;
+      /* The read of the first count only shows up in the second one. */
+      uint64_t calls = read_calls() - calls_before - 1 - other_calls;
+      double result[2] = {seconds, (double)calls};
+      ssize_t size = write(fds[1], result, sizeof(result));
+      assert(size == sizeof(result));
+      _exit(0);
+    }
+    close(fds[1]);
+    double result[2];
+    ssize_t size = read(fds[0], result, sizeof(result));
+    assert(size == sizeof(result));
+    close(fds[0]);
+    int status;
+    waitpid(child, &status, 0);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    if (best == 0 || result[0] < best) {
+      best = result[0];
+    }
+    calls = result[1];
+  }
+  printf("%-18s %-5s %10.2f ms %8lu reads\n", name, cold ? "cold" : "warm",
+         best * 1e3, (unsigned long)calls);
+}
+
+int main(int argc, char **argv) {
+  assert(argc == 2);
+  path = argv[1];
+  for (int cold = 1; cold >= 0; cold--) {
+    measure("stdio and libpng", decode_stdio, cold);
+    measure("loader, mapped", decode_mapped, cold);
+    measure("loader, pipe", decode_pipe, cold);
+  }
+  return 0;
+}
@@ -0,0 +1,198 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <poll.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <loader.h>
+#include <thread-pool.h>
+#include <zlib.h>
+
+/* Decodes an RGBA image whose stream was fully flushed every few rows, which
+ * the loader splits into segments that it inflates on all cores, and the
+ * same image without flushes, which it can only inflate serially. Each is
+ * decoded once restricted to one core, where the loader inflates serially,
+ * and once on every core. Each decode runs in its own process with the
+ * file in the page cache, and the best time of a few is printed. */
+
+#define REPEATS 3
+#define WIDTH 4096
+#define HEIGHT 4096
+#define FLUSH_ROWS 64
+#define IDAT_SIZE (1 << 20)
+
+static double now_seconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void write_all(FILE *file, const void *data, size_t size) {
+  size_t written = fwrite(data, 1, size, file);
+  assert(written == size);
+}
+
+static void write_uint32(FILE *file, uint32_t value) {
+  uint8_t bytes[4] = {value >> 24, value >> 16, value >> 8, value};
+  write_all(file, bytes, 4);
+}
+
+static void write_chunk(FILE *file, const char *type, const uint8_t *data,
+                        uint32_t size) {
+  write_uint32(file, size);
+  write_all(file, type, 4);
+  uLong crc = crc32(0, (const Bytef *)type, 4);
+  if (size != 0) {
+    write_all(file, data, size);
+    crc = crc32(crc, data, size);
+  }
+  write_uint32(file, crc);
+}
+
+/* Writes the image, gradients with noise in the low bits, filtered with
+ * Sub, and fully flushes the stream every flush_rows rows unless that is
+ * 0. */
+static void write_png(const char *path, uint32_t flush_rows) {
+  FILE *file = fopen(path, "wb");
+  assert(file != NULL);
+  write_all(file, "\x89PNG\r\n\x1a\n", 8);
+  uint8_t header[13] = {WIDTH >> 24, WIDTH >> 16, WIDTH >> 8, WIDTH & 0xFF,
+                        HEIGHT >> 24, HEIGHT >> 16, HEIGHT >> 8,
+                        HEIGHT & 0xFF, 8, 6, 0, 0, 0};
+  write_chunk(file, "IHDR", header, sizeof(header));
+
+  z_stream stream = {0};
+  int result = deflateInit(&stream, 6);
+  assert(result == Z_OK);
+  size_t row_size = WIDTH * 4 + 1;
+  uint8_t *row = malloc(row_size);
+  uint8_t *output = malloc(IDAT_SIZE);
+  assert(row != NULL && output != NULL);
+  stream.next_out = output;
+  stream.avail_out = IDAT_SIZE;
+  uint32_t random = 1;
+  for (uint32_t y = 0; y <= HEIGHT; y++) {
+    int flush = Z_FINISH;
+    if (y < HEIGHT) {
+      row[0] = 1;
+      for (uint32_t i = 1; i < row_size; i++) {
+        random = random * 1103515245 + 12345;
+        /* Differences to the pixel to the left. */
+        row[i] = (i <= 4 ? (y + i * 50) : i % 4 == 0 ? 0 : 1) +
+                 (random >> 29);
+      }
+      stream.next_in = row;
+      stream.avail_in = row_size;
+      flush = flush_rows != 0 && (y + 1) % flush_rows == 0 ? Z_FULL_FLUSH
+                                                           : Z_NO_FLUSH;
+    }
+    do {
+      result = deflate(&stream, flush);
+      assert(result == Z_OK || result == Z_STREAM_END ||
+             result == Z_BUF_ERROR);
+      if (stream.avail_out == 0 || result == Z_STREAM_END) {
+        write_chunk(file, "IDAT", output, IDAT_SIZE - stream.avail_out);
+        stream.next_out = output;
+        stream.avail_out = IDAT_SIZE;
+      }
+    } while (stream.avail_in != 0 ||
+             (flush == Z_FINISH && result != Z_STREAM_END));
+  }
+  deflateEnd(&stream);
+  write_chunk(file, "IEND", NULL, 0);
+  free(row);
+  free(output);
+  fclose(file);
+}
+
+/* Decodes the file in a child process, on the core it runs on if
+ * single_core is set, and returns the seconds it took and the threads of
+ * the pool. */
+static double measure(const char *path, bool single_core, uint32_t *threads) {
+  int fds[2];
+  int error = pipe(fds);
+  assert(error == 0);
+  pid_t child = fork();
+  assert(child != -1);
+  if (child == 0) {
+    close(fds[0]);
+    if (single_core) {
+      cpu_set_t cpu_set;
+      CPU_ZERO(&cpu_set);
+      CPU_SET(sched_getcpu(), &cpu_set);
+      error = sched_setaffinity(0, sizeof(cpu_set), &cpu_set);
+      assert(error == 0);
+    }
+    thread_pool_init();
+    double start = now_seconds();
+    struct png_header header;
+    loader_probe(path, &header);
+    loader_start(false, false, 1);
+    loader_wait_open();
+    while (png_decoding) {
+      struct pollfd pollfd = {loader_get_fd(), POLLIN, 0};
+      poll(&pollfd, 1, -1);
+      uint32_t first_row;
+      uint32_t last_row;
+      loader_poll(&first_row, &last_row);
+    }
+    double result[2] = {now_seconds() - start, thread_pool_size()};
+    ssize_t size = write(fds[1], result, sizeof(result));
+    assert(size == sizeof(result));
+    _exit(0);
+  }
+  close(fds[1]);
+  double result[2];
+  ssize_t size = read(fds[0], result, sizeof(result));
+  assert(size == sizeof(result));
+  close(fds[0]);
+  int status;
+  waitpid(child, &status, 0);
+  assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  *threads = result[1];
+  return result[0];
+}
+
+int main(void) {
+  const char *directory = getenv("TMPDIR");
+  char path[256];
+  snprintf(path, sizeof(path), "%s/bench-parallel-inflate-XXXXXX",
+           directory != NULL ? directory : "/tmp");
+  int fd = mkstemp(path);
+  assert(fd != -1);
+  close(fd);
+  printf("%-24s %12s %12s %8s\n", "image", "one core", "all cores",
+         "speedup");
+  const uint32_t flush_rows[2] = {FLUSH_ROWS, 0};
+  for (uint32_t i = 0; i < 2; i++) {
+    write_png(path, flush_rows[i]);
+    double best[2] = {0, 0};
+    uint32_t threads = 1;
+    for (uint32_t j = 0; j < REPEATS; j++) {
+      for (uint32_t single_core = 0; single_core < 2; single_core++) {
+        double seconds = measure(path, single_core, &threads);
+        if (j == 0 || seconds < best[single_core]) {
+          best[single_core] = seconds;
+        }
+      }
+    }
+    char name[64];
+    snprintf(name, sizeof(name),
+             flush_rows[i] != 0 ? "flushed every %u rows" : "not flushed",
+             flush_rows[i]);
+    char all_cores[32];
+    snprintf(all_cores, sizeof(all_cores), "%.1f ms/%u", best[0] * 1e3,
+             threads);
+    printf("%-24s %9.1f ms %12s %7.2fx\n", name, best[1] * 1e3, all_cores,
+           best[1] / best[0]);
+  }
+  unlink(path);
+  return 0;
+}
@@ -0,0 +1,215 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <loader.h>
+#include <png.h>
+#include <zlib.h>
+
+/* Measures how long it takes until the window can be sized, for PNGs whose
+ * IDAT follows an ancillary chunk of growing size, and for a small and a
+ * large image. loader_probe only reads IHDR, while the viewer used to wait
+ * for png_read_info, which reads every chunk before the first IDAT, as the
+ * loader thread still does before loader_wait_open returns. Then measures
+ * the first loader_poll after that, which the viewer makes before drawing
+ * the first frame, and the time until a row is ready to be drawn. Each
+ * measurement runs in its own process. */
+
+#define REPEATS 3
+#define COPY_SIZE (1 << 20)
+#define IDAT_SIZE (64 << 10)
+
+struct probe_case {
+  uint32_t width;
+  uint32_t height;
+  size_t chunk_size;
+};
+
+/* The large image is stored uncompressed, 256 MiB in IDAT chunks of 64 KiB
+ * like common encoders write. */
+static const struct probe_case cases[] = {{64, 64, 0},
+                                          {64, 64, 1 << 20},
+                                          {64, 64, 64 << 20},
+                                          {64, 64, 512 << 20},
+                                          {8192, 8192, 0}};
+
+static double now_seconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void write_all(FILE *file, const void *data, size_t size) {
+  size_t written = fwrite(data, 1, size, file);
+  assert(written == size);
+}
+
+static void write_uint32(FILE *file, uint32_t value) {
+  uint8_t bytes[4] = {value >> 24, value >> 16, value >> 8, value};
+  write_all(file, bytes, 4);
+}
+
+static void write_chunk(FILE *file, const char *type, const uint8_t *data,
+                        uint32_t size) {
+  write_uint32(file, size);
+  write_all(file, type, 4);
+  uLong crc = crc32(0, (const Bytef *)type, 4);
+  if (size != 0) {
+    write_all(file, data, size);
+    crc = crc32(crc, data, size);
+  }
+  write_uint32(file, crc);
+}
+
+/* Writes an RGBA PNG whose IDAT follows a private chunk of chunk_size zero
+ * bytes. */
+static void write_png(const char *path, const struct probe_case *probe_case) {
+  FILE *file = fopen(path, "wb");
+  assert(file != NULL);
+  write_all(file, "\x89PNG\r\n\x1a\n", 8);
+  uint32_t width = probe_case->width;
+  uint32_t height = probe_case->height;
+  uint8_t header[13] = {width >> 24,  width >> 16,  width >> 8,  width,
+                        height >> 24, height >> 16, height >> 8, height,
+                        8,            6,            0,           0,
+                        0};
+  write_chunk(file, "IHDR", header, sizeof(header));
+  size_t chunk_size = probe_case->chunk_size;
+  if (chunk_size != 0) {
+    uint8_t *zeros = calloc(COPY_SIZE, 1);
+    assert(zeros != NULL);
+    write_uint32(file, chunk_size);
+    write_all(file, "bnCh", 4);
+    uLong crc = crc32(0, (const Bytef *)"bnCh", 4);
+    for (size_t offset = 0; offset < chunk_size; offset += COPY_SIZE) {
+      size_t size =
+          chunk_size - offset < COPY_SIZE ? chunk_size - offset : COPY_SIZE;
+      write_all(file, zeros, size);
+      crc = crc32(crc, zeros, size);
+    }
+    write_uint32(file, crc);
+    free(zeros);
+  }
+  /* Rows of filter type None and transparent pixels, stored. */
+  z_stream stream = {0};
+  int result = deflateInit(&stream, 0);
+  assert(result == Z_OK);
+  size_t row_size = (size_t)width * 4 + 1;
+  uint8_t *row = calloc(row_size, 1);
+  uint8_t *output = malloc(IDAT_SIZE);
+  assert(row != NULL && output != NULL);
+  stream.next_out = output;
+  stream.avail_out = IDAT_SIZE;
+  for (uint32_t y = 0; y <= height; y++) {
+    int flush = y < height ? Z_NO_FLUSH : Z_FINISH;
+    stream.next_in = row;
+    stream.avail_in = y < height ? row_size : 0;
+    do {
+      result = deflate(&stream, flush);
+      assert(result == Z_OK || result == Z_STREAM_END ||
+             result == Z_BUF_ERROR);
+      if (stream.avail_out == 0 || result == Z_STREAM_END) {
+        write_chunk(file, "IDAT", output, IDAT_SIZE - stream.avail_out);
+        stream.next_out = output;
+        stream.avail_out = IDAT_SIZE;
+      }
+    } while (stream.avail_in != 0 ||
+             (flush == Z_FINISH && result != Z_STREAM_END));
+  }
+  deflateEnd(&stream);
+  write_chunk(file, "IEND", NULL, 0);
+  free(row);
+  free(output);
+  fclose(file);
+}
+
+/* Probes the file in a child process and stores the seconds until the
+ * header was known, until the loader opened the file, until the first
+ * loader_poll after that returned, and until the first row was ready. */
+static void measure(const char *path, const struct probe_case *probe_case,
+                    double times[4]) {
+  int fds[2];
+  int error = pipe(fds);
+  assert(error == 0);
+  pid_t child = fork();
+  assert(child != -1);
+  if (child == 0) {
+    close(fds[0]);
+    /* libpng warns about chunks too large to keep, which it skips anyway. */
+    int null_fd = open("/dev/null", O_WRONLY);
+    assert(null_fd != -1);
+    dup2(null_fd, STDERR_FILENO);
+    close(null_fd);
+    double start = now_seconds();
+    struct png_header header;
+    loader_probe(path, &header);
+    double probed = now_seconds();
+    loader_start(false, false, 1);
+    loader_wait_open();
+    double opened = now_seconds();
+    uint32_t first_row;
+    uint32_t last_row;
+    loader_poll(&first_row, &last_row);
+    double polled = now_seconds();
+    while (png_rows_ready == 0) {
+      struct pollfd pollfd = {loader_get_fd(), POLLIN, 0};
+      poll(&pollfd, 1, -1);
+      loader_poll(&first_row, &last_row);
+    }
+    double ready = now_seconds();
+    assert(header.width == probe_case->width &&
+           header.height == probe_case->height);
+    double result[4] = {probed - start, opened - start, polled - start,
+                        ready - start};
+    ssize_t size = write(fds[1], result, sizeof(result));
+    assert(size == sizeof(result));
+    _exit(0);
+  }
+  close(fds[1]);
+  ssize_t size = read(fds[0], times, sizeof(double) * 4);
+  assert(size == sizeof(double) * 4);
+  close(fds[0]);
+  int status;
+  waitpid(child, &status, 0);
+  assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+int main(void) {
+  const char *directory = getenv("TMPDIR");
+  char path[256];
+  snprintf(path, sizeof(path), "%s/bench-probe-XXXXXX",
+           directory != NULL ? directory : "/tmp");
+  int fd = mkstemp(path);
+  assert(fd != -1);
+  close(fd);
+  printf("%-28s %12s %12s %12s %12s\n", "image", "probe", "open",
+         "first poll", "first row");
+  for (size_t i = 0; i < sizeof(cases) / sizeof(*cases); i++) {
+    write_png(path, &cases[i]);
+    double best[4] = {0, 0, 0, 0};
+    for (uint32_t j = 0; j < REPEATS; j++) {
+      double times[4];
+      measure(path, &cases[i], times);
+      for (uint32_t k = 0; k < 4; k++) {
+        if (j == 0 || times[k] < best[k]) {
+          best[k] = times[k];
+        }
+      }
+    }
+    char name[64];
+    snprintf(name, sizeof(name), "%ux%u, %zu MiB chunk", cases[i].width,
+             cases[i].height, cases[i].chunk_size >> 20);
+    printf("%-28s %9.1f us %9.1f ms %9.1f ms %9.1f ms\n", name,
+           best[0] * 1e6, best[1] * 1e3, best[2] * 1e3, best[3] * 1e3);
+  }
+  unlink(path);
+  return 0;
+}
@@ -0,0 +1,165 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include <scale.h>
+#include <thread-pool.h>
+
+/* Renders images scaled up to fill 4K and 8K buffers, like the viewer does
+ * on every resize, and prints the output throughput in gigapixels per
+ * second. The per-pixel loop is the one the viewer had before scale_row,
+ * and the last column splits the rows into bands on the thread pool. */
+
+#define REPEATS 5
+
+static const uint32_t sizes[][2] = {{3840, 2160}, {7680, 4320}};
+static const uint32_t scales[] = {1, 2, 3, 4, 8};
+
+static uint32_t *source;
+static uint32_t source_width;
+static uint32_t source_height;
+
+/* Divides the coordinates for every pixel of the output. */
+static void render_per_pixel(uint32_t *destination, uint32_t width,
+                             uint32_t height, uint32_t scale) {
+  for (uint32_t y = 0; y < height; y++) {
+    for (uint32_t x = 0; x < width; x++) {
+      uint32_t source_y = y / scale;
+      uint32_t source_x = x / scale;
+      uint32_t pixel = 0;
+      if (source_x < source_width && source_y < source_height) {
+        pixel = source[(size_t)source_y * source_width + source_x];
+        uint8_t alpha = pixel >> 24;
+        if (alpha != 0xFF) {
+          uint8_t red = ((pixel >> 16) & 0xFF) * alpha / 0xFF;
+          uint8_t green = ((pixel >> 8) & 0xFF) * alpha / 0xFF;
+          uint8_t blue = (pixel & 0xFF) * alpha / 0xFF;
+          pixel = alpha << 24 | red << 16 | green << 8 | blue;
+        }
+      }
+      destination[(size_t)y * width + x] = pixel;
+    }
+  }
+}
+
+/* Scales every source row of the output rows [y_begin, y_end) once and
+ * copies it for the rows that repeat it. */
+static void render_rows(uint32_t *destination, uint32_t width,
+                        uint32_t y_begin, uint32_t y_end, uint32_t scale) {
+  for (uint32_t y = y_begin; y < y_end; y++) {
+    uint32_t *row = destination + (size_t)y * width;
+    if (y != y_begin && y % scale != 0) {
+      memcpy(row, row - width, width * 4);
+    } else {
+      scale_row(row, source + (size_t)(y / scale) * source_width,
+                source_width, scale);
+    }
+  }
+}
+
+static void render_scaled_rows(uint32_t *destination, uint32_t width,
+                               uint32_t height, uint32_t scale) {
+  render_rows(destination, width, 0, height, scale);
+}
+
+struct band_job {
+  uint32_t *destination;
+  uint32_t width;
+  uint32_t height;
+  uint32_t scale;
+  uint32_t band_height;
+};
+
+static void render_band(void *data, uint32_t band,
+                        __attribute__((unused)) uint32_t thread) {
+  struct band_job *job = data;
+  uint32_t y_begin = band * job->band_height;
+  uint32_t y_end = y_begin + job->band_height < job->height
+                       ? y_begin + job->band_height
+                       : job->height;
+  render_rows(job->destination, job->width, y_begin, y_end, job->scale);
+}
+
+/* Bands like those of the viewer, a few per thread and starting on a source
+ * row. */
+static void render_bands(uint32_t *destination, uint32_t width,
+                         uint32_t height, uint32_t scale) {
+  uint32_t bands = thread_pool_size() * 4;
+  uint32_t band_height = (height + bands - 1) / bands + scale - 1;
+  band_height -= band_height % scale;
+  struct band_job job = {destination, width, height, scale, band_height};
+  thread_pool_run(render_band, &job, (height + band_height - 1) / band_height);
+}
+
+static double now_seconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/* Returns the best throughput of a few runs, the others were disturbed by
+ * something else. */
+static double measure(void (*render)(uint32_t *, uint32_t, uint32_t, uint32_t),
+                      uint32_t *destination, uint32_t width, uint32_t height,
+                      uint32_t scale) {
+  double best = 0;
+  for (uint32_t i = 0; i < REPEATS; i++) {
+    double start = now_seconds();
+    render(destination, width, height, scale);
+    double seconds = now_seconds() - start;
+    double gigapixels = (double)width * height / seconds / 1e9;
+    if (gigapixels > best) {
+      best = gigapixels;
+    }
+  }
+  return best;
+}
+
+int main(void) {
+  scale_init();
+  thread_pool_init();
+  char threads[32];
+  snprintf(threads, sizeof(threads), "%u threads", thread_pool_size());
+  printf("%-10s %5s %12s %12s %12s\n", "output", "scale", "per pixel",
+         "scale_row", threads);
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(*sizes); i++) {
+    uint32_t width = sizes[i][0];
+    uint32_t height = sizes[i][1];
+    /* Prefaulted, so the first run doesn't measure page faults. */
+    uint32_t *destination =
+        mmap(NULL, (size_t)width * height * 4, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    assert(destination != MAP_FAILED);
+    for (size_t j = 0; j < sizeof(scales) / sizeof(*scales); j++) {
+      uint32_t scale = scales[j];
+      source_width = width / scale;
+      source_height = height / scale;
+      source = malloc((size_t)source_width * source_height * 4);
+      assert(source != NULL);
+      /* Opaque, so the per-pixel loop doesn't premultiply. */
+      for (size_t k = 0; k < (size_t)source_width * source_height; k++) {
+        source[k] = 0xFF000000 | (uint32_t)rand();
+      }
+      /* Sizes that aren't a multiple of the scale leave black pixels. */
+      uint32_t scaled_width = source_width * scale;
+      uint32_t scaled_height = source_height * scale;
+      double per_pixel = measure(render_per_pixel, destination, scaled_width,
+                                 scaled_height, scale);
+      double scaled = measure(render_scaled_rows, destination, scaled_width,
+                              scaled_height, scale);
+      double bands = measure(render_bands, destination, scaled_width,
+                             scaled_height, scale);
+      char output[16];
+      snprintf(output, sizeof(output), "%ux%u", width, height);
+      printf("%-10s %5u %9.2f GP/s %9.2f GP/s %9.2f GP/s\n", output, scale,
+             per_pixel, scaled, bands);
+      free(source);
+    }
+    munmap(destination, (size_t)width * height * 4);
+  }
+  return 0;
+}
@@ -0,0 +1,99 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Measures the latency of resizes that render a whole frame into shared
+ * memory, as a window is dragged from 4K to 8K and back. The viewer used to
+ * map the memfd for every frame and sync and unmap it afterwards, buffer.c
+ * keeps a prefaulted mapping until the pool has to grow. No compositor is
+ * involved, so only the client side of a resize is measured. */
+
+#define STEPS 16
+#define REPEATS 3
+
+static double now_seconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void render(uint32_t *pixels, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    pixels[i] = 0xFF000000 | (uint32_t)i;
+  }
+}
+
+static size_t pool_size;
+static uint32_t *pool_pixels;
+
+/* Grows the memfd with ftruncate and maps it for a single frame. */
+static void resize_mapping_per_frame(int fd, size_t size) {
+  if (size > pool_size) {
+    int error = ftruncate(fd, size);
+    assert(error == 0);
+    pool_size = size;
+  }
+  uint32_t *pixels = mmap(NULL, size, PROT_WRITE, MAP_SHARED, fd, 0);
+  assert(pixels != MAP_FAILED);
+  render(pixels, size / 4);
+  msync(pixels, size, MS_SYNC);
+  munmap(pixels, size);
+}
+
+/* Like buffer_create_wayland_buffer: reserves the memory with fallocate and
+ * prefaults a new mapping only when the pool grows. */
+static void resize_persistent_mapping(int fd, size_t size) {
+  if (size > pool_size) {
+    int error = fallocate(fd, 0, 0, size);
+    assert(error == 0);
+    if (pool_pixels != NULL) {
+      munmap(pool_pixels, pool_size);
+    }
+    pool_pixels = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, fd, 0);
+    assert(pool_pixels != MAP_FAILED);
+    pool_size = size;
+  }
+  render(pool_pixels, size / 4);
+}
+
+static void measure(const char *name, void (*resize)(int, size_t)) {
+  double total = 0;
+  double worst = 0;
+  uint32_t resizes = 0;
+  for (uint32_t repeat = 0; repeat < REPEATS; repeat++) {
+    int fd = syscall(SYS_memfd_create, "bench", 0);
+    assert(fd != -1);
+    pool_size = 0;
+    pool_pixels = NULL;
+    for (uint32_t step = 0; step <= STEPS * 2; step++) {
+      uint32_t growth = step <= STEPS ? step : STEPS * 2 - step;
+      size_t width = 3840 + 3840 * growth / STEPS;
+      size_t height = 2160 + 2160 * growth / STEPS;
+      double start = now_seconds();
+      resize(fd, width * height * 4);
+      double seconds = now_seconds() - start;
+      total += seconds;
+      worst = seconds > worst ? seconds : worst;
+      resizes++;
+    }
+    if (pool_pixels != NULL) {
+      munmap(pool_pixels, pool_size);
+    }
+    close(fd);
+  }
+  printf("%-28s %8.2f ms mean %8.2f ms worst\n", name,
+         total / resizes * 1e3, worst * 1e3);
+}
+
+int main(void) {
+  measure("mapping per frame", resize_mapping_per_frame);
+  measure("persistent mapping", resize_persistent_mapping);
+  return 0;
+}
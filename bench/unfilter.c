@@ -0,0 +1,89 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <unfilter.h>
+
+/* Unfilters a 4K image of every filter type, once with the scalar code and
+ * once with the vector instructions that unfilter_select picks, and prints
+ * the throughput in gigabytes of rows per second. Only RGB and RGBA rows
+ * are vectorized, the other pixel sizes are there for comparison. */
+
+#define WIDTH 3840
+#define HEIGHT 2160
+#define REPEATS 5
+
+static const uint32_t pixel_sizes[] = {1, 2, 3, 4, 8};
+static const char *const filter_names[5] = {"None", "Sub", "Up", "Average",
+                                            "Paeth"};
+
+static double now_seconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/* Random filtered rows with the filter type byte in front. */
+static uint8_t *filtered_rows(uint32_t row_size, uint8_t type) {
+  uint8_t *rows = malloc((size_t)(row_size + 1) * HEIGHT);
+  assert(rows != NULL);
+  for (size_t i = 0; i < (size_t)(row_size + 1) * HEIGHT; i++) {
+    rows[i] = i % (row_size + 1) == 0 ? type : (uint8_t)rand();
+  }
+  return rows;
+}
+
+/* Returns the best throughput of a few runs. */
+static double measure(const uint8_t *rows, uint32_t row_size,
+                      uint32_t pixel_size) {
+  double best = 0;
+  for (uint32_t i = 0; i < REPEATS; i++) {
+    struct unfilter unfilter;
+    unfilter_init(&unfilter, row_size, pixel_size, NULL, 0);
+    double start = now_seconds();
+    for (uint32_t y = 0; y < HEIGHT; y++) {
+      unfilter_fill(&unfilter, rows + (size_t)y * (row_size + 1),
+                    row_size + 1);
+      unfilter_next(&unfilter);
+    }
+    double seconds = now_seconds() - start;
+    unfilter_finish(&unfilter);
+    double gigabytes = (double)row_size * HEIGHT / seconds / 1e9;
+    if (gigabytes > best) {
+      best = gigabytes;
+    }
+  }
+  return best;
+}
+
+int main(void) {
+  size_t size_count = sizeof(pixel_sizes) / sizeof(*pixel_sizes);
+  double scalar[sizeof(pixel_sizes) / sizeof(*pixel_sizes)][5];
+  uint8_t *rows[sizeof(pixel_sizes) / sizeof(*pixel_sizes)][5];
+  for (size_t i = 0; i < size_count; i++) {
+    for (uint8_t type = 0; type < 5; type++) {
+      rows[i][type] = filtered_rows(WIDTH * pixel_sizes[i], type);
+      scalar[i][type] =
+          measure(rows[i][type], WIDTH * pixel_sizes[i], pixel_sizes[i]);
+    }
+  }
+  /* Until now every row was unfiltered by the scalar code. */
+  unfilter_select();
+  printf("%-6s %-8s %12s %12s\n", "pixel", "filter", "scalar", "vectorized");
+  for (size_t i = 0; i < size_count; i++) {
+    for (uint8_t type = 0; type < 5; type++) {
+      char vectorized[16] = "-";
+      if (unfilter_is_vectorized(pixel_sizes[i])) {
+        snprintf(vectorized, sizeof(vectorized), "%7.2f GB/s",
+                 measure(rows[i][type], WIDTH * pixel_sizes[i],
+                         pixel_sizes[i]));
+      }
+      printf("%-6u %-8s %7.2f GB/s %12s\n", pixel_sizes[i],
+             filter_names[type], scalar[i][type], vectorized);
+      free(rows[i][type]);
+    }
+  }
+  return 0;
+}
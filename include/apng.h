@@ -0,0 +1,41 @@
+#ifndef APNG_H
+#define APNG_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Converts an unfiltered row of width pixels, in the format of the PNG, to
+ * premultiplied ARGB at destination. */
+typedef void (*apng_store_function)(uint32_t *destination, const uint8_t *row,
+                                    uint32_t width);
+
+/* Reads the chunks of the mapped file before its first IDAT, which has to
+ * stay mapped while it plays. Frames are width x height pixels with rows
+ * stride pixels apart, and bits_per_pixel bits per pixel in the file.
+ * Returns false if the file is not animated. */
+bool apng_init(const uint8_t *file_data, size_t file_size, uint32_t width,
+               uint32_t height, uint32_t stride, uint32_t bits_per_pixel,
+               apng_store_function store);
+
+/* Starts finding the frames after the image, and decoding and compositing
+ * them ahead of time, on a background thread. No frame is shown if they
+ * can't be played. */
+void apng_start(void);
+
+/* File descriptor that becomes readable whenever a frame was decoded. */
+int apng_get_fd(void);
+
+/* Advances to the frame that is due now, skipping frames that are overdue.
+ * Stores the frame to show and returns true if it changed. The frame stays
+ * valid until the next call. */
+bool apng_update(const uint32_t **frame);
+
+/* Milliseconds until the next frame is due, or -1 if there is none. */
+int apng_timeout(void);
+
+/* In debug builds, prints how many frames were shown, dropped and late,
+ * unless it did so already when the last frame was shown. */
+void apng_report(void);
+
+#endif
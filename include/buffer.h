@@ -0,0 +1,60 @@
+#ifndef BUFFER_H
+#define BUFFER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <wayland-client.h>
+
+struct buffer {
+  struct wl_buffer *wayland_buffer;
+  struct wl_shm_pool *wayland_shm_pool;
+  int fd;
+  size_t pool_size;
+  /* Mapping of the whole pool, kept until the pool grows. */
+  uint32_t *pixel_data;
+  int32_t width;
+  int32_t height;
+  uint32_t format;
+  /* Attached and not released by the compositor yet. */
+  bool busy;
+
+  /* Window size the pixels were rendered for, the mipmap level they show
+   * and whether it was resampled, the loader progress they include, the PNG
+   * rows that the level rows they include were built from, and the
+   * animation frame they show. Maintained by the renderer, reset when the
+   * size changes. */
+  int32_t content_width;
+  int32_t content_height;
+  uint32_t content_level;
+  bool content_resample;
+  uint64_t content_progress;
+  uint32_t content_level_rows;
+  uint64_t content_frame;
+};
+
+void buffer_init(struct wl_shm *wayland_shm);
+
+/* Returns an idle buffer of the given size and format, preferring one that
+ * already had this size so its content can be updated instead of redrawn.
+ * Returns NULL if all buffers are busy, the caller should retry after the
+ * next release. */
+struct buffer *buffer_acquire(int32_t width, int32_t height, uint32_t format);
+
+/* Returns a buffer for pixels that already are in the shared memory file fd,
+ * with rows stride bytes apart. The buffer may be attached again while
+ * the compositor still uses it, as the pixels are changed in place anyway.
+ * Frees the idle buffers of buffer_acquire. */
+struct buffer *buffer_wrap(int fd, uint32_t *pixel_data, int32_t width,
+                           int32_t height, int32_t stride, uint32_t format);
+
+/* Creates a 1x1 XRGB buffer that is never written again, so it can stay
+ * attached or be attached to any number of surfaces without waiting for a
+ * release. */
+struct wl_buffer *buffer_create_single_pixel(uint32_t pixel);
+
+/* Attaches the buffer and marks it busy until the compositor releases it. */
+void buffer_attach(struct buffer *buffer, struct wl_surface *wayland_surface);
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef DAMAGE_H
+#define DAMAGE_H
+
+#include <stdint.h>
+
+#define DAMAGE_MAX_RANGES 4
+
+/* Rows of the PNG that changed since the last commit, as sorted and disjoint
+ * ranges [first_row, last_row). The spare range is only used while adding. */
+struct damage {
+  uint32_t count;
+  struct {
+    uint32_t first_row;
+    uint32_t last_row;
+  } ranges[DAMAGE_MAX_RANGES + 1];
+};
+
+/* Adds the rows [first_row, last_row). Once there are too many ranges, the
+ * two closest ones are merged, damaging the rows between them as well. */
+void damage_add(struct damage *damage, uint32_t first_row, uint32_t last_row);
+
+void damage_clear(struct damage *damage);
+
+#endif
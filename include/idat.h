@@ -0,0 +1,43 @@
+#ifndef IDAT_H
+#define IDAT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <zlib.h>
+
+/* Data of an IDAT chunk in the mapped file, and where it starts in the zlib
+ * stream that all of them form. */
+struct idat_chunk {
+  const uint8_t *data;
+  size_t size;
+  size_t stream_offset;
+};
+
+/* Starts reading the IDAT chunks of the mapped file, the first of which has
+ * its data at offset. The chunks after it are only found as the stream is
+ * read, from any thread. */
+void idat_init(const uint8_t *file_data, size_t file_size, size_t offset);
+
+/* Size that the zlib stream can't exceed, known without reading it. */
+size_t idat_size_bound(void);
+
+/* Returns the byte at offset in the zlib stream. */
+uint8_t idat_byte(size_t offset);
+
+/* Reads the zlib stream from offset up to end, or its end if that comes
+ * first, a chunk at a time. */
+struct idat_reader {
+  uint32_t chunk;
+  size_t offset;
+  size_t end;
+};
+
+void idat_reader_init(struct idat_reader *reader, size_t offset, size_t end);
+
+/* Points the input of stream at the next data of the reader, returns false
+ * at the end. */
+bool idat_read(struct idat_reader *reader, z_stream *stream);
+
+#endif
@@ -0,0 +1,96 @@
+#ifndef LOADER_H
+#define LOADER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Set by loader_probe and reduced by loader_crop or loader_start, except
+ * for png_stride, png_pixels, png_pixels_fd, png_indices and png_palette,
+ * which are set once loader_wait_open returns. Rows of png_pixels are
+ * written by the decoding thread and may only be read once loader_poll
+ * reported them as ready. The pixels are premultiplied ARGB in native byte
+ * order, and rows start png_stride pixels apart on 64 byte boundaries. */
+extern uint32_t png_width;
+extern uint32_t png_height;
+extern uint32_t png_stride;
+extern uint32_t *png_pixels;
+/* Shared memory file holding png_pixels, or -1 if they are private. Its rows
+ * are laid out like a wl_shm buffer with a stride of png_stride * 4. */
+extern int png_pixels_fd;
+/* Palette and gray images are stored in png_indices instead of png_pixels,
+ * as one byte per pixel that selects a premultiplied pixel of png_palette.
+ * Rows are laid out like those of png_pixels. */
+extern uint8_t *png_indices;
+extern uint32_t png_palette[256];
+/* 1 if rows are stored as indices, otherwise 4. */
+extern uint32_t png_pixel_size;
+
+/* Snapshot of the decoding progress, updated by loader_poll. png_progress
+ * counts the decoded rows over all passes. png_opaque is cleared once a
+ * translucent pixel was decoded. */
+extern uint64_t png_progress;
+extern uint32_t png_rows_ready;
+extern bool png_decoding;
+extern bool png_opaque;
+
+/* IHDR of the PNG, enough to size the window. */
+struct png_header {
+  uint32_t width;
+  uint32_t height;
+  uint8_t bit_depth;
+  uint8_t color_type;
+  bool interlaced;
+};
+
+/* Opens the file at path, or stdin for "-", and reads only its signature
+ * and IHDR chunk, which takes the same time for any size of file. */
+void loader_probe(const char *path, struct png_header *header);
+
+/* Restricts decoding to the width x height pixels from x, y on, clipped to
+ * the image, which then become png_width x png_height. Rows above them are
+ * only decoded as far as the rows below depend on them, and decoding stops
+ * after their last row unless the file is interlaced. Must come before
+ * loader_start, and doesn't combine with a reduction. */
+void loader_crop(uint32_t x, uint32_t y, uint32_t width, uint32_t height);
+
+/* Returns the smallest reduction for loader_start that keeps the decoded
+ * image within budget bytes, or 1 if it fits at full size. A reduced image
+ * is also made small enough to fit into max_width x max_height pixels. */
+uint32_t loader_pick_reduction(const struct png_header *header, size_t budget,
+                               uint32_t max_width, uint32_t max_height);
+
+/* Starts a background thread that reads the rest of the header, allocates
+ * png_pixels, in shared memory that can back a wl_shm pool if share_pixels
+ * is set, or png_indices, and then decodes the pixel data. With index_rows,
+ * non-interlaced files that can be mapped leave both NULL and only keep
+ * checkpoints to decode bands of rows on demand instead, unless
+ * share_pixels is set. With a reduction above 1, every block of reduction x
+ * reduction pixels is averaged into one pixel of png_pixels as the rows are
+ * decoded, so the full image is never kept, and png_width and png_height
+ * shrink accordingly before this returns. */
+void loader_start(bool share_pixels, bool index_rows, uint32_t reduction);
+
+/* Waits until the rows are allocated. */
+void loader_wait_open(void);
+
+/* File descriptor that becomes readable whenever new rows were decoded. */
+int loader_get_fd(void);
+
+/* Returns true if rows were decoded since the last call and stores the rows
+ * that changed as [first_row, last_row). */
+bool loader_poll(uint32_t *first_row, uint32_t *last_row);
+
+/* Returns the ready row y in the layout of png_pixels or png_indices, and
+ * stores the end of the rows following it that loader_unlock_rows(y) keeps
+ * valid. */
+const void *loader_lock_rows(uint32_t y, uint32_t *end_row);
+
+void loader_unlock_rows(uint32_t y);
+
+/* Stores the rows that changed between an earlier png_progress and the
+ * current one as [first_row, last_row). */
+void loader_changed_rows(uint64_t progress, uint32_t *first_row,
+                         uint32_t *last_row);
+
+#endif
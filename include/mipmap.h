@@ -0,0 +1,55 @@
+#ifndef MIPMAP_H
+#define MIPMAP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Reads row y of the image as premultiplied ARGB into destination. */
+typedef void (*mipmap_read_function)(uint32_t *destination, uint32_t y);
+
+/* Prepares the levels of an image of width x height pixels whose rows are
+ * read with read. Level 0 is the image itself, and every further level
+ * averages blocks of 2x2 pixels of the one before in linear light, down to
+ * a single pixel. Levels take no memory until they are built. */
+void mipmap_init(uint32_t width, uint32_t height, mipmap_read_function read);
+
+uint32_t mipmap_level_count(void);
+uint32_t mipmap_width(uint32_t level);
+uint32_t mipmap_height(uint32_t level);
+
+/* Marks the rows of the image from first_row on as changed, along with the
+ * rows of every level that were built from them. */
+void mipmap_invalidate(uint32_t first_row);
+
+/* Builds the rows of levels 1 up to last_level that the first ready_rows
+ * rows of the image allow, on the thread pool, and stops once budget
+ * nanoseconds have passed. Returns true if any rows were built, and stores
+ * whether rows are left that could be built now. */
+bool mipmap_update(uint32_t last_level, uint32_t ready_rows, uint64_t budget,
+                   bool *pending);
+
+/* Rows [0, mipmap_rows_ready(level)) of a level above 0 are built and can be
+ * read with mipmap_row. */
+uint32_t mipmap_rows_ready(uint32_t level);
+const uint32_t *mipmap_row(uint32_t level, uint32_t y);
+
+/* Prepares mipmap_resample_row for showing the image at width x height
+ * pixels, smaller than the image, and returns the highest level that it
+ * reads, which has to be built like the ones below it. */
+uint32_t mipmap_set_resample_size(uint32_t width, uint32_t height,
+                                  bool trilinear);
+
+/* Renders row y of the image at the size of mipmap_set_resample_size by
+ * sampling the smallest level that is larger bilinearly, or with trilinear
+ * by blending bilinear samples of the two levels around its scale. Returns
+ * false, without rendering, if the rows it needs are not built yet. thread
+ * is that of the thread pool. */
+bool mipmap_resample_row(uint32_t *destination, uint32_t y, uint32_t thread);
+
+/* Stores the rows [first_y, last_y) of the image at the size of
+ * mipmap_set_resample_size that mipmap_resample_row renders from level rows
+ * built from rows [first_row, last_row) of the image. */
+void mipmap_resample_rows(uint32_t first_row, uint32_t last_row,
+                          uint32_t *first_y, uint32_t *last_y);
+
+#endif
@@ -0,0 +1,21 @@
+#ifndef PARALLEL_INFLATE_H
+#define PARALLEL_INFLATE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Returns false if the zlib stream in the IDAT chunks that idat_init
+ * started reading is too short to be worth splitting, or there is only one
+ * thread. The stream inflates to at most size bytes. */
+bool parallel_inflate_init(size_t size);
+
+/* Inflates the stream on this thread and calls output with the inflated
+ * bytes in stream order, until it returns false. Meanwhile the other
+ * threads look ahead for the points where the stream was fully flushed,
+ * which start segments that can be inflated independently, and inflate
+ * them, so that this thread can skip them. Segments that turn out to depend
+ * on the previous one are inflated serially instead. */
+void parallel_inflate(bool (*output)(const uint8_t *data, size_t size));
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef ROW_INDEX_H
+#define ROW_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Converts an unfiltered row, in the format of the PNG, to the stored format
+ * at destination. */
+typedef void (*row_index_store_function)(void *destination,
+                                         const uint8_t *row);
+
+/* Prepares decoding the rows of a non-interlaced PNG from the IDAT chunks
+ * that idat_init started reading. Rows are row_size bytes before storing,
+ * with pixels of pixel_size bytes for unfiltering, and stored_row_size bytes
+ * after. */
+void row_index_init(uint32_t height, uint32_t row_size, uint32_t pixel_size,
+                    uint32_t stored_row_size, row_index_store_function store);
+
+/* Inflates the image once, recording a checkpoint for every band of rows,
+ * and calls row_decoded with the number of rows stored so far after each
+ * of them. */
+void row_index_build(void (*row_decoded)(uint32_t rows));
+
+/* Returns the stored row y, decoding its band from the checkpoint if it is
+ * not cached, and stores the end of the rows that follow it in the same
+ * band. The band stays cached until row_index_unlock(y). */
+const uint8_t *row_index_lock(uint32_t y, uint32_t *end_row);
+
+void row_index_unlock(uint32_t y);
+
+#endif
@@ -0,0 +1,18 @@
+#ifndef SCALE_H
+#define SCALE_H
+
+#include <stdint.h>
+
+/* Selects the fastest scale_row implementation supported by the CPU. */
+void scale_init(void);
+
+/* Writes each of the width pixels of source scale times to destination. */
+void scale_row(uint32_t *destination, const uint32_t *source, uint32_t width,
+               uint32_t scale);
+
+/* Like scale_row, but looks each pixel up in palette. */
+void scale_row_indexed(uint32_t *destination, const uint8_t *source,
+                       const uint32_t *palette, uint32_t width,
+                       uint32_t scale);
+
+#endif
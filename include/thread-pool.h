@@ -0,0 +1,20 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <stdint.h>
+
+/* Starts one worker thread per core available to the process, minus the
+ * calling thread which takes part in thread_pool_run. */
+void thread_pool_init(void);
+
+/* Number of threads, including the calling thread, that run tasks. */
+uint32_t thread_pool_size(void);
+
+/* Calls function(data, task, thread) for every task in [0, tasks) on the
+ * pool and returns once all of them finished. thread is below
+ * thread_pool_size() and unique among the concurrently running calls. */
+void thread_pool_run(void (*function)(void *data, uint32_t task,
+                                      uint32_t thread),
+                     void *data, uint32_t tasks);
+
+#endif
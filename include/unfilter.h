@@ -0,0 +1,48 @@
+#ifndef UNFILTER_H
+#define UNFILTER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Reassembles the rows of a non-interlaced PNG from the inflated bytes. */
+struct unfilter {
+  /* Filtered row being inflated and the unfiltered row before it, both
+   * with the filter type byte in front. */
+  uint8_t *current;
+  uint8_t *previous;
+  uint32_t filled;
+  uint32_t y;
+  uint32_t row_size;
+  uint32_t pixel_size;
+};
+
+/* Selects the fastest unfiltering supported by the CPU. */
+void unfilter_select(void);
+
+/* Whether rows with pixels of pixel_size bytes are unfiltered with vector
+ * instructions, and faster than libpng does. */
+bool unfilter_is_vectorized(uint32_t pixel_size);
+
+/* Starts at row y with rows of row_size bytes and pixels of pixel_size bytes,
+ * which is 1 for pixels of less than 8 bits. previous is the row before y,
+ * with its filter type byte, or NULL for the first row. */
+void unfilter_init(struct unfilter *unfilter, uint32_t row_size,
+                   uint32_t pixel_size, const uint8_t *previous, uint32_t y);
+
+void unfilter_finish(struct unfilter *unfilter);
+
+/* Copies bytes to the current row until it is complete, and returns how
+ * many were used. */
+size_t unfilter_fill(struct unfilter *unfilter, const uint8_t *data,
+                     size_t size);
+
+static inline bool unfilter_complete(const struct unfilter *unfilter) {
+  return unfilter->filled == unfilter->row_size + 1;
+}
+
+/* Unfilters the complete current row, which becomes the previous one, and
+ * returns its pixels. */
+const uint8_t *unfilter_next(struct unfilter *unfilter);
+
+#endif
@@ -0,0 +1,517 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <apng.h>
+#include <idat.h>
+#include <unfilter.h>
+#include <zlib.h>
+
+/* Composited frames held at a time, the one shown and those decoded ahead
+ * of it. */
+#define RING_SIZE 4
+#define OUTPUT_SIZE (64 << 10)
+
+enum dispose_op { DISPOSE_NONE, DISPOSE_BACKGROUND, DISPOSE_PREVIOUS };
+enum blend_op { BLEND_SOURCE, BLEND_OVER };
+
+/* An fcTL chunk and the IDAT or fdAT chunks holding its image. */
+struct frame {
+  uint32_t width;
+  uint32_t height;
+  uint32_t x;
+  uint32_t y;
+  uint64_t delay;
+  uint8_t dispose;
+  uint8_t blend;
+  struct idat_chunk *chunks;
+  uint32_t chunk_count;
+};
+
+static const uint8_t *file_data;
+static size_t file_size;
+/* Offset of the first IDAT chunk, where the frames after the image are
+ * looked for once the animation starts. */
+static size_t idat_offset;
+static bool animated = false;
+static struct frame *frames = NULL;
+static uint32_t frame_count = 0;
+/* 0 plays forever. */
+static uint32_t play_count;
+static uint32_t canvas_width;
+static uint32_t canvas_height;
+static uint32_t canvas_stride;
+static uint32_t frame_bits_per_pixel;
+static apng_store_function frame_store;
+
+struct slot {
+  uint32_t *pixels;
+  uint64_t delay;
+};
+
+static struct slot ring[RING_SIZE];
+static pthread_mutex_t ring_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ring_changed = PTHREAD_COND_INITIALIZER;
+/* Frames put into the ring and the one shown, counted over all plays. Frame
+ * n is in ring[n % RING_SIZE]. */
+static uint64_t produced = 0;
+static uint64_t shown = 0;
+static bool showing = false;
+/* Set after the last frame of the last play. */
+static bool finished = false;
+/* The next frame was due before it was decoded. */
+static bool stalled = false;
+/* Time the next frame is due, in nanoseconds. */
+static uint64_t due;
+static uint32_t dropped_frames = 0;
+static uint32_t late_frames = 0;
+static bool reported = false;
+static int apng_fd = -1;
+
+static uint32_t read_be32(const uint8_t *data) {
+  return (uint32_t)data[0] << 24 | data[1] << 16 | data[2] << 8 | data[3];
+}
+
+static uint32_t read_be16(const uint8_t *data) {
+  return (uint32_t)data[0] << 8 | data[1];
+}
+
+static uint64_t now_nanoseconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void add_chunk(struct frame *frame, const uint8_t *data, size_t size) {
+  frame->chunks = realloc(frame->chunks,
+                          (frame->chunk_count + 1) * sizeof(*frame->chunks));
+  assert(frame->chunks != NULL);
+  struct idat_chunk *chunk = &frame->chunks[frame->chunk_count];
+  chunk->data = data;
+  chunk->size = size;
+  chunk->stream_offset =
+      frame->chunk_count == 0 ? 0 : chunk[-1].stream_offset + chunk[-1].size;
+  frame->chunk_count++;
+}
+
+/* Reads an fcTL chunk, returns false if the frame doesn't fit. */
+static bool add_frame(const uint8_t *data) {
+  frames = realloc(frames, (frame_count + 1) * sizeof(*frames));
+  assert(frames != NULL);
+  struct frame *frame = &frames[frame_count];
+  memset(frame, 0, sizeof(*frame));
+  frame->width = read_be32(data + 4);
+  frame->height = read_be32(data + 8);
+  frame->x = read_be32(data + 12);
+  frame->y = read_be32(data + 16);
+  uint64_t delay_numerator = read_be16(data + 20);
+  uint64_t delay_denominator = read_be16(data + 22);
+  if (delay_denominator == 0) {
+    delay_denominator = 100;
+  }
+  frame->delay = delay_numerator * 1000000000 / delay_denominator;
+  /* Like browsers do, as such delays are meant as a default rather than
+   * as fast as possible. */
+  if (frame->delay <= 10000000) {
+    frame->delay = 100000000;
+  }
+  frame->dispose = data[24];
+  frame->blend = data[25];
+  frame_count++;
+  return frame->width != 0 && frame->height != 0 &&
+         frame->x <= canvas_width && frame->width <= canvas_width - frame->x &&
+         frame->y <= canvas_height &&
+         frame->height <= canvas_height - frame->y &&
+         frame->dispose <= DISPOSE_PREVIOUS && frame->blend <= BLEND_OVER;
+}
+
+/* Reads the chunks from *offset on, up to the first IDAT chunk if to_idat
+ * is set or to IEND otherwise, and leaves *offset at the chunk it stopped
+ * at. An fcTL before the first IDAT makes the image the first frame,
+ * otherwise it is not part of the animation. Returns false if a frame
+ * doesn't fit. */
+static bool read_chunks(size_t *offset, bool to_idat) {
+  bool valid = true;
+  while (*offset + 12 <= file_size && valid) {
+    size_t size = read_be32(file_data + *offset);
+    if (size > file_size - *offset - 12) {
+      break;
+    }
+    const uint8_t *type = file_data + *offset + 4;
+    const uint8_t *data = file_data + *offset + 8;
+    if (memcmp(type, "acTL", 4) == 0 && size >= 8) {
+      animated = true;
+      play_count = read_be32(data + 4);
+    } else if (memcmp(type, "fcTL", 4) == 0 && size >= 26 && animated) {
+      valid = add_frame(data);
+    } else if (memcmp(type, "IDAT", 4) == 0 && to_idat) {
+      break;
+    } else if (memcmp(type, "IDAT", 4) == 0 && frame_count != 0) {
+      add_chunk(&frames[frame_count - 1], data, size);
+    } else if (memcmp(type, "fdAT", 4) == 0 && size >= 4 &&
+               frame_count != 0) {
+      /* The data follows a sequence number. */
+      add_chunk(&frames[frame_count - 1], data + 4, size - 4);
+    } else if (memcmp(type, "IEND", 4) == 0) {
+      break;
+    }
+    *offset += size + 12;
+  }
+  return valid;
+}
+
+static void free_frames(void) {
+  for (uint32_t i = 0; i < frame_count; i++) {
+    free(frames[i].chunks);
+  }
+  free(frames);
+  frames = NULL;
+  frame_count = 0;
+}
+
+bool apng_init(const uint8_t *data, size_t size, uint32_t width,
+               uint32_t height, uint32_t stride, uint32_t bits_per_pixel,
+               apng_store_function store) {
+  file_data = data;
+  file_size = size;
+  canvas_width = width;
+  canvas_height = height;
+  canvas_stride = stride;
+  frame_bits_per_pixel = bits_per_pixel;
+  frame_store = store;
+
+  /* acTL has to come before the first IDAT, and libpng already read the
+   * chunks up to it, so the rest of the file is only read by the producer
+   * if there is an animation. */
+  idat_offset = 8;
+  bool valid = read_chunks(&idat_offset, true);
+  if (!animated || !valid) {
+    free_frames();
+#ifdef DEBUG
+    if (animated) {
+      fwrite("Could not play the animation\n", 29, 1, stderr);
+    }
+#endif
+    return false;
+  }
+  apng_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  assert(apng_fd != -1);
+  return true;
+}
+
+/* Finds the frames after the image, returns false if they can't be played.
+ */
+static bool find_frames(void) {
+  size_t offset = idat_offset;
+  bool valid = read_chunks(&offset, false);
+  for (uint32_t i = 0; i < frame_count; i++) {
+    valid = valid && frames[i].chunk_count != 0;
+  }
+  if (!valid || frame_count < 2) {
+    free_frames();
+#ifdef DEBUG
+    fwrite("Could not play the animation\n", 29, 1, stderr);
+#endif
+    return false;
+  }
+  return true;
+}
+
+/* x / 255 for x <= 255 * 255, without the division. */
+static inline uint32_t divide_by_255(uint32_t x) {
+  return (x + 1 + (x >> 8)) >> 8;
+}
+
+/* Premultiplied source over destination. */
+static inline uint32_t blend_over(uint32_t source, uint32_t destination) {
+  uint32_t alpha = source >> 24;
+  if (alpha == 0xFF) {
+    return source;
+  }
+  if (alpha == 0) {
+    return destination;
+  }
+  uint32_t result = 0;
+  for (uint32_t shift = 0; shift < 32; shift += 8) {
+    uint32_t channel = divide_by_255(((destination >> shift) & 0xFF) *
+                                     (255 - alpha)) +
+                       ((source >> shift) & 0xFF);
+    result |= channel << shift;
+  }
+  return result;
+}
+
+/* Inflates and unfilters the image of frame, and blends it into canvas.
+ * Returns false if its data is corrupt, which may leave some of its rows
+ * drawn. */
+static bool draw_frame(const struct frame *frame, uint32_t *canvas,
+                       uint32_t *row_pixels, uint8_t *output) {
+  uint32_t row_size =
+      ((uint64_t)frame->width * frame_bits_per_pixel + 7) / 8;
+  uint32_t pixel_size =
+      frame_bits_per_pixel >= 8 ? frame_bits_per_pixel / 8 : 1;
+  struct unfilter rows;
+  unfilter_init(&rows, row_size, pixel_size, NULL, 0);
+  z_stream stream = {0};
+  int result = inflateInit(&stream);
+  assert(result == Z_OK);
+  bool valid = true;
+  for (uint32_t i = 0;
+       i < frame->chunk_count && result != Z_STREAM_END && valid; i++) {
+    stream.next_in = (Bytef *)frame->chunks[i].data;
+    stream.avail_in = frame->chunks[i].size;
+    do {
+      stream.next_out = output;
+      stream.avail_out = OUTPUT_SIZE;
+      result = inflate(&stream, Z_NO_FLUSH);
+      valid = result == Z_OK || result == Z_STREAM_END ||
+              result == Z_BUF_ERROR;
+      const uint8_t *data = output;
+      size_t size = stream.next_out - output;
+      while (valid && size != 0 && rows.y < frame->height) {
+        size_t used = unfilter_fill(&rows, data, size);
+        data += used;
+        size -= used;
+        /* Unknown filter types would trip the asserts of unfilter_next. */
+        if (unfilter_complete(&rows) && rows.current[0] > 4) {
+          valid = false;
+        } else if (unfilter_complete(&rows)) {
+          uint32_t y = frame->y + rows.y;
+          frame_store(row_pixels, unfilter_next(&rows), frame->width);
+          uint32_t *destination =
+              canvas + (size_t)y * canvas_stride + frame->x;
+          if (frame->blend == BLEND_SOURCE) {
+            memcpy(destination, row_pixels, frame->width * 4);
+          } else {
+            for (uint32_t x = 0; x < frame->width; x++) {
+              destination[x] = blend_over(row_pixels[x], destination[x]);
+            }
+          }
+        }
+      }
+    } while (valid && stream.avail_out == 0 && result != Z_STREAM_END);
+  }
+  inflateEnd(&stream);
+  unfilter_finish(&rows);
+  return valid && rows.y == frame->height;
+}
+
+/* Copies the area of frame between canvas and the packed rows of area. */
+static void copy_area(const struct frame *frame, uint32_t *canvas,
+                      uint32_t *area, bool to_area) {
+  for (uint32_t y = 0; y < frame->height; y++) {
+    uint32_t *canvas_row =
+        canvas + (size_t)(frame->y + y) * canvas_stride + frame->x;
+    uint32_t *area_row = area + (size_t)y * frame->width;
+    if (to_area) {
+      memcpy(area_row, canvas_row, frame->width * 4);
+    } else {
+      memcpy(canvas_row, area_row, frame->width * 4);
+    }
+  }
+}
+
+static void notify(void) {
+  uint64_t value = 1;
+  ssize_t size = write(apng_fd, &value, sizeof(value));
+  assert(size == sizeof(value));
+}
+
+static void *producer_thread(__attribute__((unused)) void *data) {
+  if (!find_frames()) {
+    pthread_mutex_lock(&ring_mutex);
+    finished = true;
+    pthread_mutex_unlock(&ring_mutex);
+    return NULL;
+  }
+  size_t frame_size = (size_t)canvas_stride * canvas_height;
+  uint32_t *canvas = malloc(frame_size * 4);
+  assert(canvas != NULL);
+  /* The area of a DISPOSE_PREVIOUS frame before it was drawn. */
+  uint32_t *previous = malloc((size_t)canvas_width * canvas_height * 4);
+  assert(previous != NULL);
+  uint32_t *row_pixels = malloc(canvas_width * 4);
+  assert(row_pixels != NULL);
+  uint8_t *output = malloc(OUTPUT_SIZE);
+  assert(output != NULL);
+
+  /* A corrupt frame stops the animation at the last frame before it. */
+  bool valid = true;
+  for (uint32_t play = 0; (play_count == 0 || play < play_count) && valid;
+       play++) {
+    for (uint32_t i = 0; i < frame_count && valid; i++) {
+      const struct frame *frame = &frames[i];
+      uint8_t dispose = frame->dispose;
+      if (i == 0) {
+        /* Every play starts from a transparent canvas. */
+        memset(canvas, 0, frame_size * 4);
+        if (dispose == DISPOSE_PREVIOUS) {
+          dispose = DISPOSE_BACKGROUND;
+        }
+      }
+      if (dispose == DISPOSE_PREVIOUS) {
+        copy_area(frame, canvas, previous, true);
+      }
+      valid = draw_frame(frame, canvas, row_pixels, output);
+      if (!valid) {
+#ifdef DEBUG
+        fprintf(stderr, "Stopped the animation at corrupt frame %u\n",
+                i + 1);
+#endif
+        break;
+      }
+
+      pthread_mutex_lock(&ring_mutex);
+      while (produced >= (showing ? shown : 0) + RING_SIZE) {
+        pthread_cond_wait(&ring_changed, &ring_mutex);
+      }
+      struct slot *slot = &ring[produced % RING_SIZE];
+      pthread_mutex_unlock(&ring_mutex);
+
+      if (slot->pixels == NULL) {
+        slot->pixels = malloc(frame_size * 4);
+        assert(slot->pixels != NULL);
+      }
+      memcpy(slot->pixels, canvas, frame_size * 4);
+      slot->delay = frame->delay;
+      pthread_mutex_lock(&ring_mutex);
+      produced++;
+      pthread_mutex_unlock(&ring_mutex);
+      notify();
+
+      if (dispose == DISPOSE_BACKGROUND) {
+        for (uint32_t y = 0; y < frame->height; y++) {
+          memset(canvas + (size_t)(frame->y + y) * canvas_stride + frame->x,
+                 0, frame->width * 4);
+        }
+      } else if (dispose == DISPOSE_PREVIOUS) {
+        copy_area(frame, canvas, previous, false);
+      }
+    }
+  }
+  pthread_mutex_lock(&ring_mutex);
+  finished = true;
+  pthread_mutex_unlock(&ring_mutex);
+
+  free(output);
+  free(row_pixels);
+  free(previous);
+  free(canvas);
+  return NULL;
+}
+
+/* Called with ring_mutex held. */
+static void report(void) {
+  if (!showing || reported) {
+    return;
+  }
+  reported = true;
+#ifdef DEBUG
+  fprintf(stderr, "Played %lu animation frames, %u dropped and %u late\n",
+          (unsigned long)shown + 1, dropped_frames, late_frames);
+#endif
+}
+
+void apng_start(void) {
+  pthread_t thread;
+  int error = pthread_create(&thread, NULL, producer_thread, NULL);
+  assert(error == 0);
+  pthread_detach(thread);
+}
+
+int apng_get_fd(void) { return apng_fd; }
+
+bool apng_update(const uint32_t **frame) {
+  if (apng_fd == -1) {
+    return false;
+  }
+  uint64_t value;
+  ssize_t size = read(apng_fd, &value, sizeof(value));
+  assert(size == sizeof(value) || size == -1);
+
+  uint64_t now = now_nanoseconds();
+  bool changed = false;
+  uint32_t skipped = 0;
+  pthread_mutex_lock(&ring_mutex);
+  if (!showing) {
+    if (produced != 0) {
+      showing = true;
+      due = now + ring[0].delay;
+      changed = true;
+    }
+  } else {
+    while (now >= due && shown + 1 < produced) {
+      shown++;
+      skipped++;
+      changed = true;
+      if (stalled) {
+        /* Frames that were late are shown for their whole delay. */
+        stalled = false;
+        due = now + ring[shown % RING_SIZE].delay;
+      } else {
+        due += ring[shown % RING_SIZE].delay;
+      }
+    }
+    if (now >= due && shown + 1 == produced && !finished && !stalled) {
+      stalled = true;
+      late_frames++;
+#ifdef DEBUG
+      fprintf(stderr, "Animation frame %lu is late, %u so far\n",
+              (unsigned long)produced, late_frames);
+#endif
+    }
+  }
+  if (skipped > 1) {
+    dropped_frames += skipped - 1;
+  }
+  if (changed) {
+    pthread_cond_broadcast(&ring_changed);
+  }
+  *frame = showing ? ring[shown % RING_SIZE].pixels : NULL;
+#ifdef DEBUG
+  if (skipped > 1) {
+    fprintf(stderr, "Animation dropped %u frames, %u so far\n", skipped - 1,
+            dropped_frames);
+  }
+#endif
+  if (finished && shown + 1 == produced) {
+    report();
+  }
+  pthread_mutex_unlock(&ring_mutex);
+  return changed;
+}
+
+void apng_report(void) {
+  if (apng_fd == -1) {
+    return;
+  }
+  pthread_mutex_lock(&ring_mutex);
+  report();
+  pthread_mutex_unlock(&ring_mutex);
+}
+
+int apng_timeout(void) {
+  if (apng_fd == -1) {
+    return -1;
+  }
+  int timeout = -1;
+  pthread_mutex_lock(&ring_mutex);
+  if (!showing) {
+    timeout = produced != 0 ? 0 : -1;
+  } else if (shown + 1 < produced || (!finished && !stalled)) {
+    /* Without the next frame, waking up at its time records that it was
+     * late, and the decoder wakes us up once it is there. */
+    uint64_t now = now_nanoseconds();
+    timeout = due > now ? (due - now + 999999) / 1000000 : 0;
+  }
+  pthread_mutex_unlock(&ring_mutex);
+  return timeout;
+}
@@ -0,0 +1,214 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <syscall.h>
+#include <unistd.h>
+
+#include <buffer.h>
+#include <wayland-client.h>
+
+/* Double buffering plus one buffer the compositor may hold on to while it
+ * is still compositing an older frame. */
+#define BUFFER_COUNT 3
+
+static struct wl_shm *wayland_shm;
+static struct buffer buffers[BUFFER_COUNT];
+static bool buffers_used[BUFFER_COUNT];
+
+/* Size of the most recent buffer_acquire, buffers of other sizes are freed
+ * as soon as they are idle. */
+static int32_t current_width;
+static int32_t current_height;
+
+/* Buffer of buffer_wrap, its memory belongs to the caller. */
+static struct buffer shared_buffer;
+
+static void buffer_destroy(struct buffer *buffer) {
+  if (buffer->wayland_buffer != NULL) {
+    wl_buffer_destroy(buffer->wayland_buffer);
+  }
+  wl_shm_pool_destroy(buffer->wayland_shm_pool);
+  munmap(buffer->pixel_data, buffer->pool_size);
+  close(buffer->fd);
+  buffers_used[buffer - buffers] = false;
+}
+
+static void wayland_buffer_release_listener(
+    void *data, __attribute__((unused)) struct wl_buffer *wayland_buffer) {
+  struct buffer *buffer = data;
+  buffer->busy = false;
+  if (buffer->width != current_width || buffer->height != current_height) {
+    buffer_destroy(buffer);
+  }
+}
+
+static const struct wl_buffer_listener wayland_buffer_listener = {
+    wayland_buffer_release_listener};
+
+static void wayland_shared_buffer_release_listener(
+    void *data, __attribute__((unused)) struct wl_buffer *wayland_buffer) {
+  struct buffer *buffer = data;
+  buffer->busy = false;
+}
+
+static const struct wl_buffer_listener wayland_shared_buffer_listener = {
+    wayland_shared_buffer_release_listener};
+
+void buffer_init(struct wl_shm *shm) { wayland_shm = shm; }
+
+static void buffer_create_wayland_buffer(struct buffer *buffer, int32_t width,
+                                         int32_t height, uint32_t format) {
+  if (buffer->wayland_buffer != NULL) {
+    wl_buffer_destroy(buffer->wayland_buffer);
+  }
+  size_t size = 4 * (size_t)width * height;
+  if (size > buffer->pool_size) {
+    /* Unlike ftruncate, fallocate reserves the memory now, so running out
+     * of it fails here instead of as a SIGBUS while rendering. */
+    int error = fallocate(buffer->fd, 0, 0, size);
+    assert(error == 0);
+    if (buffer->wayland_shm_pool == NULL) {
+      buffer->wayland_shm_pool =
+          wl_shm_create_pool(wayland_shm, buffer->fd, size);
+      assert(buffer->wayland_shm_pool != NULL);
+    } else {
+      wl_shm_pool_resize(buffer->wayland_shm_pool, size);
+      munmap(buffer->pixel_data, buffer->pool_size);
+    }
+    /* Prefault the pages so the first render doesn't take a page fault for
+     * every 4 KiB. */
+    buffer->pixel_data = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_POPULATE, buffer->fd, 0);
+    assert(buffer->pixel_data != MAP_FAILED);
+    buffer->pool_size = size;
+  }
+  buffer->wayland_buffer = wl_shm_pool_create_buffer(
+      buffer->wayland_shm_pool, 0, width, height, 4 * width, format);
+  assert(buffer->wayland_buffer != NULL);
+  wl_buffer_add_listener(buffer->wayland_buffer, &wayland_buffer_listener,
+                         buffer);
+  buffer->format = format;
+  if (width != buffer->width || height != buffer->height) {
+    buffer->width = width;
+    buffer->height = height;
+    buffer->content_width = 0;
+    buffer->content_height = 0;
+  }
+}
+
+struct buffer *buffer_acquire(int32_t width, int32_t height, uint32_t format) {
+  current_width = width;
+  current_height = height;
+
+  for (int i = 0; i < BUFFER_COUNT; i++) {
+    struct buffer *buffer = &buffers[i];
+    if (buffers_used[i] && !buffer->busy && buffer->width == width &&
+        buffer->height == height) {
+      if (buffer->format != format) {
+        buffer_create_wayland_buffer(buffer, width, height, format);
+      }
+      return buffer;
+    }
+  }
+
+  /* Recycle one idle buffer of an old size and free the others. */
+  struct buffer *idle = NULL;
+  for (int i = 0; i < BUFFER_COUNT; i++) {
+    struct buffer *buffer = &buffers[i];
+    if (!buffers_used[i] || buffer->busy) {
+      continue;
+    }
+    if (idle == NULL) {
+      idle = buffer;
+    } else {
+      buffer_destroy(buffer);
+    }
+  }
+  if (idle != NULL) {
+    buffer_create_wayland_buffer(idle, width, height, format);
+    return idle;
+  }
+
+  for (int i = 0; i < BUFFER_COUNT; i++) {
+    if (buffers_used[i]) {
+      continue;
+    }
+    struct buffer *buffer = &buffers[i];
+    buffer->fd = syscall(SYS_memfd_create, "pixel_data", 0);
+    assert(buffer->fd != -1);
+    buffer->wayland_shm_pool = NULL;
+    buffer->pool_size = 0;
+    buffer->pixel_data = NULL;
+    buffer->wayland_buffer = NULL;
+    buffer->width = 0;
+    buffer->height = 0;
+    buffer->busy = false;
+    buffers_used[i] = true;
+    buffer_create_wayland_buffer(buffer, width, height, format);
+    return buffer;
+  }
+  return NULL;
+}
+
+struct buffer *buffer_wrap(int fd, uint32_t *pixel_data, int32_t width,
+                           int32_t height, int32_t stride, uint32_t format) {
+  /* Nothing is rendered into the other buffers anymore. */
+  current_width = 0;
+  current_height = 0;
+  for (int i = 0; i < BUFFER_COUNT; i++) {
+    if (buffers_used[i] && !buffers[i].busy) {
+      buffer_destroy(&buffers[i]);
+    }
+  }
+
+  struct buffer *buffer = &shared_buffer;
+  if (buffer->wayland_shm_pool == NULL) {
+    buffer->fd = fd;
+    buffer->pixel_data = pixel_data;
+    buffer->pool_size = (size_t)stride * height;
+    buffer->wayland_shm_pool =
+        wl_shm_create_pool(wayland_shm, fd, buffer->pool_size);
+    assert(buffer->wayland_shm_pool != NULL);
+    buffer->width = width;
+    buffer->height = height;
+  }
+  assert(buffer->fd == fd && buffer->width == width &&
+         buffer->height == height);
+  if (buffer->wayland_buffer == NULL || buffer->format != format) {
+    if (buffer->wayland_buffer != NULL) {
+      wl_buffer_destroy(buffer->wayland_buffer);
+    }
+    buffer->wayland_buffer = wl_shm_pool_create_buffer(
+        buffer->wayland_shm_pool, 0, width, height, stride, format);
+    assert(buffer->wayland_buffer != NULL);
+    wl_buffer_add_listener(buffer->wayland_buffer,
+                           &wayland_shared_buffer_listener, buffer);
+    buffer->format = format;
+  }
+  return buffer;
+}
+
+struct wl_buffer *buffer_create_single_pixel(uint32_t pixel) {
+  int fd = syscall(SYS_memfd_create, "single_pixel", 0);
+  assert(fd != -1);
+  ssize_t written = write(fd, &pixel, sizeof(pixel));
+  assert(written == sizeof(pixel));
+  struct wl_shm_pool *wayland_shm_pool =
+      wl_shm_create_pool(wayland_shm, fd, sizeof(pixel));
+  assert(wayland_shm_pool != NULL);
+  struct wl_buffer *wayland_buffer = wl_shm_pool_create_buffer(
+      wayland_shm_pool, 0, 1, 1, sizeof(pixel), WL_SHM_FORMAT_XRGB8888);
+  assert(wayland_buffer != NULL);
+  wl_shm_pool_destroy(wayland_shm_pool);
+  close(fd);
+  return wayland_buffer;
+}
+
+void buffer_attach(struct buffer *buffer, struct wl_surface *wayland_surface) {
+  wl_surface_attach(wayland_surface, buffer->wayland_buffer, 0, 0);
+  buffer->busy = true;
+}
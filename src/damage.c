@@ -0,0 +1,57 @@
+#include <stdint.h>
+#include <string.h>
+
+#include <damage.h>
+
+static void remove_range(struct damage *damage, uint32_t index) {
+  memmove(&damage->ranges[index], &damage->ranges[index + 1],
+          (damage->count - index - 1) * sizeof(damage->ranges[0]));
+  damage->count--;
+}
+
+void damage_add(struct damage *damage, uint32_t first_row, uint32_t last_row) {
+  if (first_row >= last_row) {
+    return;
+  }
+
+  /* Absorb every range that overlaps or touches the new one. */
+  uint32_t index = 0;
+  while (index < damage->count) {
+    if (damage->ranges[index].last_row < first_row) {
+      index++;
+    } else if (damage->ranges[index].first_row > last_row) {
+      break;
+    } else {
+      if (damage->ranges[index].first_row < first_row) {
+        first_row = damage->ranges[index].first_row;
+      }
+      if (damage->ranges[index].last_row > last_row) {
+        last_row = damage->ranges[index].last_row;
+      }
+      remove_range(damage, index);
+    }
+  }
+
+  memmove(&damage->ranges[index + 1], &damage->ranges[index],
+          (damage->count - index) * sizeof(damage->ranges[0]));
+  damage->ranges[index].first_row = first_row;
+  damage->ranges[index].last_row = last_row;
+  damage->count++;
+
+  if (damage->count > DAMAGE_MAX_RANGES) {
+    uint32_t closest = 0;
+    uint32_t closest_gap = UINT32_MAX;
+    for (uint32_t i = 0; i + 1 < damage->count; i++) {
+      uint32_t gap =
+          damage->ranges[i + 1].first_row - damage->ranges[i].last_row;
+      if (gap < closest_gap) {
+        closest = i;
+        closest_gap = gap;
+      }
+    }
+    damage->ranges[closest].last_row = damage->ranges[closest + 1].last_row;
+    remove_range(damage, closest + 1);
+  }
+}
+
+void damage_clear(struct damage *damage) { damage->count = 0; }
@@ -0,0 +1,137 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <idat.h>
+#include <zlib.h>
+
+/* The chunks found so far. They are only looked for as the stream is read,
+ * so the pages of the file are only touched as far as the decoder got. Any
+ * thread may find more of them, so they are only accessed with the mutex
+ * held. */
+static const uint8_t *file_data;
+static size_t file_size;
+/* Offset of the data of the first chunk. */
+static size_t first_offset;
+static struct idat_chunk *chunks = NULL;
+static uint32_t chunk_count = 0;
+static uint32_t chunk_capacity = 0;
+static size_t stream_size = 0;
+/* File offset of the chunk after the last one found, and whether that is
+ * not an IDAT chunk, which ends the stream. */
+static size_t next_offset;
+static bool all_found = false;
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t read_be32(const uint8_t *data) {
+  return (uint32_t)data[0] << 24 | data[1] << 16 | data[2] << 8 | data[3];
+}
+
+/* Adds the chunk at next_offset, returns false if the stream ended before
+ * it. The IDAT chunks have to follow each other. */
+static bool find_next_chunk(void) {
+  if (all_found) {
+    return false;
+  }
+  if (next_offset + 12 > file_size ||
+      memcmp(file_data + next_offset + 4, "IDAT", 4) != 0) {
+    all_found = true;
+    return false;
+  }
+  size_t size = read_be32(file_data + next_offset);
+  assert(size <= file_size - next_offset - 12);
+  if (chunk_count == chunk_capacity) {
+    chunk_capacity = chunk_capacity == 0 ? 16 : chunk_capacity * 2;
+    chunks = realloc(chunks, chunk_capacity * sizeof(*chunks));
+    assert(chunks != NULL);
+  }
+  chunks[chunk_count].data = file_data + next_offset + 8;
+  chunks[chunk_count].size = size;
+  chunks[chunk_count].stream_offset = stream_size;
+  chunk_count++;
+  stream_size += size;
+  next_offset += size + 12;
+  return true;
+}
+
+void idat_init(const uint8_t *data, size_t size, size_t offset) {
+  file_data = data;
+  file_size = size;
+  first_offset = offset;
+  next_offset = offset - 8;
+  /* libpng just read the header of the first one. */
+  bool found = find_next_chunk();
+  assert(found);
+}
+
+size_t idat_size_bound(void) { return file_size - first_offset; }
+
+/* Chunk holding the byte at offset in the zlib stream, finding chunks up to
+ * it if needed, or chunk_count if the stream ends before it. Called with
+ * the mutex held. */
+static uint32_t find_chunk(size_t offset) {
+  while (offset >= stream_size && find_next_chunk()) {
+  }
+  if (offset >= stream_size) {
+    return chunk_count;
+  }
+  uint32_t low = 0;
+  uint32_t high = chunk_count;
+  while (high - low > 1) {
+    uint32_t middle = (low + high) / 2;
+    if (chunks[middle].stream_offset <= offset) {
+      low = middle;
+    } else {
+      high = middle;
+    }
+  }
+  return low;
+}
+
+uint8_t idat_byte(size_t offset) {
+  pthread_mutex_lock(&mutex);
+  uint32_t index = find_chunk(offset);
+  assert(index < chunk_count);
+  const struct idat_chunk *chunk = &chunks[index];
+  uint8_t byte = chunk->data[offset - chunk->stream_offset];
+  pthread_mutex_unlock(&mutex);
+  return byte;
+}
+
+void idat_reader_init(struct idat_reader *reader, size_t offset, size_t end) {
+  reader->chunk = 0;
+  reader->offset = offset;
+  reader->end = end;
+}
+
+bool idat_read(struct idat_reader *reader, z_stream *stream) {
+  if (reader->offset >= reader->end) {
+    return false;
+  }
+  pthread_mutex_lock(&mutex);
+  /* Usually the offset is in the chunk of the last read or the next one. */
+  uint32_t index = reader->chunk;
+  if (index >= chunk_count ||
+      reader->offset < chunks[index].stream_offset ||
+      reader->offset >= chunks[index].stream_offset + chunks[index].size) {
+    index = find_chunk(reader->offset);
+  }
+  if (index == chunk_count) {
+    pthread_mutex_unlock(&mutex);
+    return false;
+  }
+  const struct idat_chunk *chunk = &chunks[index];
+  size_t chunk_end = chunk->stream_offset + chunk->size;
+  size_t end = chunk_end < reader->end ? chunk_end : reader->end;
+  stream->next_in =
+      (uint8_t *)chunk->data + (reader->offset - chunk->stream_offset);
+  pthread_mutex_unlock(&mutex);
+  stream->avail_in = end - reader->offset;
+  reader->chunk = end == chunk_end ? index + 1 : index;
+  reader->offset = end;
+  return true;
+}
@@ -0,0 +1,1190 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <apng.h>
+#include <idat.h>
+#include <loader.h>
+#include <parallel-inflate.h>
+#include <png.h>
+#include <row-index.h>
+#include <unfilter.h>
+#include <zlib.h>
+
+uint32_t png_width;
+uint32_t png_height;
+uint32_t png_stride;
+uint32_t *png_pixels = NULL;
+int png_pixels_fd = -1;
+uint8_t *png_indices = NULL;
+uint32_t png_palette[256];
+uint32_t png_pixel_size;
+
+uint64_t png_progress = 0;
+uint32_t png_rows_ready = 0;
+bool png_decoding = true;
+bool png_opaque = true;
+
+/* Size of the reads from files that can't be mapped, like pipes. */
+#define READ_BUFFER_SIZE (1 << 20)
+#define PROBE_SIZE (8 + 8 + 13)
+/* Output of inflate per call when libpng is bypassed. */
+#define INFLATE_OUTPUT_SIZE (256 << 10)
+/* Larger blocks could overflow the sums of their channels. */
+#define MAX_REDUCTION 4096
+/* Reduced images drop the pages of the mapped file behind the decoder in
+ * steps of this size. */
+#define DROP_SIZE (8 << 20)
+
+static int file_fd;
+/* Mapping of the whole file, or NULL if it is read into read_buffer. */
+static uint8_t *file_data;
+static size_t file_size;
+static size_t file_offset;
+static uint8_t *read_buffer;
+
+/* libpng and zlib only allocate a few buffers per image, so they are served
+ * from blocks that are freed all at once after decoding. */
+#define ARENA_BLOCK_SIZE (256 << 10)
+
+struct arena_block {
+  struct arena_block *next;
+  size_t size;
+  size_t used;
+  max_align_t data[];
+};
+
+static struct arena_block *arena = NULL;
+#ifdef DEBUG
+static uint32_t arena_allocations = 0;
+static uint32_t arena_blocks = 0;
+#endif
+
+static png_voidp arena_malloc(__attribute__((unused)) png_structp png_ptr,
+                              png_alloc_size_t size) {
+  size = (size + alignof(max_align_t) - 1) & ~(alignof(max_align_t) - 1);
+  if (arena == NULL || arena->size - arena->used < size) {
+    size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+    struct arena_block *block = malloc(sizeof(*block) + block_size);
+    if (block == NULL) {
+      return NULL;
+    }
+    block->next = arena;
+    block->size = block_size;
+    block->used = 0;
+    arena = block;
+#ifdef DEBUG
+    arena_blocks++;
+#endif
+  }
+#ifdef DEBUG
+  arena_allocations++;
+#endif
+  png_voidp pointer = (uint8_t *)arena->data + arena->used;
+  arena->used += size;
+  return pointer;
+}
+
+static void arena_free(__attribute__((unused)) png_structp png_ptr,
+                       __attribute__((unused)) png_voidp pointer) {}
+
+static void arena_destroy(void) {
+  while (arena != NULL) {
+    struct arena_block *next = arena->next;
+    free(arena);
+    arena = next;
+  }
+}
+
+static png_structp png;
+static png_infop info;
+static int png_passes;
+/* Set if the rows are decoded on demand by the row index, which gets them in
+ * the format of the file and converts them itself. */
+static bool png_row_index = false;
+/* Set if the IDAT chunks of a non-interlaced file are mapped, so they can be
+ * decoded without libpng as well. */
+static bool png_idat_mapped = false;
+/* Set if the mapped file is an APNG whose frames play after the image. */
+static bool png_animated = false;
+/* Size of the image in the file, which png_width and png_height are reduced
+ * from by averaging blocks of png_reduction x png_reduction pixels. */
+static uint32_t image_width;
+static uint32_t image_height;
+static uint32_t png_reduction = 1;
+/* Set if only the png_width x png_height pixels from crop_x, crop_y on are
+ * decoded. The rows after them are never read. */
+static bool png_cropped = false;
+static uint32_t crop_x = 0;
+static uint32_t crop_y = 0;
+/* Rows of the file that are decoded. */
+static uint32_t decoded_height;
+/* Set if the pixels of the file are palette indices or gray levels that
+ * png_palette translates. */
+static bool png_indexed;
+static uint32_t png_raw_row_size;
+static uint32_t png_raw_pixel_size;
+static int png_color_type;
+static int png_bit_depth;
+static png_color_16 png_transparent_color;
+static bool png_has_transparent_color = false;
+/* Cleared if the header already guarantees opaque pixels. */
+static bool png_may_be_translucent;
+static atomic_bool png_translucent = false;
+/* Entries of png_palette that are not opaque. */
+static bool png_palette_translucent[256];
+
+static int loader_fd;
+/* Rows decoded so far, counted over all passes. */
+static _Atomic uint64_t loader_progress = 0;
+
+/* Bytes at the start of the mapped file whose pages were dropped. */
+static size_t dropped_size = 0;
+
+/* The pages of a large file would take far more memory than a reduced
+ * image, so they are dropped once the decoder read past them. They are read
+ * from the file again if needed. */
+static void drop_read_pages(size_t offset) {
+  size_t end = offset & ~(size_t)(DROP_SIZE - 1);
+  if (png_reduction != 1 && end > dropped_size) {
+    madvise(file_data + dropped_size, end - dropped_size, MADV_DONTNEED);
+    dropped_size = end;
+  }
+}
+
+static void read_mapped(png_structp png_ptr, png_bytep data, size_t length) {
+  if (length > file_size - file_offset) {
+    png_error(png_ptr, "Unexpected end of file");
+  }
+  memcpy(data, file_data + file_offset, length);
+  file_offset += length;
+  drop_read_pages(file_offset);
+}
+
+/* file_offset and file_size delimit the unread part of read_buffer. */
+static void read_buffered(png_structp png_ptr, png_bytep data,
+                          size_t length) {
+  while (length != 0) {
+    if (file_offset == file_size) {
+      ssize_t size = read(file_fd, read_buffer, READ_BUFFER_SIZE);
+      if (size <= 0) {
+        png_error(png_ptr, "Unexpected end of file");
+      }
+      file_offset = 0;
+      file_size = size;
+    }
+    size_t available = file_size - file_offset;
+    size_t copied = length < available ? length : available;
+    memcpy(data, read_buffer + file_offset, copied);
+    file_offset += copied;
+    data += copied;
+    length -= copied;
+  }
+}
+
+/* x / 255 for x <= 255 * 255, without the division. */
+static inline uint32_t divide_by_255(uint32_t x) {
+  return (x + 1 + (x >> 8)) >> 8;
+}
+
+static inline uint32_t premultiply(uint32_t pixel) {
+  uint32_t alpha = pixel >> 24;
+  uint32_t red = divide_by_255(((pixel >> 16) & 0xFF) * alpha);
+  uint32_t green = divide_by_255(((pixel >> 8) & 0xFF) * alpha);
+  uint32_t blue = divide_by_255((pixel & 0xFF) * alpha);
+  return alpha << 24 | red << 16 | green << 8 | blue;
+}
+
+/* Fills png_palette for images that are stored as indices, which are the
+ * palette indices or the gray levels before expanding them to 8 bits. */
+static void read_palette(int color_type, int bit_depth) {
+  png_bytep alphas = NULL;
+  int alpha_count = 0;
+  png_color_16p transparent_gray = NULL;
+  if (png_get_valid(png, info, PNG_INFO_tRNS) != 0) {
+    png_get_tRNS(png, info, &alphas, &alpha_count, &transparent_gray);
+  }
+
+  for (uint32_t i = 0; i < 256; i++) {
+    png_palette[i] = 0xFF000000;
+  }
+  if (color_type == PNG_COLOR_TYPE_PALETTE) {
+    png_colorp colors;
+    int color_count;
+    png_get_PLTE(png, info, &colors, &color_count);
+    for (int i = 0; i < color_count; i++) {
+      uint32_t alpha = i < alpha_count ? alphas[i] : 0xFF;
+      png_palette[i] = premultiply(alpha << 24 | colors[i].red << 16 |
+                                   colors[i].green << 8 | colors[i].blue);
+      png_palette_translucent[i] = alpha != 0xFF;
+    }
+  } else {
+    uint32_t max_gray = (1u << bit_depth) - 1;
+    for (uint32_t i = 0; i <= max_gray; i++) {
+      png_palette[i] = 0xFF000000 | (i * 255 / max_gray) * 0x010101;
+    }
+    if (transparent_gray != NULL && transparent_gray->gray <= max_gray) {
+      png_palette[transparent_gray->gray] = 0;
+      png_palette_translucent[transparent_gray->gray] = true;
+    }
+  }
+}
+
+/* Premultiplies every step-th pixel of a row of width pixels from first on
+ * and flags the image as translucent if any of them is not opaque. */
+static void premultiply_pixels(uint32_t *row, uint32_t width, uint32_t first,
+                               uint32_t step) {
+  bool opaque = true;
+  for (uint32_t x = first; x < width; x += step) {
+    if (row[x] >> 24 != 0xFF) {
+      opaque = false;
+      row[x] = premultiply(row[x]);
+    }
+  }
+  if (!opaque) {
+    atomic_store_explicit(&png_translucent, true, memory_order_relaxed);
+  }
+}
+
+/* Like premultiply_pixels for indices, whose palette is premultiplied
+ * already. */
+static void check_indices(const uint8_t *row, uint32_t width, uint32_t first,
+                          uint32_t step) {
+  bool opaque = true;
+  for (uint32_t x = first; x < width; x += step) {
+    if (png_palette_translucent[row[x]]) {
+      opaque = false;
+    }
+  }
+  if (!opaque) {
+    atomic_store_explicit(&png_translucent, true, memory_order_relaxed);
+  }
+}
+
+/* Palette index or gray level x of a row with up to 8 bits per pixel. */
+static inline uint32_t read_index(const uint8_t *row, uint32_t x) {
+  if (png_bit_depth == 8) {
+    return row[x];
+  }
+  uint32_t per_byte = 8 / png_bit_depth;
+  uint32_t shift = 8 - png_bit_depth * (x % per_byte + 1);
+  return (row[x / per_byte] >> shift) & ((1u << png_bit_depth) - 1);
+}
+
+/* Stores a row of palette indices or gray levels of up to 8 bits as one
+ * byte per pixel, like png_set_packing. */
+static void store_indices(void *destination, const uint8_t *row) {
+  uint8_t *indices = destination;
+  if (png_bit_depth == 8) {
+    memcpy(indices, row, png_width);
+  } else {
+    for (uint32_t x = 0; x < png_width; x++) {
+      indices[x] = read_index(row, x);
+    }
+  }
+  if (png_may_be_translucent) {
+    check_indices(indices, png_width, 0, 1);
+  }
+}
+
+/* Sample of 8 or 16 bits, as stored in the file. */
+static inline uint32_t read_sample(const uint8_t *sample) {
+  return png_bit_depth == 16 ? (uint32_t)sample[0] << 8 | sample[1]
+                             : sample[0];
+}
+
+/* Reduces a sample to 8 bits, rounding like png_set_scale_16. */
+static inline uint32_t scale_sample(uint32_t sample) {
+  if (png_bit_depth != 16) {
+    return sample;
+  }
+  int32_t high = sample >> 8;
+  return high + ((((int32_t)sample & 0xFF) - high + 128) * 65535 >> 24);
+}
+
+/* Converts a gray or truecolor row of width pixels to ARGB, like the
+ * transforms that loader_open sets up for libpng. */
+static void convert_pixels(uint32_t *pixels, const uint8_t *row,
+                           uint32_t width) {
+  uint32_t sample_size = png_bit_depth / 8;
+  /* The common formats need none of the conversions. */
+  if (png_bit_depth == 8 && png_color_type == PNG_COLOR_TYPE_RGB_ALPHA) {
+    for (uint32_t x = 0; x < width; x++, row += 4) {
+      pixels[x] = (uint32_t)row[3] << 24 | row[0] << 16 | row[1] << 8 | row[2];
+    }
+  } else if (png_bit_depth == 8 && png_color_type == PNG_COLOR_TYPE_RGB &&
+             !png_has_transparent_color) {
+    for (uint32_t x = 0; x < width; x++, row += 3) {
+      pixels[x] = 0xFF000000 | row[0] << 16 | row[1] << 8 | row[2];
+    }
+  } else {
+    for (uint32_t x = 0; x < width; x++) {
+      uint32_t red;
+      uint32_t green;
+      uint32_t blue;
+      uint32_t alpha = 0xFF;
+      if (png_color_type == PNG_COLOR_TYPE_RGB ||
+          png_color_type == PNG_COLOR_TYPE_RGB_ALPHA) {
+        red = read_sample(row);
+        green = read_sample(row + sample_size);
+        blue = read_sample(row + sample_size * 2);
+        row += sample_size * 3;
+        if (png_has_transparent_color && red == png_transparent_color.red &&
+            green == png_transparent_color.green &&
+            blue == png_transparent_color.blue) {
+          alpha = 0;
+        }
+      } else {
+        red = green = blue = read_sample(row);
+        row += sample_size;
+        if (png_has_transparent_color && red == png_transparent_color.gray) {
+          alpha = 0;
+        }
+      }
+      if ((png_color_type & PNG_COLOR_MASK_ALPHA) != 0) {
+        alpha = scale_sample(read_sample(row));
+        row += sample_size;
+      }
+      pixels[x] = alpha << 24 | scale_sample(red) << 16 |
+                  scale_sample(green) << 8 | scale_sample(blue);
+    }
+  }
+}
+
+/* Stores a gray or truecolor row as premultiplied ARGB. */
+static void store_pixels(void *destination, const uint8_t *row) {
+  convert_pixels(destination, row, png_width);
+  if (png_may_be_translucent) {
+    premultiply_pixels(destination, png_width, 0, 1);
+  }
+}
+
+/* Stores the columns of a row of the file that a crop keeps, like
+ * store_indices or store_pixels. */
+static void store_cropped(void *destination, const uint8_t *row) {
+  if (png_indices != NULL) {
+    uint8_t *indices = destination;
+    for (uint32_t x = 0; x < png_width; x++) {
+      indices[x] = read_index(row, crop_x + x);
+    }
+    if (png_may_be_translucent) {
+      check_indices(indices, png_width, 0, 1);
+    }
+  } else {
+    store_pixels(destination, row + (size_t)crop_x * png_raw_pixel_size);
+  }
+}
+
+/* Stores a row of width pixels, in the format of the file, as premultiplied
+ * ARGB, for animation frames and reduced images. */
+static void store_argb(uint32_t *destination, const uint8_t *row,
+                       uint32_t width) {
+  if (png_indexed) {
+    bool opaque = true;
+    for (uint32_t x = 0; x < width; x++) {
+      uint32_t index = read_index(row, x);
+      destination[x] = png_palette[index];
+      opaque = opaque && !png_palette_translucent[index];
+    }
+    if (!opaque) {
+      atomic_store_explicit(&png_translucent, true, memory_order_relaxed);
+    }
+  } else {
+    convert_pixels(destination, row, width);
+    premultiply_pixels(destination, width, 0, 1);
+  }
+}
+
+void loader_probe(const char *path, struct png_header *header) {
+  /* "-" reads the PNG from stdin. */
+  file_fd = strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY);
+  assert(file_fd != -1);
+
+  /* The signature and the IHDR chunk up to its CRC, which always come
+   * first. They are read into read_buffer, where libpng finds them again if
+   * the file can't be mapped. */
+  read_buffer = malloc(READ_BUFFER_SIZE);
+  assert(read_buffer != NULL);
+  file_offset = 0;
+  file_size = 0;
+  while (file_size < PROBE_SIZE) {
+    ssize_t size = read(file_fd, read_buffer + file_size,
+                        PROBE_SIZE - file_size);
+    assert(size > 0);
+    file_size += size;
+  }
+  assert(png_sig_cmp(read_buffer, 0, 8) == 0);
+  assert(memcmp(read_buffer + 12, "IHDR", 4) == 0);
+  header->width = png_get_uint_32(read_buffer + 16);
+  header->height = png_get_uint_32(read_buffer + 20);
+  header->bit_depth = read_buffer[24];
+  header->color_type = read_buffer[25];
+  header->interlaced = read_buffer[28] != PNG_INTERLACE_NONE;
+
+  png_width = header->width;
+  png_height = header->height;
+  png_pixel_size = header->color_type == PNG_COLOR_TYPE_PALETTE ||
+                           (header->color_type == PNG_COLOR_TYPE_GRAY &&
+                            header->bit_depth <= 8)
+                       ? 1
+                       : 4;
+  loader_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  assert(loader_fd != -1);
+}
+
+/* Sums of the premultiplied channels of the pixels of the file that were
+ * added to each pixel of a reduced image, and their number. Non-interlaced
+ * files only need the row of blocks that is being decoded, interlaced ones
+ * need all of them, since every pass adds to every row. */
+static uint32_t (*block_sums)[4];
+static uint32_t *block_counts;
+/* A row of the file in its own format and as premultiplied ARGB. */
+static uint8_t *image_raw_row;
+static uint32_t *image_row;
+
+static void reduce_init(void) {
+  size_t blocks = (size_t)png_width * (png_passes != 1 ? png_height : 1);
+  block_sums = calloc(blocks, sizeof(*block_sums));
+  assert(block_sums != NULL);
+  block_counts = calloc(blocks, sizeof(*block_counts));
+  assert(block_counts != NULL);
+  image_raw_row = malloc(png_raw_row_size);
+  assert(image_raw_row != NULL);
+  image_row = malloc((size_t)image_width * sizeof(*image_row));
+  assert(image_row != NULL);
+}
+
+/* Pixels from the start of one row to the next, so that every row starts on
+ * a cache line. */
+static uint32_t row_stride(uint32_t width, uint32_t pixel_size) {
+  return (width + 64 / pixel_size - 1) & ~(64 / pixel_size - 1);
+}
+
+/* Bytes that a reduced image of width x height pixels takes while it is
+ * decoded, including the sums of its blocks. */
+static size_t reduced_size(uint32_t width, uint32_t height, bool interlaced) {
+  size_t size = (size_t)row_stride(width, 4) * height * 4;
+  size_t block_size = sizeof(uint32_t) * 5;
+  return size + block_size * width * (interlaced ? height : 1);
+}
+
+uint32_t loader_pick_reduction(const struct png_header *header, size_t budget,
+                               uint32_t max_width, uint32_t max_height) {
+  bool indexed = header->color_type == PNG_COLOR_TYPE_PALETTE ||
+                 (header->color_type == PNG_COLOR_TYPE_GRAY &&
+                  header->bit_depth <= 8);
+  uint32_t pixel_size = indexed ? 1 : 4;
+  if ((size_t)row_stride(header->width, pixel_size) * header->height *
+          pixel_size <=
+      budget) {
+    return 1;
+  }
+  /* Images are never shown smaller than 1:1, so the pixels that wouldn't
+   * fit into the largest window anyway are averaged first. */
+  uint32_t reduction = 2;
+  uint32_t width_reduction = (header->width + max_width - 1) / max_width;
+  uint32_t height_reduction = (header->height + max_height - 1) / max_height;
+  if (reduction < width_reduction) {
+    reduction = width_reduction;
+  }
+  if (reduction < height_reduction) {
+    reduction = height_reduction;
+  }
+  while (reduction < MAX_REDUCTION &&
+         reduced_size((header->width + reduction - 1) / reduction,
+                      (header->height + reduction - 1) / reduction,
+                      header->interlaced) > budget) {
+    reduction++;
+  }
+  return reduction < MAX_REDUCTION ? reduction : MAX_REDUCTION;
+}
+
+/* Reads the rest of the PNG header and allocates the rows. */
+static void loader_open(bool share_pixels, bool index_rows) {
+  png = png_create_read_struct_2(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL,
+                                 NULL, arena_malloc, arena_free);
+  assert(png != NULL);
+  info = png_create_info_struct(png);
+  assert(info != NULL);
+
+  /* Mapping the file saves a read system call and a copy through stdio for
+   * every few KiB. */
+  struct stat file_stat;
+  int error = fstat(file_fd, &file_stat);
+  assert(error == 0);
+  file_data = NULL;
+  if (S_ISREG(file_stat.st_mode) && file_stat.st_size > 0) {
+    file_data = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, file_fd,
+                     0);
+    if (file_data == MAP_FAILED) {
+      file_data = NULL;
+    }
+  }
+  if (file_data != NULL) {
+    free(read_buffer);
+    read_buffer = NULL;
+    file_size = file_stat.st_size;
+    file_offset = 0;
+    /* The decoder reads the file once from front to back, so the pages can
+     * be read ahead and dropped right after. */
+    madvise(file_data, file_size, MADV_SEQUENTIAL);
+    /* A crop may end long before the file does. */
+    if (!png_cropped) {
+      madvise(file_data, file_size, MADV_WILLNEED);
+    }
+    png_set_read_fn(png, NULL, read_mapped);
+  } else {
+    png_set_read_fn(png, NULL, read_buffered);
+  }
+  png_read_info(png, info);
+  int color_type = png_get_color_type(png, info);
+  int bit_depth = png_get_bit_depth(png, info);
+  png_may_be_translucent = (color_type & PNG_COLOR_MASK_ALPHA) != 0 ||
+                           png_get_valid(png, info, PNG_INFO_tRNS) != 0;
+  /* The in-tree decoders need to read the IDAT chunks at any offset, and
+   * don't handle the Adam7 passes. */
+  png_idat_mapped = file_data != NULL &&
+                    png_get_interlace_type(png, info) == PNG_INTERLACE_NONE;
+  png_row_index = index_rows && png_idat_mapped && !share_pixels &&
+                  png_reduction == 1 && !png_cropped;
+  png_color_type = color_type;
+  png_bit_depth = bit_depth;
+  png_raw_row_size = png_get_rowbytes(png, info);
+  png_indexed = color_type == PNG_COLOR_TYPE_PALETTE ||
+                (color_type == PNG_COLOR_TYPE_GRAY && bit_depth <= 8);
+  uint32_t bits_per_pixel = png_get_channels(png, info) * bit_depth;
+  png_raw_pixel_size = bits_per_pixel / 8;
+  if (png_raw_pixel_size == 0) {
+    png_raw_pixel_size = 1;
+  }
+  /* Palette and gray images take a quarter of the memory as one byte per
+   * pixel, and are only expanded while scaling. Reduced images get the rows
+   * in the format of the file and convert them to ARGB before averaging. */
+  bool reduced = png_reduction != 1;
+  bool indexed = png_indexed && !reduced;
+  if (png_indexed) {
+    read_palette(color_type, bit_depth);
+    if (!reduced) {
+      png_set_packing(png);
+    }
+  } else {
+    png_color_16p transparent_color;
+    if (png_get_tRNS(png, info, NULL, NULL, &transparent_color) != 0) {
+      png_transparent_color = *transparent_color;
+      png_has_transparent_color = true;
+    }
+    if (!reduced) {
+      png_set_scale_16(png);
+      png_set_gray_to_rgb(png);
+      png_set_expand(png);
+      png_set_bgr(png);
+      png_set_filler(png, 0xFF, PNG_FILLER_AFTER);
+    }
+  }
+  /* Without interlace handling, libpng returns the rows of each pass at the
+   * width of the pass. */
+  if (reduced || png_cropped) {
+    png_passes = png_get_interlace_type(png, info) == PNG_INTERLACE_ADAM7
+                     ? PNG_INTERLACE_ADAM7_PASSES
+                     : 1;
+  } else {
+    png_passes = png_set_interlace_handling(png);
+  }
+  png_read_update_info(png, info);
+
+  image_height = png_get_image_height(png, info);
+  image_width = png_get_image_width(png, info);
+  if (png_cropped) {
+    assert(crop_x + png_width <= image_width);
+    assert(crop_y + png_height <= image_height);
+  } else {
+    assert(png_width == (image_width + png_reduction - 1) / png_reduction);
+    assert(png_height == (image_height + png_reduction - 1) / png_reduction);
+  }
+  decoded_height = png_cropped && png_passes == 1 ? crop_y + png_height
+                                                  : image_height;
+  uint32_t pixel_size = indexed ? 1 : 4;
+  assert(pixel_size == png_pixel_size);
+  assert(reduced || png_get_rowbytes(png, info) == image_width * pixel_size);
+  png_stride = row_stride(png_width, pixel_size);
+  size_t size = (size_t)png_stride * png_height * pixel_size;
+  if (reduced) {
+    reduce_init();
+  } else if (png_cropped) {
+    /* A whole row of the file, in the format of the stored rows. */
+    image_row = malloc((size_t)image_width * sizeof(*image_row));
+    assert(image_row != NULL);
+  }
+  if (png_idat_mapped) {
+    /* libpng stopped right after the header of the first IDAT chunk. */
+    idat_init(file_data, file_size, file_offset);
+    unfilter_select();
+    png_animated = !reduced && !png_cropped &&
+                   apng_init(file_data, file_size, png_width, png_height,
+                             png_stride, bits_per_pixel, store_argb);
+    if (png_animated) {
+      /* Frames start from a transparent canvas. */
+      atomic_store_explicit(&png_translucent, true, memory_order_relaxed);
+    }
+  }
+  if (png_row_index) {
+    row_index_init(png_height, png_raw_row_size, png_raw_pixel_size,
+                   png_stride * pixel_size,
+                   indexed ? store_indices : store_pixels);
+  } else if (indexed) {
+    png_indices = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    assert(png_indices != MAP_FAILED);
+  } else if (share_pixels) {
+    png_pixels_fd = syscall(SYS_memfd_create, "png_pixels", 0);
+    assert(png_pixels_fd != -1);
+    /* Like calloc, but the compositor can map the pixels as well. */
+    int error = fallocate(png_pixels_fd, 0, 0, size);
+    assert(error == 0);
+    png_pixels = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                      png_pixels_fd, 0);
+    assert(png_pixels != MAP_FAILED);
+  } else {
+    /* Zeroed like calloc, but page aligned. */
+    png_pixels = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    assert(png_pixels != MAP_FAILED);
+  }
+}
+
+static void loader_notify(uint64_t progress) {
+  atomic_store_explicit(&loader_progress, progress, memory_order_release);
+  uint64_t value = 1;
+  ssize_t size = write(loader_fd, &value, sizeof(value));
+  assert(size == sizeof(value));
+}
+
+/* Left at 0 until the first batch, so that the first rows are shown as soon
+ * as they are decoded. */
+static struct timespec last_notify;
+
+static void row_decoded(uint64_t progress) {
+  /* Waking up the main thread for every row would cost more than rendering
+   * the rows, so batch them to about one per frame. */
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if ((now.tv_sec - last_notify.tv_sec) * 1000000000 + now.tv_nsec -
+          last_notify.tv_nsec >=
+      8000000) {
+    loader_notify(progress);
+    last_notify = now;
+  }
+}
+
+static void row_index_decoded(uint32_t rows) { row_decoded(rows); }
+
+/* Width and height of the area that a pixel of each Adam7 pass stands for
+ * until the later passes fill it in. */
+static const uint8_t pass_block_width[7] = {8, 4, 4, 2, 2, 1, 1};
+static const uint8_t pass_block_height[7] = {8, 8, 4, 4, 2, 2, 1};
+
+/* Repeats the pixels that pass just decoded in row y over their blocks, so
+ * every finished pass shows the whole image at a coarser resolution. The
+ * blocks only cover pixels of later passes. */
+static void fill_pass_blocks(uint32_t y, int pass) {
+  uint32_t block_width = pass_block_width[pass];
+  uint32_t block_height = pass_block_height[pass];
+  if (block_width == 1 && block_height == 1) {
+    return;
+  }
+  uint32_t pixel_size = png_pixel_size;
+  size_t row_size = (size_t)png_stride * pixel_size;
+  uint8_t *rows =
+      png_indices != NULL ? png_indices : (uint8_t *)png_pixels;
+  uint8_t *row = rows + y * row_size;
+  uint32_t end_row =
+      y + block_height < png_height ? y + block_height : png_height;
+  for (uint32_t x = PNG_PASS_START_COL(pass); x < png_width;
+       x += PNG_PASS_COL_OFFSET(pass)) {
+    uint32_t end = x + block_width < png_width ? x + block_width : png_width;
+    for (uint32_t i = x + 1; i < end; i++) {
+      memcpy(row + i * pixel_size, row + x * pixel_size, pixel_size);
+    }
+    for (uint32_t block_y = y + 1; block_y < end_row; block_y++) {
+      memcpy(rows + block_y * row_size + x * pixel_size,
+             row + x * pixel_size, (end - x) * pixel_size);
+    }
+  }
+}
+
+/* Decodes every pass into png_pixels or png_indices with libpng. */
+static void read_rows(void) {
+  uint64_t progress = 0;
+  for (int pass = 0; pass < png_passes; pass++) {
+    for (uint32_t y = 0; y < png_height; y++) {
+      /* Only the pixels of this pass are new, the others were
+       * premultiplied by earlier passes already. */
+      bool new_pixels = true;
+      uint32_t first = 0;
+      uint32_t step = 1;
+      if (png_passes != 1) {
+        new_pixels = PNG_ROW_IN_INTERLACE_PASS(y, pass);
+        first = PNG_PASS_START_COL(pass);
+        step = PNG_PASS_COL_OFFSET(pass);
+      }
+      /* Otherwise the filler already made every pixel opaque. */
+      bool check = png_may_be_translucent && new_pixels;
+      if (png_indices != NULL) {
+        uint8_t *row = png_indices + (size_t)y * png_stride;
+        png_read_row(png, row, NULL);
+        if (check) {
+          check_indices(row, png_width, first, step);
+        }
+      } else {
+        uint32_t *row = png_pixels + (size_t)y * png_stride;
+        png_read_row(png, (png_bytep)row, NULL);
+        if (check) {
+          premultiply_pixels(row, png_width, first, step);
+        }
+      }
+      if (png_passes != 1 && new_pixels) {
+        fill_pass_blocks(y, pass);
+      }
+      progress++;
+      row_decoded(progress);
+    }
+    /* Pass boundaries are always published, the main thread relies on it to
+     * report whole passes. */
+    loader_notify(progress);
+  }
+  png_read_end(png, NULL);
+}
+
+/* Adds count pixels of row y of the file, from column first on and step
+ * columns apart, to their blocks. */
+static void reduce_pixels(const uint32_t *pixels, uint32_t count, uint32_t y,
+                          uint32_t first, uint32_t step) {
+  size_t row = png_passes != 1 ? (size_t)(y / png_reduction) * png_width : 0;
+  uint32_t(*sums)[4] = block_sums + row;
+  uint32_t *counts = block_counts + row;
+  uint32_t i = 0;
+  uint32_t x = first;
+  for (uint32_t block = first / png_reduction; i < count; block++) {
+    uint32_t block_end = (block + 1) * png_reduction;
+    uint32_t alpha = 0;
+    uint32_t red = 0;
+    uint32_t green = 0;
+    uint32_t blue = 0;
+    uint32_t added = 0;
+    for (; i < count && x < block_end; i++, x += step) {
+      uint32_t pixel = pixels[i];
+      alpha += pixel >> 24;
+      red += (pixel >> 16) & 0xFF;
+      green += (pixel >> 8) & 0xFF;
+      blue += pixel & 0xFF;
+      added++;
+    }
+    sums[block][0] += alpha;
+    sums[block][1] += red;
+    sums[block][2] += green;
+    sums[block][3] += blue;
+    counts[block] += added;
+  }
+}
+
+/* Stores the averages of the row of blocks at y into png_pixels. Blocks
+ * that no pass reached yet repeat the block to their left, like the pixels
+ * of an Adam7 pass, and rows of blocks without any pixels repeat the row
+ * above. */
+static void store_blocks(uint32_t y) {
+  size_t row = png_passes != 1 ? (size_t)y * png_width : 0;
+  uint32_t(*sums)[4] = block_sums + row;
+  uint32_t *counts = block_counts + row;
+  uint32_t *pixels = png_pixels + (size_t)y * png_stride;
+  /* Every pass that reaches a row also reaches its first column. */
+  if (counts[0] == 0) {
+    if (y != 0) {
+      memcpy(pixels, pixels - png_stride, png_width * sizeof(*pixels));
+    }
+    return;
+  }
+  for (uint32_t x = 0; x < png_width; x++) {
+    uint32_t count = counts[x];
+    if (count == 0) {
+      pixels[x] = pixels[x - 1];
+      continue;
+    }
+    uint32_t half = count / 2;
+    pixels[x] = (sums[x][0] + half) / count << 24 |
+                (sums[x][1] + half) / count << 16 |
+                (sums[x][2] + half) / count << 8 | (sums[x][3] + half) / count;
+  }
+}
+
+/* Adds row y of the file, already converted at image_row, to the reduced
+ * image, and stores its row of blocks once all of their rows were added. */
+static void reduce_row(uint32_t y) {
+  reduce_pixels(image_row, image_width, y, 0, 1);
+  if ((y + 1) % png_reduction == 0 || y + 1 == image_height) {
+    uint32_t block_y = y / png_reduction;
+    store_blocks(block_y);
+    memset(block_sums, 0, png_width * sizeof(*block_sums));
+    memset(block_counts, 0, png_width * sizeof(*block_counts));
+    row_decoded(block_y + 1);
+  }
+}
+
+/* Decodes the file with libpng and reduces it into png_pixels. The rows of
+ * interlaced files are added pass by pass, and the whole image is stored
+ * after each of them. */
+static void read_reduced_rows(void) {
+  for (int pass = 0; pass < png_passes; pass++) {
+    uint32_t first_row = 0;
+    uint32_t row_step = 1;
+    uint32_t first = 0;
+    uint32_t step = 1;
+    uint32_t width = image_width;
+    uint32_t height = image_height;
+    if (png_passes != 1) {
+      first_row = PNG_PASS_START_ROW(pass);
+      row_step = PNG_PASS_ROW_OFFSET(pass);
+      first = PNG_PASS_START_COL(pass);
+      step = PNG_PASS_COL_OFFSET(pass);
+      width = PNG_PASS_COLS(image_width, pass);
+      /* libpng skips passes without pixels. */
+      height = width == 0 ? 0 : PNG_PASS_ROWS(image_height, pass);
+    }
+    for (uint32_t i = 0; i < height; i++) {
+      uint32_t y = first_row + i * row_step;
+      png_read_row(png, image_raw_row, NULL);
+      store_argb(image_row, image_raw_row, width);
+      if (png_passes != 1) {
+        reduce_pixels(image_row, width, y, first, step);
+      } else {
+        reduce_row(y);
+      }
+    }
+    if (png_passes != 1) {
+      for (uint32_t y = 0; y < png_height; y++) {
+        store_blocks(y);
+      }
+    }
+    loader_notify((uint64_t)(pass + 1) * png_height);
+  }
+  png_read_end(png, NULL);
+}
+
+/* Decodes the rows of the file with libpng up to the last one of the crop,
+ * and stores the pixels inside it. Interlaced files are read pass by pass,
+ * and each pixel of a pass is repeated over the part of its block inside the
+ * crop, like fill_pass_blocks. */
+static void read_cropped_rows(void) {
+  uint32_t pixel_size = png_pixel_size;
+  size_t row_size = (size_t)png_stride * pixel_size;
+  uint8_t *rows = png_indices != NULL ? png_indices : (uint8_t *)png_pixels;
+  uint8_t *image_bytes = (uint8_t *)image_row;
+  uint32_t crop_right = crop_x + png_width;
+  uint32_t crop_bottom = crop_y + png_height;
+  for (int pass = 0; pass < png_passes; pass++) {
+    uint32_t first_row = 0;
+    uint32_t row_step = 1;
+    uint32_t first = 0;
+    uint32_t step = 1;
+    uint32_t width = image_width;
+    uint32_t height = decoded_height;
+    uint32_t block_width = 1;
+    uint32_t block_height = 1;
+    if (png_passes != 1) {
+      first_row = PNG_PASS_START_ROW(pass);
+      row_step = PNG_PASS_ROW_OFFSET(pass);
+      first = PNG_PASS_START_COL(pass);
+      step = PNG_PASS_COL_OFFSET(pass);
+      width = PNG_PASS_COLS(image_width, pass);
+      /* libpng skips passes without pixels. */
+      height = width == 0 ? 0 : PNG_PASS_ROWS(image_height, pass);
+      block_width = pass_block_width[pass];
+      block_height = pass_block_height[pass];
+    }
+    for (uint32_t i = 0; i < height; i++) {
+      uint32_t y = first_row + i * row_step;
+      png_read_row(png, image_bytes, NULL);
+      uint32_t top = y > crop_y ? y : crop_y;
+      uint32_t bottom =
+          y + block_height < crop_bottom ? y + block_height : crop_bottom;
+      if (top >= bottom) {
+        continue;
+      }
+      if (png_passes == 1) {
+        uint8_t *row = rows + (size_t)(y - crop_y) * row_size;
+        memcpy(row, image_bytes + (size_t)crop_x * pixel_size,
+               (size_t)png_width * pixel_size);
+        if (png_may_be_translucent && png_indices != NULL) {
+          check_indices(row, png_width, 0, 1);
+        } else if (png_may_be_translucent) {
+          premultiply_pixels((uint32_t *)row, png_width, 0, 1);
+        }
+        row_decoded(y + 1 - crop_y);
+        continue;
+      }
+      if (png_may_be_translucent && png_indices != NULL) {
+        check_indices(image_bytes, width, 0, 1);
+      } else if (png_may_be_translucent) {
+        premultiply_pixels(image_row, width, 0, 1);
+      }
+      for (uint32_t j = 0; j < width; j++) {
+        uint32_t x = first + j * step;
+        uint32_t left = x > crop_x ? x : crop_x;
+        uint32_t right =
+            x + block_width < crop_right ? x + block_width : crop_right;
+        for (uint32_t block_y = top; block_y < bottom; block_y++) {
+          uint8_t *row = rows + (size_t)(block_y - crop_y) * row_size;
+          for (uint32_t block_x = left; block_x < right; block_x++) {
+            memcpy(row + (size_t)(block_x - crop_x) * pixel_size,
+                   image_bytes + (size_t)j * pixel_size, pixel_size);
+          }
+        }
+      }
+    }
+    loader_notify((uint64_t)(pass + 1) * png_height);
+  }
+  /* The rest of the file isn't needed, so it's not read. */
+}
+
+static struct unfilter inflated_rows;
+
+/* Unfilters and stores the rows that the inflated bytes complete. */
+static bool store_inflated(const uint8_t *data, size_t size) {
+  while (size != 0 && inflated_rows.y < decoded_height) {
+    size_t used = unfilter_fill(&inflated_rows, data, size);
+    data += used;
+    size -= used;
+    if (unfilter_complete(&inflated_rows)) {
+      uint32_t y = inflated_rows.y;
+      const uint8_t *row = unfilter_next(&inflated_rows);
+      if (png_reduction != 1) {
+        store_argb(image_row, row, image_width);
+        reduce_row(y);
+      } else if (y >= crop_y) {
+        /* Rows above a crop are only unfiltered for the rows below. */
+        size_t offset = (size_t)(y - crop_y) * png_stride;
+        if (png_cropped) {
+          store_cropped(png_indices != NULL ? (void *)(png_indices + offset)
+                                            : (void *)(png_pixels + offset),
+                        row);
+        } else if (png_indices != NULL) {
+          store_indices(png_indices + offset, row);
+        } else {
+          store_pixels(png_pixels + offset, row);
+        }
+        row_decoded(inflated_rows.y - crop_y);
+      }
+    }
+  }
+  return inflated_rows.y < decoded_height;
+}
+
+/* Inflates the IDAT chunks on this thread into store_inflated. */
+static void inflate_rows(void) {
+  z_stream stream = {0};
+  int result = inflateInit(&stream);
+  assert(result == Z_OK);
+  struct idat_reader reader;
+  idat_reader_init(&reader, 0, SIZE_MAX);
+  uint8_t *output = malloc(INFLATE_OUTPUT_SIZE);
+  assert(output != NULL);
+  bool more = true;
+  while (more) {
+    if (stream.avail_in == 0) {
+      if (stream.next_in != NULL) {
+        drop_read_pages(stream.next_in - file_data);
+      }
+      bool read = idat_read(&reader, &stream);
+      assert(read);
+    }
+    stream.next_out = output;
+    stream.avail_out = INFLATE_OUTPUT_SIZE;
+    result = inflate(&stream, Z_NO_FLUSH);
+    assert(result == Z_OK || result == Z_BUF_ERROR ||
+           result == Z_STREAM_END);
+    more = store_inflated(output, stream.next_out - output);
+    /* The stream ended before the last row. */
+    assert(!more || result != Z_STREAM_END);
+  }
+  free(output);
+  inflateEnd(&stream);
+}
+
+/* Arguments of loader_start, and whether loader_open is done with them. */
+static bool open_share_pixels;
+static bool open_index_rows;
+static bool opened = false;
+static pthread_mutex_t open_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t open_done = PTHREAD_COND_INITIALIZER;
+
+static void *loader_thread(__attribute__((unused)) void *data) {
+  loader_open(open_share_pixels, open_index_rows);
+  pthread_mutex_lock(&open_mutex);
+  opened = true;
+  pthread_cond_broadcast(&open_done);
+  pthread_mutex_unlock(&open_mutex);
+
+  /* The segments inflated ahead would take more memory than a reduced
+   * image, which is inflated here while the pages of the file are dropped
+   * behind it, and would read the file past the last row of a crop. */
+  bool parallel = !png_row_index && png_idat_mapped && png_reduction == 1 &&
+                  !png_cropped &&
+                  parallel_inflate_init((size_t)image_height *
+                                        (png_raw_row_size + 1));
+  if (png_row_index) {
+    row_index_build(row_index_decoded);
+    loader_notify(png_height);
+  } else if (parallel || (png_idat_mapped &&
+                          unfilter_is_vectorized(png_raw_pixel_size))) {
+    /* Unfiltering with vector instructions pays off even on one thread. */
+    unfilter_init(&inflated_rows, png_raw_row_size, png_raw_pixel_size, NULL,
+                  0);
+    if (parallel) {
+      parallel_inflate(store_inflated);
+    } else {
+      inflate_rows();
+    }
+    unfilter_finish(&inflated_rows);
+    assert(inflated_rows.y == decoded_height);
+    loader_notify(png_height);
+  } else if (png_reduction != 1) {
+    read_reduced_rows();
+  } else if (png_cropped) {
+    read_cropped_rows();
+  } else {
+    read_rows();
+  }
+  png_destroy_read_struct(&png, &info, NULL);
+  arena_destroy();
+  if (png_reduction != 1) {
+    free(block_sums);
+    free(block_counts);
+    free(image_raw_row);
+  }
+  free(image_row);
+  if (png_animated) {
+    apng_start();
+  }
+  if (png_row_index || png_animated) {
+    /* Kept for decoding the bands or frames again, which reads them in no
+     * particular order. */
+    madvise(file_data, file_size, MADV_NORMAL);
+  } else if (file_data != NULL) {
+    munmap(file_data, file_size);
+  } else {
+    free(read_buffer);
+  }
+  close(file_fd);
+#ifdef DEBUG
+  fprintf(stderr, "libpng made %u allocations from %u blocks\n",
+          arena_allocations, arena_blocks);
+#endif
+  return NULL;
+}
+
+void loader_crop(uint32_t x, uint32_t y, uint32_t width, uint32_t height) {
+  assert(x < png_width && y < png_height);
+  crop_x = x;
+  crop_y = y;
+  png_width = width < png_width - x ? width : png_width - x;
+  png_height = height < png_height - y ? height : png_height - y;
+  assert(png_width != 0 && png_height != 0);
+  png_cropped = true;
+}
+
+void loader_start(bool share_pixels, bool index_rows, uint32_t reduction) {
+  assert(reduction == 1 || !png_cropped);
+  if (reduction != 1) {
+    png_reduction = reduction;
+    png_width = (png_width + reduction - 1) / reduction;
+    png_height = (png_height + reduction - 1) / reduction;
+    png_pixel_size = 4;
+  }
+  open_share_pixels = share_pixels;
+  open_index_rows = index_rows;
+  pthread_t thread;
+  int error = pthread_create(&thread, NULL, loader_thread, NULL);
+  assert(error == 0);
+  pthread_detach(thread);
+}
+
+void loader_wait_open(void) {
+  pthread_mutex_lock(&open_mutex);
+  while (!opened) {
+    pthread_cond_wait(&open_done, &open_mutex);
+  }
+  pthread_mutex_unlock(&open_mutex);
+}
+
+int loader_get_fd(void) { return loader_fd; }
+
+const void *loader_lock_rows(uint32_t y, uint32_t *end_row) {
+  if (png_row_index) {
+    return row_index_lock(y, end_row);
+  }
+  *end_row = png_height;
+  if (png_indices != NULL) {
+    return png_indices + (size_t)y * png_stride;
+  }
+  return png_pixels + (size_t)y * png_stride;
+}
+
+void loader_unlock_rows(uint32_t y) {
+  if (png_row_index) {
+    row_index_unlock(y);
+  }
+}
+
+void loader_changed_rows(uint64_t progress, uint32_t *first_row,
+                         uint32_t *last_row) {
+  uint64_t pass = progress / png_height;
+  uint64_t current_pass = png_progress / png_height;
+  if (progress == png_progress) {
+    *first_row = 0;
+    *last_row = 0;
+  } else if (current_pass == pass) {
+    *first_row = progress % png_height;
+    *last_row = png_progress % png_height;
+  } else if (current_pass == pass + 1 && png_progress % png_height == 0) {
+    *first_row = progress % png_height;
+    *last_row = png_height;
+  } else {
+    *first_row = 0;
+    *last_row = png_height;
+  }
+}
+
+bool loader_poll(uint32_t *first_row, uint32_t *last_row) {
+  uint64_t value;
+  ssize_t size = read(loader_fd, &value, sizeof(value));
+  assert(size == sizeof(value) || errno == EAGAIN);
+
+  uint64_t progress =
+      atomic_load_explicit(&loader_progress, memory_order_acquire);
+  if (progress == png_progress) {
+    return false;
+  }
+
+  uint64_t polled_progress = png_progress;
+  png_progress = progress;
+  loader_changed_rows(polled_progress, first_row, last_row);
+  png_opaque = !atomic_load_explicit(&png_translucent, memory_order_relaxed);
+  png_rows_ready = progress >= png_height ? png_height : progress;
+  png_decoding = progress < (uint64_t)png_passes * png_height;
+  return true;
+}
@@ -1,15 +1,23 @@
 #include <assert.h>
+#include <poll.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/mman.h>
-#include <syscall.h>
+#include <time.h>
 #include <unistd.h>
 
-#include <png.h>
+#include <apng.h>
+#include <buffer.h>
+#include <damage.h>
+#include <loader.h>
+#include <mipmap.h>
+#include <scale.h>
+#include <single-pixel-buffer-v1.h>
+#include <thread-pool.h>
+#include <viewporter.h>
 #include <wayland-client.h>
 #include <xdg-shell.h>
 #include <zxdg-decoration.h>
@@ -18,6 +26,10 @@ static struct wl_compositor *wayland_compositor;
 static struct xdg_wm_base *wayland_xdg_wm_base;
 static struct zxdg_decoration_manager_v1 *wayland_zxdg_decoration_manager_v1;
 static struct wl_shm *wayland_shm;
+static struct wl_subcompositor *wayland_subcompositor;
+static struct wp_viewporter *wayland_wp_viewporter;
+static struct wp_single_pixel_buffer_manager_v1
+    *wayland_wp_single_pixel_buffer_manager_v1;
 
 static void wayland_registry_global_listener(
     __attribute__((unused)) void *data, struct wl_registry *wayland_registry,
@@ -34,6 +46,16 @@ static void wayland_registry_global_listener(
   } else if (strcmp(interface, "wl_shm") == 0) {
     wayland_shm =
         wl_registry_bind(wayland_registry, name, &wl_shm_interface, version);
+  } else if (strcmp(interface, "wl_subcompositor") == 0) {
+    wayland_subcompositor = wl_registry_bind(wayland_registry, name,
+                                             &wl_subcompositor_interface, 1);
+  } else if (strcmp(interface, "wp_viewporter") == 0) {
+    wayland_wp_viewporter = wl_registry_bind(wayland_registry, name,
+                                             &wp_viewporter_interface, 1);
+  } else if (strcmp(interface, "wp_single_pixel_buffer_manager_v1") == 0) {
+    wayland_wp_single_pixel_buffer_manager_v1 = wl_registry_bind(
+        wayland_registry, name, &wp_single_pixel_buffer_manager_v1_interface,
+        1);
   }
 }
 
@@ -45,30 +67,72 @@ wayland_xdg_wm_base_ping_listener(__attribute__((unused)) void *data,
 }
 
 static bool should_resize = true;
-static bool should_recommit = false;
 static bool size_changed = false;
+static bool configured = false;
+/* Only the most recent configure is acknowledged, right before the commit
+ * that applies it. */
+static bool configure_pending = false;
+static uint32_t configure_serial;
+/* The compositor doesn't show the surface, so rendering is pointless. */
+static bool suspended = false;
+/* Maximized, fullscreen or tiled, where the window has to be exactly the
+ * configured size. */
+static bool size_fixed = false;
+/* A frame callback was requested and not done yet, rendering waits for it so
+ * that at most one frame is drawn per refresh. */
+static bool frame_pending = false;
 
 static int32_t window_width;
 static int32_t window_height;
 static int32_t bounds_width = INT32_MAX;
 static int32_t bounds_height = INT32_MAX;
 
-static void
-wayland_xdg_surface_configure_listener(__attribute__((unused)) void *data,
-                                       struct xdg_surface *xdg_surface,
-                                       uint32_t serial) {
-  xdg_surface_ack_configure(xdg_surface, serial);
+static void wayland_xdg_surface_configure_listener(
+    __attribute__((unused)) void *data,
+    __attribute__((unused)) struct xdg_surface *xdg_surface, uint32_t serial) {
+  configured = true;
   if (size_changed) {
     should_resize = true;
     size_changed = false;
   }
-  should_recommit = true;
+  configure_pending = true;
+  configure_serial = serial;
+}
+
+static void ack_configure(struct xdg_surface *wayland_xdg_surface) {
+  if (configure_pending) {
+    xdg_surface_ack_configure(wayland_xdg_surface, configure_serial);
+    configure_pending = false;
+  }
 }
 
 static void wayland_xdg_toplevel_configure_listener(
     __attribute__((unused)) void *data,
     __attribute__((unused)) struct xdg_toplevel *xdg_toplevel, int32_t width,
-    int32_t height, __attribute__((unused)) struct wl_array *states) {
+    int32_t height, struct wl_array *states) {
+  suspended = false;
+  bool was_size_fixed = size_fixed;
+  size_fixed = false;
+  uint32_t *state;
+  wl_array_for_each(state, states) {
+    switch (*state) {
+    case XDG_TOPLEVEL_STATE_SUSPENDED:
+      suspended = true;
+      break;
+    case XDG_TOPLEVEL_STATE_MAXIMIZED:
+    case XDG_TOPLEVEL_STATE_FULLSCREEN:
+    case XDG_TOPLEVEL_STATE_TILED_LEFT:
+    case XDG_TOPLEVEL_STATE_TILED_RIGHT:
+    case XDG_TOPLEVEL_STATE_TILED_TOP:
+    case XDG_TOPLEVEL_STATE_TILED_BOTTOM:
+      size_fixed = true;
+      break;
+    }
+  }
+  if (size_fixed != was_size_fixed) {
+    size_changed = true;
+  }
+
   if (width != 0) {
     window_width = width;
     if (window_width > bounds_width) {
@@ -88,6 +152,7 @@ static void wayland_xdg_toplevel_configure_listener(
 static void wayland_xdg_toplevel_close_listener(
     __attribute__((unused)) void *data,
     __attribute__((unused)) struct xdg_toplevel *xdg_toplevel) {
+  apng_report();
   exit(0);
 }
 
@@ -116,27 +181,541 @@ static void wayland_xdg_toplevel_wm_capabilities_handler(
     __attribute__((unused)) struct xdg_toplevel *xdg_toplevel,
     __attribute__((unused)) struct wl_array *capabilities) {}
 
+/* Set when the image is shown on a subsurface above a single pixel scaled up
+ * to the window size, so the padding is neither rendered nor uploaded. */
+static struct wl_subsurface *wayland_subsurface;
+static struct wp_viewport *wayland_background_wp_viewport;
+
+/* Set when the compositor scales a PNG sized buffer up to the surface size,
+ * otherwise the buffer is rendered at the surface size. */
+static struct wp_viewport *wayland_wp_viewport;
+
+/* Position and size of the surface showing the image, and the layout of the
+ * image in its buffer. */
+static int32_t surface_x;
+static int32_t surface_y;
+static int32_t surface_width;
+static int32_t surface_height;
+static int32_t buffer_width;
+static int32_t buffer_height;
+static int32_t x_padding;
+static int32_t y_padding;
+static int32_t scale;
+/* Size of the image in the window. When it is smaller than the PNG, the
+ * buffer shows mipmap level shown_level, which is source_width x
+ * source_height pixels, or with resample the levels are sampled down to this
+ * size. */
+static int32_t image_width;
+static int32_t image_height;
+static uint32_t shown_level = 0;
+static uint32_t source_width;
+static uint32_t source_height;
+static bool resample = false;
+static bool use_trilinear = false;
+/* Highest mipmap level that the layout reads. */
+static uint32_t needed_level = 0;
+
+static void wayland_surface_frame_done_listener(
+    __attribute__((unused)) void *data, struct wl_callback *wayland_callback,
+    __attribute__((unused)) uint32_t time) {
+  wl_callback_destroy(wayland_callback);
+  frame_pending = false;
+}
+
+static const struct wl_callback_listener wayland_surface_frame_listener = {
+    wayland_surface_frame_done_listener};
+
+/* Requests a frame callback with the next commit and holds back rendering
+ * until it's done. */
+static void request_frame(struct wl_surface *wayland_surface) {
+  struct wl_callback *wayland_callback = wl_surface_frame(wayland_surface);
+  assert(wayland_callback != NULL);
+  wl_callback_add_listener(wayland_callback, &wayland_surface_frame_listener,
+                           NULL);
+  frame_pending = true;
+}
+
+/* Frame of an animation shown instead of the decoded image, and how many
+ * frames were shown before. */
+static const uint32_t *animation_frame = NULL;
+static uint64_t animation_frames = 0;
+
+/* Reads row y of the image, or of the animation frame shown, as
+ * premultiplied ARGB for the mipmap levels. */
+static void read_image_row(uint32_t *destination, uint32_t y) {
+  if (animation_frame != NULL) {
+    memcpy(destination, animation_frame + (size_t)y * png_stride,
+           png_width * 4);
+    return;
+  }
+  uint32_t end_row;
+  const void *row = loader_lock_rows(y, &end_row);
+  if (png_pixel_size == 1) {
+    scale_row_indexed(destination, row, png_palette, png_width, 1);
+  } else {
+    memcpy(destination, row, png_width * 4);
+  }
+  loader_unlock_rows(y);
+}
+
+/* Opaque black, so the padding looks the same in XRGB and ARGB buffers. */
+static const uint32_t background = 0xFF000000;
+
+/* Time the main loop spends building mipmap levels between two checks for
+ * events. */
+#define MIPMAP_BUDGET 4000000
+
+static void fill_pixels(uint32_t *pixels, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    pixels[i] = background;
+  }
+}
+
+/* Renders the window rows [window_y_begin, window_y_end) of the scaled image
+ * area on thread. Rows of the PNG or its levels that are not decoded or
+ * built yet are left black. */
+static void render_rows(uint32_t *pixel_data, int32_t window_y_begin,
+                        int32_t window_y_end, uint32_t thread) {
+  int32_t area_width = buffer_width - x_padding * 2;
+  int32_t scaled_width = resample ? image_width : (int32_t)source_width * scale;
+  uint32_t rows_ready =
+      shown_level != 0 ? mipmap_rows_ready(shown_level) : png_rows_ready;
+  /* PNG rows [rows_begin, rows_end) locked at rows. */
+  const void *rows = NULL;
+  uint32_t rows_begin = 0;
+  uint32_t rows_end = 0;
+  for (int32_t window_y = window_y_begin; window_y < window_y_end;
+       window_y++) {
+    uint32_t *row = pixel_data + (size_t)(y_padding + window_y) * buffer_width;
+    fill_pixels(row, x_padding);
+
+    uint32_t png_y = window_y / scale;
+    if (resample) {
+      if (window_y >= image_height ||
+          !mipmap_resample_row(row + x_padding, window_y, thread)) {
+        fill_pixels(row + x_padding, scaled_width);
+      }
+    } else if (png_y >= rows_ready) {
+      fill_pixels(row + x_padding, scaled_width);
+    } else if (window_y != window_y_begin && window_y % scale != 0) {
+      /* The row above shows the same PNG row, so copy instead of scaling it
+       * again. */
+      memcpy(row + x_padding, row - buffer_width + x_padding,
+             scaled_width * 4);
+    } else if (shown_level != 0) {
+      scale_row(row + x_padding, mipmap_row(shown_level, png_y), source_width,
+                scale);
+    } else if (animation_frame != NULL) {
+      scale_row(row + x_padding, animation_frame + (size_t)png_y * png_stride,
+                png_width, scale);
+    } else {
+      if (rows == NULL || png_y >= rows_end) {
+        if (rows != NULL) {
+          loader_unlock_rows(rows_begin);
+        }
+        rows = loader_lock_rows(png_y, &rows_end);
+        rows_begin = png_y;
+      }
+      size_t offset = (size_t)(png_y - rows_begin) * png_stride;
+      if (png_pixel_size == 1) {
+        scale_row_indexed(row + x_padding, (const uint8_t *)rows + offset,
+                          png_palette, png_width, scale);
+      } else {
+        scale_row(row + x_padding, (const uint32_t *)rows + offset,
+                  png_width, scale);
+      }
+    }
+
+    fill_pixels(row + x_padding + scaled_width,
+                area_width - scaled_width + x_padding);
+  }
+  if (rows != NULL) {
+    loader_unlock_rows(rows_begin);
+  }
+}
+
+/* First window row of the image area showing row png_y of the PNG or the
+ * level shown. */
+static int32_t window_rows_begin(uint32_t png_y) { return png_y * scale; }
+
+/* End of the window rows showing PNG rows up to png_y, including the black
+ * rows that are left over at the bottom of the image area. */
+static int32_t window_rows_end(uint32_t png_y) {
+  if (png_y == source_height) {
+    return buffer_height - y_padding * 2;
+  }
+  return png_y * scale;
+}
+
+/* Stores the window rows [*window_y_begin, *window_y_end) of the image area
+ * that show PNG rows [first_row, last_row), or with a mipmap level those
+ * that read the rows of it built from them. */
+static void window_rows(uint32_t first_row, uint32_t last_row,
+                        int32_t *window_y_begin, int32_t *window_y_end) {
+  if (first_row >= last_row) {
+    *window_y_begin = 0;
+    *window_y_end = 0;
+  } else if (resample) {
+    uint32_t first_y;
+    uint32_t last_y;
+    mipmap_resample_rows(first_row, last_row, &first_y, &last_y);
+    *window_y_begin = first_y;
+    *window_y_end = last_y;
+  } else {
+    /* Rows of a level average blocks of rows of the PNG, the last one cut
+     * off. */
+    *window_y_begin = window_rows_begin(first_row >> shown_level);
+    *window_y_end = window_rows_end(
+        (last_row + (1u << shown_level) - 1) >> shown_level);
+  }
+}
+
+/* Rows of the PNG that the rows of the levels shown are built from. The
+ * lower levels are built at least as far. */
+static uint32_t level_rows_ready(void) {
+  if (needed_level == 0) {
+    return png_rows_ready;
+  }
+  uint32_t rows = mipmap_rows_ready(needed_level) << needed_level;
+  return rows < png_height ? rows : png_height;
+}
+
+/* Stores the PNG rows [first_row, last_row) whose part of the levels shown
+ * differs from a frame that included the levels built from the first
+ * level_rows rows, if the PNG changed from changed_row on since. Changed
+ * rows invalidate every level row from theirs on, which are black until
+ * they are built again. */
+static void level_changed_rows(uint32_t level_rows, uint32_t changed_row,
+                               uint32_t *first_row, uint32_t *last_row) {
+  uint32_t rows_ready = level_rows_ready();
+  *first_row = level_rows < rows_ready ? level_rows : rows_ready;
+  *last_row = level_rows > rows_ready ? level_rows : rows_ready;
+  if (changed_row < *first_row) {
+    *first_row = changed_row;
+  }
+}
+
+struct render_job {
+  uint32_t *pixel_data;
+  int32_t window_y_begin;
+  int32_t window_y_end;
+  int32_t band_height;
+};
+
+static void render_band(void *data, uint32_t band, uint32_t thread) {
+  struct render_job *job = data;
+  int32_t window_y_begin = job->window_y_begin + band * job->band_height;
+  int32_t window_y_end = window_y_begin + job->band_height;
+  if (window_y_end > job->window_y_end) {
+    window_y_end = job->window_y_end;
+  }
+  render_rows(job->pixel_data, window_y_begin, window_y_end, thread);
+}
+
+/* Like render_rows, but splits the rows into bands rendered by the thread
+ * pool. */
+static void render_rows_parallel(uint32_t *pixel_data, int32_t window_y_begin,
+                                 int32_t window_y_end) {
+  /* A few bands per thread even out the threads that got preempted, and
+   * starting every band on a PNG row keeps the memcpy shortcut. */
+  uint32_t bands = thread_pool_size() * 4;
+  int32_t band_height =
+      (window_y_end - window_y_begin + bands - 1) / bands + scale - 1;
+  band_height -= band_height % scale;
+  if (band_height == 0) {
+    return;
+  }
+
+  struct render_job job = {pixel_data, window_y_begin, window_y_end,
+                           band_height};
+  thread_pool_run(render_band, &job,
+                  (window_y_end - window_y_begin + band_height - 1) /
+                      band_height);
+}
+
+/* Tells the compositor which parts of the surface it doesn't need to blend:
+ * everything for opaque images, otherwise just the padding. */
+static void set_opaque_region(struct wl_surface *wayland_surface, bool opaque,
+                              int32_t width, int32_t height) {
+  struct wl_region *wayland_region =
+      wl_compositor_create_region(wayland_compositor);
+  assert(wayland_region != NULL);
+  if (opaque) {
+    wl_region_add(wayland_region, 0, 0, width, height);
+  } else if (x_padding != 0) {
+    wl_region_add(wayland_region, 0, 0, x_padding, height);
+    wl_region_add(wayland_region, width - x_padding, 0, x_padding, height);
+  } else if (y_padding != 0) {
+    wl_region_add(wayland_region, 0, 0, width, y_padding);
+    wl_region_add(wayland_region, 0, height - y_padding, width, y_padding);
+  }
+  wl_surface_set_opaque_region(wayland_surface, wayland_region);
+  wl_region_destroy(wayland_region);
+}
+
+/* Brings the buffer up to date with the buffer layout and decoded rows. */
+static void render_buffer(struct buffer *buffer) {
+  uint32_t *pixel_data = buffer->pixel_data;
+  if (buffer->content_width != buffer_width ||
+      buffer->content_height != buffer_height ||
+      buffer->content_level != shown_level ||
+      buffer->content_resample != resample ||
+      buffer->content_frame != animation_frames) {
+    fill_pixels(pixel_data, (size_t)y_padding * buffer_width);
+    render_rows_parallel(pixel_data, 0, buffer_height - y_padding * 2);
+    fill_pixels(pixel_data + (size_t)(buffer_height - y_padding) * buffer_width,
+                (size_t)y_padding * buffer_width);
+    buffer->content_width = buffer_width;
+    buffer->content_height = buffer_height;
+    buffer->content_level = shown_level;
+    buffer->content_resample = resample;
+    buffer->content_frame = animation_frames;
+  } else {
+    uint32_t first_row;
+    uint32_t last_row;
+    loader_changed_rows(buffer->content_progress, &first_row, &last_row);
+    if (shown_level != 0 || resample) {
+      level_changed_rows(buffer->content_level_rows,
+                         first_row != last_row ? first_row : png_height,
+                         &first_row, &last_row);
+    }
+    int32_t window_y_begin;
+    int32_t window_y_end;
+    window_rows(first_row, last_row, &window_y_begin, &window_y_end);
+    if (window_y_begin < window_y_end) {
+      render_rows_parallel(pixel_data, window_y_begin, window_y_end);
+    }
+  }
+  buffer->content_progress = png_progress;
+  buffer->content_level_rows = level_rows_ready();
+}
+
+/* Fits the image into the window at the largest integer scale, or if the
+ * window is smaller, at the largest size that fits. A mipmap level of exactly
+ * that size is shown at 1:1, otherwise the next larger level is resampled to
+ * it, blended with the level below with use_trilinear. The image surface
+ * covers the whole window unless there is a subsurface for it. With a
+ * viewport the buffer only holds the PNG or the level that the compositor
+ * scales down, and without a subsurface the surface shrinks to the scaled
+ * image, as the padding can't be scaled from it. Windows of a fixed size
+ * can't shrink, so without a subsurface they are rendered like without a
+ * viewport. Stores whether the buffer has to be redrawn and whether any
+ * surface changed. */
+static void update_layout(bool *buffer_changed, bool *surfaces_changed) {
+  int32_t old_window_width = window_width;
+  int32_t old_window_height = window_height;
+  int32_t old_surface_x = surface_x;
+  int32_t old_surface_y = surface_y;
+  int32_t old_surface_width = surface_width;
+  int32_t old_surface_height = surface_height;
+  int32_t old_buffer_width = buffer_width;
+  int32_t old_buffer_height = buffer_height;
+  int32_t old_scale = scale;
+  uint32_t old_shown_level = shown_level;
+  bool old_resample = resample;
+  int32_t old_image_width = image_width;
+  int32_t old_image_height = image_height;
+
+  bool compositor_scaling =
+      wayland_wp_viewport != NULL &&
+      (wayland_subsurface != NULL || !size_fixed);
+  int32_t window_scale = 1;
+  int32_t window_x_padding = 0;
+  int32_t window_y_padding = 0;
+  shown_level = 0;
+  resample = false;
+  needed_level = 0;
+  if ((uint32_t)window_width >= png_width &&
+      (uint32_t)window_height >= png_height) {
+    if ((float)window_width / window_height > (float)png_width / png_height) {
+      window_scale = window_height / png_height;
+      window_x_padding = (window_width - png_width * window_scale) / 2;
+    } else {
+      window_scale = window_width / png_width;
+      window_y_padding = (window_height - png_height * window_scale) / 2;
+    }
+    image_width = png_width * window_scale;
+    image_height = png_height * window_scale;
+  } else {
+    /* The largest size with the aspect ratio of the PNG. */
+    if ((uint64_t)window_width * png_height >
+        (uint64_t)window_height * png_width) {
+      image_width = (uint64_t)png_width * window_height / png_height;
+      image_height = window_height;
+    } else {
+      image_width = window_width;
+      image_height = (uint64_t)png_height * window_width / png_width;
+    }
+    if (image_width == 0) {
+      image_width = 1;
+    }
+    if (image_height == 0) {
+      image_height = 1;
+    }
+    /* The smallest level that is still larger leaves less than half of the
+     * pixels to drop, which the compositor or bilinear sampling can do. */
+    while (shown_level + 1 < mipmap_level_count() &&
+           mipmap_width(shown_level + 1) >= (uint32_t)image_width &&
+           mipmap_height(shown_level + 1) >= (uint32_t)image_height) {
+      shown_level++;
+    }
+    needed_level = shown_level;
+    if (!compositor_scaling &&
+        (use_trilinear ||
+         mipmap_width(shown_level) != (uint32_t)image_width ||
+         mipmap_height(shown_level) != (uint32_t)image_height)) {
+      shown_level = 0;
+      resample = true;
+      needed_level =
+          mipmap_set_resample_size(image_width, image_height, use_trilinear);
+    }
+    window_x_padding = (window_width - image_width) / 2;
+    window_y_padding = (window_height - image_height) / 2;
+  }
+  source_width = mipmap_width(shown_level);
+  source_height = mipmap_height(shown_level);
+
+  surface_x = 0;
+  surface_y = 0;
+  if (wayland_subsurface != NULL) {
+    surface_x = window_x_padding;
+    surface_y = window_y_padding;
+    surface_width = image_width;
+    surface_height = image_height;
+    buffer_width = surface_width;
+    buffer_height = surface_height;
+    x_padding = 0;
+    y_padding = 0;
+    scale = window_scale;
+  } else {
+    surface_width = window_width;
+    surface_height = window_height;
+    buffer_width = window_width;
+    buffer_height = window_height;
+    x_padding = window_x_padding;
+    y_padding = window_y_padding;
+    scale = window_scale;
+  }
+  if (compositor_scaling) {
+    if (wayland_subsurface == NULL) {
+      surface_width = image_width;
+      surface_height = image_height;
+    }
+    buffer_width = source_width;
+    buffer_height = source_height;
+    x_padding = 0;
+    y_padding = 0;
+    scale = 1;
+  }
+
+  *buffer_changed = buffer_width != old_buffer_width ||
+                    buffer_height != old_buffer_height || scale != old_scale ||
+                    shown_level != old_shown_level ||
+                    resample != old_resample ||
+                    image_width != old_image_width ||
+                    image_height != old_image_height;
+  *surfaces_changed =
+      window_width != old_window_width || window_height != old_window_height ||
+      surface_x != old_surface_x || surface_y != old_surface_y ||
+      surface_width != old_surface_width ||
+      surface_height != old_surface_height;
+}
+
+/* Damages the image area of the PNG rows [first_row, last_row) in the
+ * attached buffer. */
+static void damage_rows(struct wl_surface *wayland_surface,
+                        uint32_t first_row, uint32_t last_row) {
+  int32_t window_y_begin;
+  int32_t window_y_end;
+  window_rows(first_row, last_row, &window_y_begin, &window_y_end);
+  if (window_y_begin < window_y_end) {
+    wl_surface_damage_buffer(wayland_surface, x_padding,
+                             y_padding + window_y_begin,
+                             buffer_width - x_padding * 2,
+                             window_y_end - window_y_begin);
+  }
+}
+
+/* Like wl_display_dispatch, but also returns when the loader has decoded new
+ * rows, and with animate when the next animation frame is due or was
+ * decoded. With busy it only handles the events that already arrived. */
+static void wayland_dispatch(struct wl_display *wayland_display, bool animate,
+                             bool busy) {
+  while (wl_display_prepare_read(wayland_display) != 0) {
+    wl_display_dispatch_pending(wayland_display);
+  }
+  wl_display_flush(wayland_display);
+  struct pollfd pollfds[] = {
+      {wl_display_get_fd(wayland_display), POLLIN, 0},
+      {loader_get_fd(), POLLIN, 0},
+      {animate ? apng_get_fd() : -1, POLLIN, 0},
+  };
+  poll(pollfds, 3, busy ? 0 : animate ? apng_timeout() : -1);
+  if (pollfds[0].revents & POLLIN) {
+    wl_display_read_events(wayland_display);
+  } else {
+    wl_display_cancel_read(wayland_display);
+  }
+  wl_display_dispatch_pending(wayland_display);
+}
+
 int main(int argc, char **argv) {
-  assert(argc == 2);
-  FILE *file = fopen(argv[1], "r");
-  assert(file != NULL);
-
-  png_structp png =
-      png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-  assert(png != NULL);
-  png_infop png_info = png_create_info_struct(png);
-  assert(png_info != NULL);
-  png_init_io(png, file);
-  png_set_filler(png, 0xFF, PNG_FILLER_AFTER);
-  png_read_png(png, png_info,
-               PNG_TRANSFORM_SCALE_16 | PNG_TRANSFORM_GRAY_TO_RGB |
-                   PNG_TRANSFORM_EXPAND | PNG_TRANSFORM_BGR,
-               NULL);
-
-  uint32_t **png_rows = (uint32_t **)png_get_rows(png, png_info);
-  assert(png_rows != NULL);
-  png_uint_32 png_height = png_get_image_height(png, png_info);
-  png_uint_32 png_width = png_get_image_width(png, png_info);
+  /* Usage: wayland-png-viewer [--viewporter] [--zero-copy] [--row-index]
+   * [--memory-budget MIB] [--crop X,Y,WIDTH,HEIGHT] [--trilinear] FILE */
+  const char *path = NULL;
+  bool use_viewporter = false;
+  bool use_zero_copy = false;
+  bool use_row_index = false;
+  size_t memory_budget = 0;
+  bool use_crop = false;
+  uint32_t crop[4];
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--crop") == 0) {
+      assert(i + 1 < argc);
+      int count = sscanf(argv[++i], "%u,%u,%u,%u", &crop[0], &crop[1],
+                         &crop[2], &crop[3]);
+      assert(count == 4);
+      use_crop = true;
+    } else if (strcmp(argv[i], "--memory-budget") == 0) {
+      assert(i + 1 < argc);
+      memory_budget = strtoull(argv[++i], NULL, 10) << 20;
+      assert(memory_budget != 0);
+    } else if (strcmp(argv[i], "--viewporter") == 0) {
+      use_viewporter = true;
+    } else if (strcmp(argv[i], "--zero-copy") == 0) {
+      use_zero_copy = true;
+    } else if (strcmp(argv[i], "--row-index") == 0) {
+      use_row_index = true;
+    } else if (strcmp(argv[i], "--trilinear") == 0) {
+      use_trilinear = true;
+    } else {
+      assert(path == NULL);
+      path = argv[i];
+    }
+  }
+  assert(path != NULL);
+  /* The window only needs the size of the image, so it is created while
+   * the loader thread reads the rest. */
+  struct png_header header;
+  loader_probe(path, &header);
+  if (use_crop) {
+    loader_crop(crop[0], crop[1], crop[2], crop[3]);
+  }
+  /* The row index sizes its cache by the number of threads. */
+  thread_pool_init();
+  /* Images that exceed the budget are only decoded once the bounds of the
+   * window are known, as the reduction depends on them. Crops are small
+   * enough already. */
+  uint32_t reduction = 1;
+  if (memory_budget != 0 && !use_crop) {
+    reduction =
+        loader_pick_reduction(&header, memory_budget, INT32_MAX, INT32_MAX);
+  }
+  if (reduction == 1) {
+    loader_start(use_zero_copy, use_row_index, 1);
+  }
+
+  scale_init();
 
   struct wl_display *wayland_display = wl_display_connect(NULL);
   assert(wayland_display != NULL);
@@ -162,6 +741,9 @@ int main(int argc, char **argv) {
   struct wl_surface *wayland_surface =
       wl_compositor_create_surface(wayland_compositor);
   assert(wayland_surface != NULL);
+  /* Surface showing the image, either wayland_surface or a subsurface of
+   * it. */
+  struct wl_surface *wayland_image_surface = wayland_surface;
 
   struct xdg_surface *wayland_xdg_surface =
       xdg_wm_base_get_xdg_surface(wayland_xdg_wm_base, wayland_surface);
@@ -198,14 +780,61 @@ int main(int argc, char **argv) {
   }
 #endif
 
-  int fd = syscall(SYS_memfd_create, "pixel_data", 0);
-  assert(fd != -1);
+  buffer_init(wayland_shm);
+
+  struct wl_buffer *wayland_background_buffer = NULL;
+  if (wayland_subcompositor != NULL && wayland_wp_viewporter != NULL) {
+    wayland_image_surface = wl_compositor_create_surface(wayland_compositor);
+    assert(wayland_image_surface != NULL);
+    wayland_subsurface = wl_subcompositor_get_subsurface(
+        wayland_subcompositor, wayland_image_surface, wayland_surface);
+    assert(wayland_subsurface != NULL);
+
+    wayland_background_wp_viewport =
+        wp_viewporter_get_viewport(wayland_wp_viewporter, wayland_surface);
+    assert(wayland_background_wp_viewport != NULL);
+    if (wayland_wp_single_pixel_buffer_manager_v1 != NULL) {
+      wayland_background_buffer =
+          wp_single_pixel_buffer_manager_v1_create_u32_rgba_buffer(
+              wayland_wp_single_pixel_buffer_manager_v1, 0, 0, 0, UINT32_MAX);
+      assert(wayland_background_buffer != NULL);
+    } else {
+      wayland_background_buffer = buffer_create_single_pixel(background);
+    }
+  }
+#ifdef DEBUG
+  else {
+    fwrite("Could not render the padding on the compositor\n", 48, 1,
+           stderr);
+  }
+#endif
 
-  struct wl_shm_pool *wayland_shm_pool = wl_shm_create_pool(wayland_shm, fd, 1);
-  assert(wayland_shm_pool != NULL);
+  if (use_viewporter) {
+    if (wayland_wp_viewporter != NULL) {
+      wayland_wp_viewport = wp_viewporter_get_viewport(wayland_wp_viewporter,
+                                                       wayland_image_surface);
+      assert(wayland_wp_viewport != NULL);
+    }
+#ifdef DEBUG
+    else {
+      fwrite("Could not enable compositor-side scaling\n", 41, 1, stderr);
+    }
+#endif
+  }
 
   wl_surface_commit(wayland_surface);
 
+  if (reduction != 1) {
+    /* The bounds come with the first configure. */
+    wl_display_roundtrip(wayland_display);
+    reduction = loader_pick_reduction(&header, memory_budget, bounds_width,
+                                      bounds_height);
+    loader_start(use_zero_copy, use_row_index, reduction);
+#ifdef DEBUG
+    fprintf(stderr, "Reducing the image by %u to %ux%u\n", reduction,
+            png_width, png_height);
+#endif
+  }
   window_width = png_width * 16;
   if (window_width > bounds_width) {
     window_width = bounds_width;
@@ -214,84 +843,172 @@ int main(int argc, char **argv) {
   if (window_height > bounds_height) {
     window_height = bounds_height;
   }
-  size_t max_pool_size = 1;
+  /* Rendering needs the rows, the first configure usually arrives after
+   * them anyway. */
+  loader_wait_open();
+  mipmap_init(png_width, png_height, read_image_row);
+  /* PNG rows decoded since the last commit. */
+  struct damage damage = {0};
+  bool surface_opaque = png_opaque;
+  bool buffer_layout_changed = false;
+  bool surface_layout_changed = false;
+  bool buffer_attached = false;
+  bool surface_zero_copy = false;
+  uint64_t surface_frame = 0;
+  /* Mipmap rows were built since the last commit, and the PNG rows that
+   * the levels committed were built from. */
+  bool levels_changed = false;
+  uint32_t surface_level_rows = 0;
   for (;;) {
-    if (should_resize) {
-      if ((uint32_t)window_width < png_width) {
-        window_width = png_width;
-      }
-      if ((uint32_t)window_height < png_height) {
-        window_height = png_height;
+    uint32_t first_row;
+    uint32_t last_row;
+    if (loader_poll(&first_row, &last_row)) {
+      damage_add(&damage, first_row, last_row);
+      mipmap_invalidate(first_row);
+    }
+    bool rows_changed = damage.count != 0;
+    bool format_changed = surface_opaque != png_opaque;
+    /* Configures and decoded rows that arrive in the meantime are merged
+     * into the next frame. */
+    bool can_render = configured && !suspended && !frame_pending;
+    /* Animations play once the image is complete, a frame per frame
+     * callback at most. */
+    bool can_animate = can_render && !png_decoding;
+    if (can_animate && apng_update(&animation_frame)) {
+      animation_frames++;
+      mipmap_invalidate(0);
+    }
+    bool frame_changed = surface_frame != animation_frames;
+    if (can_render && should_resize) {
+      /* Configures often repeat the size, only a different layout needs
+       * work. */
+      bool buffer_changed;
+      bool surfaces_changed;
+      update_layout(&buffer_changed, &surfaces_changed);
+      if (buffer_changed) {
+        buffer_layout_changed = true;
       }
-      size_t size = 4 * window_width * window_height;
-      if (size > max_pool_size) {
-        wl_shm_pool_resize(wayland_shm_pool, size);
-        ftruncate(fd, size);
-        max_pool_size = size;
+      if (surfaces_changed) {
+        surface_layout_changed = true;
       }
-
-      int32_t x_padding = 0;
-      int32_t y_padding = 0;
-      int32_t scale = 1;
-      if ((float)window_width / window_height > (float)png_width / png_height) {
-        scale = window_height / png_height;
-        x_padding = (window_width - png_width * scale) / 2;
-      } else {
-        scale = window_width / png_width;
-        y_padding = (window_height - png_height * scale) / 2;
+      should_resize = false;
+    }
+    /* Levels follow the decoded rows a few milliseconds at a time, so they
+     * never hold up a frame for long, but animation frames are only shown
+     * with all of them. */
+    bool levels_pending = false;
+    if ((shown_level != 0 || resample) &&
+        mipmap_update(needed_level, png_rows_ready,
+                      animation_frame != NULL ? UINT64_MAX : MIPMAP_BUDGET,
+                      &levels_pending)) {
+      levels_changed = true;
+    }
+    if (can_render &&
+        (buffer_layout_changed || surface_layout_changed || rows_changed ||
+         format_changed || frame_changed || levels_changed)) {
+      /* The buffer doesn't depend on the window size with a viewport or a
+       * subsurface, so a resize may only move and scale the surfaces. */
+      bool redraw = !buffer_attached || buffer_layout_changed ||
+                    rows_changed || format_changed || frame_changed ||
+                    levels_changed;
+      /* At 1:1 the decoded pixels can be shown as they are. */
+      bool zero_copy = png_pixels_fd != -1 && animation_frame == NULL &&
+                       shown_level == 0 && !resample && scale == 1 &&
+                       buffer_width == (int32_t)png_width &&
+                       buffer_height == (int32_t)png_height;
+      uint32_t format =
+          png_opaque ? WL_SHM_FORMAT_XRGB8888 : WL_SHM_FORMAT_ARGB8888;
+      struct buffer *buffer = NULL;
+      if (redraw && zero_copy) {
+        buffer = buffer_wrap(png_pixels_fd, png_pixels, png_width, png_height,
+                             png_stride * 4, format);
+      } else if (redraw) {
+        buffer = buffer_acquire(buffer_width, buffer_height, format);
       }
-
-      uint32_t *pixel_data = mmap(0, size, PROT_WRITE, MAP_SHARED, fd, 0);
-      assert(pixel_data != NULL);
-      memset(pixel_data, 0, y_padding * window_width * 4);
-      for (int32_t window_y = 0; window_y < window_height - y_padding * 2;
-           window_y++) {
-        memset(pixel_data + (y_padding + window_y) * window_width, 0,
-               x_padding * 4);
-        for (int32_t window_x = 0; window_x < window_width - x_padding * 2;
-             window_x++) {
-          uint32_t png_y = window_y / scale;
-          uint32_t png_x = window_x / scale;
-
-          uint32_t pixel_value;
-          if (png_x >= png_width || png_y >= png_height) {
-            pixel_value = 0;
+      /* Otherwise every buffer is busy, try again after the next release. */
+      if (!redraw || buffer != NULL) {
+        if (buffer != NULL) {
+          if (!zero_copy) {
+            render_buffer(buffer);
+          }
+          buffer_attach(buffer, wayland_image_surface);
+          /* The compositor has the previous frame, which only lacks the new
+           * rows and level rows unless the buffer was redrawn at a new size,
+           * has a new format or shows the pixels that weren't decoded yet
+           * differently. */
+          if (format_changed || !buffer_attached || buffer_layout_changed ||
+              frame_changed || zero_copy != surface_zero_copy) {
+            wl_surface_damage_buffer(wayland_image_surface, 0, 0,
+                                     buffer_width, buffer_height);
+          } else if (shown_level != 0 || resample) {
+            uint32_t first_row;
+            uint32_t last_row;
+            level_changed_rows(
+                surface_level_rows,
+                damage.count != 0 ? damage.ranges[0].first_row : png_height,
+                &first_row, &last_row);
+            damage_rows(wayland_image_surface, first_row, last_row);
           } else {
-            pixel_value = png_rows[png_y][png_x];
-
-            uint8_t alpha = pixel_value >> 24;
-            if (alpha != 0xFF) {
-              uint8_t red = ((pixel_value >> 16) & 0xFF) * alpha / 0xFF;
-              uint8_t green = ((pixel_value >> 8) & 0xFF) * alpha / 0xFF;
-              uint8_t blue = (pixel_value & 0xFF) * alpha / 0xFF;
-              pixel_value = alpha << 24 | red << 16 | green << 8 | blue;
+            for (uint32_t i = 0; i < damage.count; i++) {
+              damage_rows(wayland_image_surface, damage.ranges[i].first_row,
+                          damage.ranges[i].last_row);
             }
           }
-          pixel_data[(y_padding + window_y) * window_width + x_padding +
-                     window_x] = pixel_value;
         }
-        memset(pixel_data + (y_padding + window_y + 1) * window_width -
-                   x_padding,
-               0, x_padding * 4);
+        if (surface_layout_changed) {
+          if (wayland_wp_viewport != NULL) {
+            wp_viewport_set_destination(wayland_wp_viewport, surface_width,
+                                        surface_height);
+          }
+          if (wayland_subsurface != NULL) {
+            wl_subsurface_set_position(wayland_subsurface, surface_x,
+                                       surface_y);
+            wp_viewport_set_destination(wayland_background_wp_viewport,
+                                        window_width, window_height);
+            set_opaque_region(wayland_surface, true, window_width,
+                              window_height);
+          }
+        }
+        if (surface_layout_changed || format_changed) {
+          set_opaque_region(wayland_image_surface, png_opaque, surface_width,
+                            surface_height);
+        }
+        if (wayland_subsurface != NULL) {
+          if (!buffer_attached) {
+            wl_surface_attach(wayland_surface, wayland_background_buffer, 0,
+                              0);
+            wl_surface_damage_buffer(wayland_surface, 0, 0, 1, 1);
+          }
+          /* Applied together with the parent's commit. */
+          wl_surface_commit(wayland_image_surface);
+        }
+        ack_configure(wayland_xdg_surface);
+        request_frame(wayland_surface);
+        wl_surface_commit(wayland_surface);
+
+        surface_opaque = png_opaque;
+        if (buffer != NULL) {
+          damage_clear(&damage);
+          surface_level_rows = level_rows_ready();
+          buffer_attached = true;
+          surface_zero_copy = zero_copy;
+          surface_frame = animation_frames;
+          levels_changed = false;
+        }
+        buffer_layout_changed = false;
+        surface_layout_changed = false;
       }
-      memset(pixel_data + (window_height - y_padding) * window_width, 0,
-             y_padding * window_width * 4);
-      msync(pixel_data, size, MS_SYNC);
-      munmap(pixel_data, size);
-
-      should_resize = false;
     }
-    if (should_recommit) {
-      struct wl_buffer *wayland_buffer = wl_shm_pool_create_buffer(
-          wayland_shm_pool, 0, window_width, window_height, 4 * window_width,
-          WL_SHM_FORMAT_XRGB8888);
-      assert(wayland_buffer != NULL);
-
-      wl_surface_attach(wayland_surface, wayland_buffer, 0, 0);
+    if (configure_pending &&
+        ((!should_resize && !buffer_layout_changed &&
+          !surface_layout_changed) ||
+         suspended)) {
+      /* Nothing to render for this configure, but it still has to be
+       * acknowledged by a commit. */
+      ack_configure(wayland_xdg_surface);
       wl_surface_commit(wayland_surface);
-
-      should_recommit = false;
     }
-    wl_display_dispatch(wayland_display);
+    wayland_dispatch(wayland_display, can_animate && !frame_pending,
+                     levels_pending);
   }
 }
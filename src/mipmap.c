@@ -0,0 +1,412 @@
+#include <assert.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include <mipmap.h>
+#include <thread-pool.h>
+
+/* Enough levels for any image that fits into memory. */
+#define MAX_LEVELS 32
+/* Rows built per task, and tasks per thread between checks of the time
+ * budget. */
+#define BAND_HEIGHT 8
+#define BANDS_PER_THREAD 4
+
+struct level {
+  uint32_t width;
+  uint32_t height;
+  uint32_t stride;
+  /* Mapped when the level is built first. */
+  uint32_t *pixels;
+  uint32_t rows_ready;
+};
+
+static struct level levels[MAX_LEVELS];
+static uint32_t level_count;
+static mipmap_read_function read_row;
+/* Two rows of level 0 per thread, for the levels that read it. */
+static uint32_t *scratch_rows;
+
+/* sRGB to linear light in 16 bits, and back from the top 12 bits of that,
+ * which still tell apart the darkest sRGB values. */
+static uint16_t to_linear[256];
+static uint8_t to_srgb[4096];
+
+void mipmap_init(uint32_t width, uint32_t height, mipmap_read_function read) {
+  for (uint32_t value = 0; value < 256; value++) {
+    double color = value / 255.0;
+    double linear = color <= 0.04045 ? color / 12.92
+                                     : pow((color + 0.055) / 1.055, 2.4);
+    to_linear[value] = lround(linear * 65535);
+  }
+  for (uint32_t i = 0; i < 4096; i++) {
+    double linear = (i + 0.5) / 4096;
+    double color = linear <= 0.0031308
+                       ? linear * 12.92
+                       : 1.055 * pow(linear, 1 / 2.4) - 0.055;
+    to_srgb[i] = lround(color * 255);
+  }
+
+  read_row = read;
+  level_count = 0;
+  for (;;) {
+    struct level *level = &levels[level_count++];
+    level->width = width;
+    level->height = height;
+    /* Every row starts on a cache line. */
+    level->stride = (width + 15) & ~15u;
+    if (width == 1 && height == 1) {
+      break;
+    }
+    assert(level_count < MAX_LEVELS);
+    width = (width + 1) / 2;
+    height = (height + 1) / 2;
+  }
+  scratch_rows =
+      malloc((size_t)levels[0].width * 2 * thread_pool_size() * 4);
+  assert(scratch_rows != NULL);
+}
+
+uint32_t mipmap_level_count(void) { return level_count; }
+
+uint32_t mipmap_width(uint32_t level) { return levels[level].width; }
+
+uint32_t mipmap_height(uint32_t level) { return levels[level].height; }
+
+uint32_t mipmap_rows_ready(uint32_t level) { return levels[level].rows_ready; }
+
+const uint32_t *mipmap_row(uint32_t level, uint32_t y) {
+  return levels[level].pixels + (size_t)y * levels[level].stride;
+}
+
+void mipmap_invalidate(uint32_t first_row) {
+  for (uint32_t i = 1; i < level_count; i++) {
+    first_row /= 2;
+    if (levels[i].rows_ready > first_row) {
+      levels[i].rows_ready = first_row;
+    }
+  }
+}
+
+/* x / 255 for x <= 255 * 255, without the division. */
+static inline uint32_t divide_by_255(uint32_t x) {
+  return (x + 1 + (x >> 8)) >> 8;
+}
+
+/* Averages count premultiplied pixels in linear light, weighting their
+ * colors by their alpha. */
+static uint32_t average_pixels(const uint32_t *pixels, uint32_t count) {
+  uint32_t alpha_sum = 0;
+  uint32_t sums[3] = {0, 0, 0};
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t pixel = pixels[i];
+    uint32_t alpha = pixel >> 24;
+    alpha_sum += alpha;
+    for (uint32_t channel = 0; channel < 3; channel++) {
+      uint32_t value = (pixel >> (16 - channel * 8)) & 0xFF;
+      if (alpha == 0xFF) {
+        sums[channel] += to_linear[value] * 0xFF;
+      } else if (alpha != 0) {
+        /* The linear color is premultiplied, not the sRGB one. */
+        uint32_t color = (value * 0xFF + alpha / 2) / alpha;
+        sums[channel] += to_linear[color > 0xFF ? 0xFF : color] * alpha;
+      }
+    }
+  }
+  if (alpha_sum == 0) {
+    return 0;
+  }
+  uint32_t alpha = (alpha_sum + count / 2) / count;
+  uint32_t pixel = alpha << 24;
+  for (uint32_t channel = 0; channel < 3; channel++) {
+    uint32_t color = to_srgb[sums[channel] / alpha_sum >> 4];
+    if (alpha != 0xFF) {
+      color = divide_by_255(color * alpha);
+    }
+    pixel |= color << (16 - channel * 8);
+  }
+  return pixel;
+}
+
+/* Returns row y of level, read into the scratch rows of thread at slot if
+ * it is level 0. */
+static const uint32_t *get_row(uint32_t level, uint32_t y, uint32_t thread,
+                               uint32_t slot) {
+  if (level != 0) {
+    return mipmap_row(level, y);
+  }
+  uint32_t *row =
+      scratch_rows + ((size_t)thread * 2 + slot) * levels[0].width;
+  read_row(row, y);
+  return row;
+}
+
+/* Builds row y of level from the one below. */
+static void build_row(uint32_t level, uint32_t y, uint32_t thread) {
+  const struct level *source = &levels[level - 1];
+  uint32_t source_y = y * 2;
+  const uint32_t *top = get_row(level - 1, source_y, thread, 0);
+  const uint32_t *bottom = NULL;
+  if (source_y + 1 < source->height) {
+    bottom = get_row(level - 1, source_y + 1, thread, 1);
+  }
+  uint32_t *row = levels[level].pixels + (size_t)y * levels[level].stride;
+  for (uint32_t x = 0; x < levels[level].width; x++) {
+    uint32_t source_x = x * 2;
+    uint32_t pixels[4];
+    uint32_t count = 0;
+    pixels[count++] = top[source_x];
+    bool right = source_x + 1 < source->width;
+    if (right) {
+      pixels[count++] = top[source_x + 1];
+    }
+    if (bottom != NULL) {
+      pixels[count++] = bottom[source_x];
+      if (right) {
+        pixels[count++] = bottom[source_x + 1];
+      }
+    }
+    row[x] = average_pixels(pixels, count);
+  }
+}
+
+struct build_job {
+  uint32_t level;
+  uint32_t first_row;
+  uint32_t last_row;
+};
+
+static void build_band(void *data, uint32_t band, uint32_t thread) {
+  const struct build_job *job = data;
+  uint32_t first_row = job->first_row + band * BAND_HEIGHT;
+  uint32_t last_row = first_row + BAND_HEIGHT;
+  if (last_row > job->last_row) {
+    last_row = job->last_row;
+  }
+  for (uint32_t y = first_row; y < last_row; y++) {
+    build_row(job->level, y, thread);
+  }
+}
+
+static uint64_t now_nanoseconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+bool mipmap_update(uint32_t last_level, uint32_t ready_rows, uint64_t budget,
+                   bool *pending) {
+  uint64_t start = now_nanoseconds();
+  levels[0].rows_ready = ready_rows;
+  *pending = false;
+  bool built = false;
+  uint32_t batch_rows = thread_pool_size() * BANDS_PER_THREAD * BAND_HEIGHT;
+  for (uint32_t i = 1; i <= last_level && i < level_count; i++) {
+    struct level *level = &levels[i];
+    const struct level *source = &levels[i - 1];
+    /* Rows need both rows below them, except for the last one. */
+    uint32_t buildable = source->rows_ready == source->height
+                             ? level->height
+                             : source->rows_ready / 2;
+    while (level->rows_ready < buildable) {
+      if (now_nanoseconds() - start >= budget) {
+        *pending = true;
+        return built;
+      }
+      if (level->pixels == NULL) {
+        level->pixels = mmap(NULL, (size_t)level->stride * level->height * 4,
+                             PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        assert(level->pixels != MAP_FAILED);
+      }
+      struct build_job job = {i, level->rows_ready, buildable};
+      if (job.last_row - job.first_row > batch_rows) {
+        job.last_row = job.first_row + batch_rows;
+      }
+      thread_pool_run(build_band, &job,
+                      (job.last_row - job.first_row + BAND_HEIGHT - 1) /
+                          BAND_HEIGHT);
+      level->rows_ready = job.last_row;
+      built = true;
+#ifdef DEBUG
+      if (level->rows_ready == level->height) {
+        fprintf(stderr, "Built mipmap level %u of %ux%u pixels\n", i,
+                level->width, level->height);
+      }
+#endif
+    }
+  }
+  return built;
+}
+
+/* Column or row of a level to sample for one of the output, and the weight
+ * of the one after it out of 256. */
+struct sample {
+  uint32_t index;
+  uint32_t weight;
+};
+
+/* The two levels that mipmap_resample_row blends, the weight of the second
+ * out of 256, and the columns it samples from each. */
+static uint32_t resample_levels[2];
+static uint32_t resample_blend;
+static uint32_t resample_width;
+static uint32_t resample_height;
+static struct sample *resample_columns[2];
+static double resample_scale_y;
+
+/* Where output pixel i samples level, at scale pixels of level 0 per output
+ * pixel. */
+static struct sample find_sample(uint32_t i, double scale, uint32_t level) {
+  double position = (i + 0.5) * scale / (1u << level) - 0.5;
+  struct sample sample = {0, 0};
+  if (position > 0) {
+    sample.index = position;
+    sample.weight = lround((position - sample.index) * 256);
+    if (sample.weight == 256) {
+      sample.index++;
+      sample.weight = 0;
+    }
+  }
+  return sample;
+}
+
+/* Clamps sample to the last of size pixels. */
+static struct sample clamp_sample(struct sample sample, uint32_t size) {
+  if (sample.index >= size - 1) {
+    sample.index = size - 1;
+    sample.weight = 0;
+  }
+  return sample;
+}
+
+uint32_t mipmap_set_resample_size(uint32_t width, uint32_t height,
+                                  bool trilinear) {
+  double scale_x = (double)levels[0].width / width;
+  resample_scale_y = (double)levels[0].height / height;
+  double detail = log2(scale_x > resample_scale_y ? scale_x
+                                                  : resample_scale_y);
+  if (detail < 0) {
+    detail = 0;
+  }
+  resample_levels[0] = detail;
+  resample_blend =
+      trilinear ? lround((detail - resample_levels[0]) * 256) : 0;
+  if (resample_blend == 256) {
+    resample_levels[0]++;
+    resample_blend = 0;
+  }
+  if (resample_levels[0] >= level_count - 1) {
+    resample_levels[0] = level_count - 1;
+    resample_blend = 0;
+  }
+  resample_levels[1] =
+      resample_blend != 0 ? resample_levels[0] + 1 : resample_levels[0];
+
+  resample_width = width;
+  resample_height = height;
+  for (uint32_t i = 0; i < 2; i++) {
+    uint32_t level = resample_levels[i];
+    resample_columns[i] =
+        realloc(resample_columns[i], width * sizeof(*resample_columns[i]));
+    assert(resample_columns[i] != NULL);
+    for (uint32_t x = 0; x < width; x++) {
+      resample_columns[i][x] =
+          clamp_sample(find_sample(x, scale_x, level), levels[level].width);
+    }
+  }
+  return resample_levels[1];
+}
+
+/* Channel of a premultiplied pixel at shift, interpolated between the
+ * pixels at index and the one after it by weight. */
+static inline uint32_t mix(const uint32_t *row, struct sample column,
+                           uint32_t shift) {
+  uint32_t first = (row[column.index] >> shift) & 0xFF;
+  if (column.weight == 0) {
+    return first << 8;
+  }
+  uint32_t second = (row[column.index + 1] >> shift) & 0xFF;
+  return first * (256 - column.weight) + second * column.weight;
+}
+
+bool mipmap_resample_row(uint32_t *destination, uint32_t y, uint32_t thread) {
+  const uint32_t *rows[2][2];
+  struct sample samples[2];
+  for (uint32_t i = 0; i < 2; i++) {
+    uint32_t level = resample_levels[i];
+    samples[i] = clamp_sample(find_sample(y, resample_scale_y, level),
+                              levels[level].height);
+    uint32_t last_row = samples[i].index + (samples[i].weight != 0);
+    if (last_row >= levels[level].rows_ready) {
+      return false;
+    }
+  }
+  for (uint32_t i = 0; i < 2; i++) {
+    uint32_t level = resample_levels[i];
+    if (i == 1 && level == resample_levels[0]) {
+      rows[1][0] = rows[0][0];
+      rows[1][1] = rows[0][1];
+      continue;
+    }
+    /* Only one of the levels can be level 0, so both rows of it fit into
+     * the scratch rows. */
+    rows[i][0] = get_row(level, samples[i].index, thread, 0);
+    rows[i][1] = samples[i].weight != 0
+                     ? get_row(level, samples[i].index + 1, thread, 1)
+                     : rows[i][0];
+  }
+
+  /* Without a blend only the first level is sampled. */
+  uint32_t sampled_levels = resample_blend != 0 ? 2 : 1;
+  for (uint32_t x = 0; x < resample_width; x++) {
+    uint32_t pixel = 0;
+    for (uint32_t shift = 0; shift < 32; shift += 8) {
+      uint32_t values[2];
+      for (uint32_t i = 0; i < sampled_levels; i++) {
+        struct sample column = resample_columns[i][x];
+        uint32_t top = mix(rows[i][0], column, shift);
+        uint32_t bottom = mix(rows[i][1], column, shift);
+        values[i] =
+            top * (256 - samples[i].weight) + bottom * samples[i].weight;
+      }
+      values[1] = values[sampled_levels - 1];
+      uint32_t value =
+          (uint32_t)(((uint64_t)values[0] * (256 - resample_blend) +
+                      (uint64_t)values[1] * resample_blend + (1u << 23)) >>
+                     24);
+      pixel |= value << shift;
+    }
+    destination[x] = pixel;
+  }
+  return true;
+}
+
+void mipmap_resample_rows(uint32_t first_row, uint32_t last_row,
+                          uint32_t *first_y, uint32_t *last_y) {
+  *first_y = 0;
+  *last_y = 0;
+  for (uint32_t y = 0; y < resample_height; y++) {
+    for (uint32_t i = 0; i < 2; i++) {
+      uint32_t level = resample_levels[i];
+      struct sample sample = clamp_sample(
+          find_sample(y, resample_scale_y, level), levels[level].height);
+      /* Rows of the image that the level rows it reads were built from. */
+      uint32_t begin = sample.index << level;
+      uint32_t end = (sample.index + 1 + (sample.weight != 0)) << level;
+      if (begin < last_row && end > first_row) {
+        if (*first_y == *last_y) {
+          *first_y = y;
+        }
+        *last_y = y + 1;
+      }
+    }
+  }
+}
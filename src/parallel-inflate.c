@@ -0,0 +1,426 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <idat.h>
+#include <parallel-inflate.h>
+#include <thread-pool.h>
+#include <zlib.h>
+
+/* Smaller streams inflate in less time than starting the threads takes. */
+#ifndef MIN_STREAM_SIZE
+#define MIN_STREAM_SIZE (4 << 20)
+#endif
+/* A few segments per thread even out their different sizes, and a few more
+ * may be inflated ahead of the output to bound the memory. */
+#define SEGMENTS_PER_THREAD 4
+#define AHEAD_PER_THREAD 2
+/* Distance that deflate refers back at most. */
+#define WINDOW_SIZE 32768
+/* Output of the serial stream per call, and its input per call, which is
+ * small enough that segments can still start right after it. */
+#define OUTPUT_SIZE (256 << 10)
+#define INPUT_SIZE (64 << 10)
+/* Bytes that the search for a marker reads before it checks whether it
+ * should go on. */
+#define SCAN_SIZE (1 << 20)
+
+/* A full flush ends with an empty stored block, whose length fields are
+ * these bytes. */
+static const uint8_t flush_marker[4] = {0x00, 0x00, 0xFF, 0xFF};
+
+struct segment {
+  size_t begin;
+  /* SIZE_MAX until the next segment was found, and for the last one. */
+  size_t end;
+  uint8_t *output;
+  size_t output_size;
+  size_t output_capacity;
+  z_stream stream;
+  /* Inflated without referring to bytes before the segment. */
+  bool independent;
+  /* The stream stopped between two blocks at the end of the segment, or
+   * ended there. */
+  bool at_block;
+  bool ended;
+  /* Taken by a worker, or by the serial stream that got there first. */
+  bool claimed;
+  bool done;
+};
+
+/* Looks for flush markers in pieces of the stream that follow each other,
+ * including those split between two pieces. */
+struct marker_scan {
+  uint8_t tail[3];
+  uint32_t tail_size;
+};
+
+static size_t segment_size;
+static size_t output_limit;
+
+/* Everything below is guarded by the mutex. The first segment is the one
+ * that the serial stream inflates from the start of the stream on, and the
+ * others are found while it does. */
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t segments_changed = PTHREAD_COND_INITIALIZER;
+static struct segment *segments;
+static uint32_t segment_count;
+static uint32_t segment_capacity;
+/* Lowest segment that may not be claimed yet. */
+static uint32_t next_segment;
+/* Segment that the serial stream gets to next. Workers only claim segments
+ * up to ahead_segments after it. */
+static uint32_t serial_segment;
+static uint32_t ahead_segments;
+/* End of the input given to the serial stream so far. Segments that start
+ * before it would never be used. */
+static size_t serial_offset;
+/* Where a single thread at a time searches for the start of the segment
+ * after the last one, and whether it reached the end of the stream. */
+static size_t scan_offset;
+static struct marker_scan scan;
+static bool scanning;
+static bool scan_done;
+static bool stopping;
+
+bool parallel_inflate_init(size_t size) {
+  /* The rest of the file is mostly the stream. */
+  size_t stream_size = idat_size_bound();
+  if (stream_size < MIN_STREAM_SIZE || thread_pool_size() == 1) {
+    return false;
+  }
+  /* Valid segments never fill a buffer of this size. */
+  output_limit = size + 1;
+  segment_size = stream_size / (thread_pool_size() * SEGMENTS_PER_THREAD);
+  return true;
+}
+
+/* Returns the stream offset right after the first marker that ends in the
+ * size bytes of the stream at offset, or SIZE_MAX. */
+static size_t scan_markers(struct marker_scan *scan, const uint8_t *data,
+                           size_t size, size_t offset) {
+  /* Markers that start in the tail of the piece before. */
+  for (uint32_t i = 0; i < scan->tail_size; i++) {
+    uint32_t from_tail = scan->tail_size - i;
+    if (size >= sizeof(flush_marker) - from_tail &&
+        memcmp(scan->tail + i, flush_marker, from_tail) == 0 &&
+        memcmp(data, flush_marker + from_tail,
+               sizeof(flush_marker) - from_tail) == 0) {
+      return offset + sizeof(flush_marker) - from_tail;
+    }
+  }
+  const uint8_t *marker = memmem(data, size, flush_marker,
+                                 sizeof(flush_marker));
+  if (marker != NULL) {
+    return offset + (marker - data) + sizeof(flush_marker);
+  }
+  /* The tail of a piece shorter than it also keeps bytes from before. */
+  uint8_t bytes[sizeof(scan->tail) * 2];
+  memcpy(bytes, scan->tail, scan->tail_size);
+  size_t copied = size < sizeof(scan->tail) ? size : sizeof(scan->tail);
+  memcpy(bytes + scan->tail_size, data + size - copied, copied);
+  size_t total = scan->tail_size + copied;
+  scan->tail_size = total < sizeof(scan->tail) ? total : sizeof(scan->tail);
+  memcpy(scan->tail, bytes + total - scan->tail_size, scan->tail_size);
+  return SIZE_MAX;
+}
+
+/* Searches SCAN_SIZE bytes of the stream from scan_offset on for the start
+ * of the next segment. Called without the mutex by the scanning thread. */
+static size_t scan_next(bool *ended) {
+  struct idat_reader reader;
+  idat_reader_init(&reader, scan_offset, scan_offset + SCAN_SIZE);
+  z_stream input = {0};
+  size_t begin = SIZE_MAX;
+  bool read = true;
+  while (begin == SIZE_MAX && (read = idat_read(&reader, &input))) {
+    begin = scan_markers(&scan, input.next_in, input.avail_in,
+                         reader.offset - input.avail_in);
+  }
+  *ended = !read && reader.offset < reader.end;
+  scan_offset = reader.offset;
+  return begin;
+}
+
+/* Starts the search for the segment after one that begins at offset, so
+ * that segments are at least segment_size bytes long. */
+static void restart_scan(size_t offset) {
+  scan_offset = offset + segment_size - sizeof(flush_marker);
+  scan.tail_size = 0;
+}
+
+/* Inflates the input of the segment with stream into the output of the
+ * segment, and returns false on invalid data. */
+static bool inflate_segment(struct segment *segment, z_stream *stream) {
+  struct idat_reader reader;
+  idat_reader_init(&reader, segment->begin, segment->end);
+  int result = Z_OK;
+  bool any_input = false;
+  for (;;) {
+    if (stream->avail_in == 0) {
+      if (!idat_read(&reader, stream)) {
+        break;
+      }
+      any_input = true;
+    }
+    if (segment->output_size == segment->output_capacity) {
+      if (segment->output_capacity == output_limit) {
+        return false;
+      }
+      /* Most images compress to less than a quarter. */
+      size_t input_size =
+          segment->end != SIZE_MAX ? segment->end - segment->begin
+                                   : segment_size;
+      segment->output_capacity = segment->output_capacity == 0
+                                     ? input_size * 4
+                                     : segment->output_capacity * 2;
+      if (segment->output_capacity > output_limit) {
+        segment->output_capacity = output_limit;
+      }
+      segment->output = realloc(segment->output, segment->output_capacity);
+      assert(segment->output != NULL);
+    }
+    stream->next_out = segment->output + segment->output_size;
+    stream->avail_out = segment->output_capacity - segment->output_size;
+    result = inflate(stream, Z_NO_FLUSH);
+    segment->output_size = stream->next_out - segment->output;
+    if (result == Z_STREAM_END) {
+      break;
+    }
+    if (result != Z_OK && result != Z_BUF_ERROR) {
+      return false;
+    }
+  }
+  /* Within a block or at the end, the next segment didn't start a block. */
+  segment->ended = result == Z_STREAM_END;
+  segment->at_block = segment->ended || ((stream->data_type & 128) != 0 &&
+                                         (stream->data_type & 64) == 0 &&
+                                         (stream->data_type & 63) == 0);
+  return any_input;
+}
+
+/* Inflates the segments ahead of the serial stream, and searches for more
+ * of them while there is nothing to inflate. */
+static void *worker_thread(__attribute__((unused)) void *data) {
+  pthread_mutex_lock(&mutex);
+  while (!stopping) {
+    while (next_segment < segment_count && segments[next_segment].claimed) {
+      next_segment++;
+    }
+    /* A segment can be inflated once its end is known. */
+    if (next_segment < segment_count &&
+        next_segment < serial_segment + ahead_segments &&
+        (next_segment + 1 < segment_count || scan_done)) {
+      struct segment *segment = &segments[next_segment];
+      segment->claimed = true;
+      pthread_mutex_unlock(&mutex);
+
+      int result = inflateInit2(&segment->stream, -15);
+      assert(result == Z_OK);
+      segment->independent = inflate_segment(segment, &segment->stream);
+
+      pthread_mutex_lock(&mutex);
+      segment->done = true;
+      pthread_cond_broadcast(&segments_changed);
+    } else if (!scanning && !scan_done &&
+               segment_count - 1 < serial_segment + ahead_segments &&
+               segment_count < segment_capacity) {
+      scanning = true;
+      /* The serial stream got past the search without a segment. */
+      if (scan_offset < serial_offset) {
+        restart_scan(serial_offset);
+      }
+      pthread_mutex_unlock(&mutex);
+
+      bool ended;
+      size_t begin = scan_next(&ended);
+
+      pthread_mutex_lock(&mutex);
+      if (begin != SIZE_MAX && begin > serial_offset) {
+        segments[segment_count - 1].end = begin;
+        struct segment *segment = &segments[segment_count++];
+        memset(segment, 0, sizeof(*segment));
+        segment->begin = begin;
+        segment->end = SIZE_MAX;
+        restart_scan(begin);
+      } else if (begin != SIZE_MAX) {
+        restart_scan(serial_offset);
+      }
+      scan_done = ended;
+      scanning = false;
+      pthread_cond_broadcast(&segments_changed);
+    } else {
+      pthread_cond_wait(&segments_changed, &mutex);
+    }
+  }
+  pthread_mutex_unlock(&mutex);
+  return NULL;
+}
+
+/* Appends size bytes of output to the last WINDOW_SIZE bytes in window. */
+static void update_window(uint8_t *window, size_t *window_size,
+                          const uint8_t *data, size_t size) {
+  if (size >= WINDOW_SIZE) {
+    memcpy(window, data + size - WINDOW_SIZE, WINDOW_SIZE);
+    *window_size = WINDOW_SIZE;
+    return;
+  }
+  size_t kept = *window_size + size > WINDOW_SIZE ? WINDOW_SIZE - size
+                                                  : *window_size;
+  memmove(window, window + *window_size - kept, kept);
+  memcpy(window + kept, data, size);
+  *window_size = kept + size;
+}
+
+void parallel_inflate(bool (*output)(const uint8_t *data, size_t size)) {
+#ifdef DEBUG
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  uint32_t serial_segments = 0;
+#endif
+  /* Segments are at least segment_size bytes apart. */
+  segment_capacity = idat_size_bound() / segment_size + 2;
+  segments = calloc(segment_capacity, sizeof(*segments));
+  assert(segments != NULL);
+  segments[0].claimed = true;
+  segments[0].end = SIZE_MAX;
+  segment_count = 1;
+  next_segment = 0;
+  serial_segment = 1;
+  serial_offset = 0;
+  restart_scan(0);
+  scanning = false;
+  scan_done = false;
+  stopping = false;
+  /* The serial stream is inflated on this thread. */
+  uint32_t thread_count = thread_pool_size() - 1;
+  ahead_segments = thread_pool_size() * AHEAD_PER_THREAD;
+  pthread_t *threads = malloc(thread_count * sizeof(*threads));
+  assert(threads != NULL);
+  for (uint32_t i = 0; i < thread_count; i++) {
+    int error = pthread_create(&threads[i], NULL, worker_thread, NULL);
+    assert(error == 0);
+  }
+
+  /* The stream that the output came from last, which continues with the
+   * next segment if that one depends on it. */
+  z_stream first_stream = {0};
+  int result = inflateInit(&first_stream);
+  assert(result == Z_OK);
+  z_stream *serial = &first_stream;
+  struct idat_reader reader;
+  idat_reader_init(&reader, 0, 0);
+  uint8_t *buffer = malloc(OUTPUT_SIZE);
+  /* The output so far, that segments after a sync flush may still refer to
+   * after a segment that didn't. */
+  uint8_t *window = malloc(WINDOW_SIZE);
+  assert(buffer != NULL && window != NULL);
+  size_t window_size = 0;
+  /* Set while the serial stream may hold output that it didn't return. */
+  bool pending = false;
+  bool more = true;
+  while (more) {
+    if (serial->avail_in == 0 && !pending) {
+      pthread_mutex_lock(&mutex);
+      struct segment *segment = serial_segment < segment_count
+                                    ? &segments[serial_segment]
+                                    : NULL;
+      if (segment != NULL && reader.offset == segment->begin) {
+        /* Continues with the segment if a worker inflated it, otherwise
+         * the serial stream inflates it. */
+        bool inflated = segment->claimed;
+        segment->claimed = true;
+        while (inflated && !segment->done) {
+          pthread_cond_wait(&segments_changed, &mutex);
+        }
+        serial_segment++;
+        pthread_cond_broadcast(&segments_changed);
+        pthread_mutex_unlock(&mutex);
+        bool at_block = (serial->data_type & 128) != 0 &&
+                        (serial->data_type & 64) == 0 &&
+                        (serial->data_type & 63) == 0;
+        if (inflated && segment->independent && at_block) {
+          update_window(window, &window_size, segment->output,
+                        segment->output_size);
+          more = output(segment->output, segment->output_size);
+          inflateEnd(serial);
+          serial = &segment->stream;
+          result = inflateSetDictionary(serial, window, window_size);
+          assert(result == Z_OK);
+          /* The stream ended before the last row. */
+          assert(!more || !segment->ended);
+          idat_reader_init(&reader, segment->end, segment->end);
+        } else if (inflated) {
+          /* The flush marker was just a sync flush, or a coincidence. */
+          inflateEnd(&segment->stream);
+#ifdef DEBUG
+          serial_segments++;
+#endif
+        }
+#ifdef DEBUG
+        serial_segments += !inflated;
+#endif
+        free(segment->output);
+        continue;
+      }
+      size_t end = reader.offset + INPUT_SIZE;
+      if (segment != NULL && end > segment->begin) {
+        end = segment->begin;
+      }
+      if (end > serial_offset) {
+        serial_offset = end;
+      }
+      pthread_mutex_unlock(&mutex);
+      reader.end = end;
+      bool read = idat_read(&reader, serial);
+      /* The stream ended before the last row. */
+      assert(read);
+    }
+    serial->next_out = buffer;
+    serial->avail_out = OUTPUT_SIZE;
+    result = inflate(serial, Z_NO_FLUSH);
+    assert(result == Z_OK || result == Z_BUF_ERROR || result == Z_STREAM_END);
+    pending = serial->avail_out == 0;
+    update_window(window, &window_size, buffer, serial->next_out - buffer);
+    more = output(buffer, serial->next_out - buffer);
+    assert(!more || result != Z_STREAM_END);
+  }
+
+  /* Lets the threads finish the segments they took. */
+  pthread_mutex_lock(&mutex);
+  stopping = true;
+  pthread_cond_broadcast(&segments_changed);
+  pthread_mutex_unlock(&mutex);
+  for (uint32_t i = 0; i < thread_count; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  free(threads);
+  free(buffer);
+  free(window);
+  inflateEnd(serial);
+  for (uint32_t i = serial_segment; i < segment_count; i++) {
+    if (segments[i].claimed) {
+      inflateEnd(&segments[i].stream);
+      free(segments[i].output);
+    }
+  }
+#ifdef DEBUG
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  fprintf(stderr,
+          "Inflated %u segments on %u threads in %.3f ms, %u of them "
+          "serially\n",
+          segment_count, thread_count + 1,
+          (end.tv_sec - start.tv_sec) * 1e3 +
+              (end.tv_nsec - start.tv_nsec) / 1e6,
+          serial_segments);
+#endif
+  free(segments);
+}
@@ -0,0 +1,457 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <idat.h>
+#include <row-index.h>
+#include <thread-pool.h>
+#include <unfilter.h>
+#include <zlib.h>
+
+/* Rows are cached and decoded in bands of about BAND_SIZE stored bytes, and
+ * the cache keeps about CACHE_SIZE of them. Every band has a checkpoint,
+ * which mostly costs the 32 KiB inflate window and a row. The tests build
+ * with tiny ones. */
+#ifndef BAND_SIZE
+#define BAND_SIZE (16 << 20)
+#endif
+#ifndef CACHE_SIZE
+#define CACHE_SIZE (128 << 20)
+#endif
+#define WINDOW_SIZE 32768
+/* Size of the inflate output when decoding a band. */
+#define OUTPUT_SIZE 65536
+
+#define NO_CHECKPOINT UINT32_MAX
+#define NO_BAND UINT32_MAX
+
+static uint32_t image_height;
+static uint32_t raw_row_size;
+static uint32_t raw_pixel_size;
+static uint32_t stored_row_size;
+static row_index_store_function store_row;
+static uint32_t band_rows;
+static uint32_t band_count;
+
+/* Inflate state at the start of a deflate block. The rows from row on are
+ * reconstructed from the unfiltered row before it and the filtered bytes
+ * that were inflated before the block, so a checkpoint may serve several
+ * bands if a block spans them. */
+struct checkpoint {
+  uint32_t row;
+  /* Set once the block started, the other fields are final then. */
+  bool done;
+  size_t stream_offset;
+  /* Bits of the byte before stream_offset that belong to the block. */
+  int bits;
+  uint8_t *window;
+  uint32_t window_size;
+  /* With the filter type byte in front, like the rows below. */
+  uint8_t *previous;
+  uint8_t *pending;
+  size_t pending_size;
+  size_t pending_capacity;
+};
+
+/* One per band at most, and band_checkpoints selects the one to decode a
+ * band from. */
+static struct checkpoint *checkpoints;
+static uint32_t checkpoint_count = 0;
+static uint32_t *band_checkpoints;
+
+struct slot {
+  uint8_t *data;
+  uint32_t band;
+  /* Threads reading the band, which can't be evicted meanwhile. */
+  uint32_t pins;
+  bool loading;
+  uint64_t last_use;
+};
+
+static struct slot *slots;
+static uint32_t slot_count;
+static uint64_t cache_clock = 0;
+
+/* Guards the slots and checkpoint.done, and is signalled whenever a slot is
+ * unpinned or loaded or a checkpoint is done. */
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cache_changed = PTHREAD_COND_INITIALIZER;
+
+void row_index_init(uint32_t height, uint32_t row_size, uint32_t pixel_size,
+                    uint32_t stored_size, row_index_store_function store) {
+  image_height = height;
+  raw_row_size = row_size;
+  raw_pixel_size = pixel_size;
+  stored_row_size = stored_size;
+  store_row = store;
+
+  band_rows = BAND_SIZE / stored_row_size;
+  if (band_rows == 0) {
+    band_rows = 1;
+  }
+  if (band_rows > height) {
+    band_rows = height;
+  }
+  band_count = (height + band_rows - 1) / band_rows;
+  checkpoints = calloc(band_count, sizeof(*checkpoints));
+  assert(checkpoints != NULL);
+  band_checkpoints = malloc(band_count * sizeof(*band_checkpoints));
+  assert(band_checkpoints != NULL);
+  for (uint32_t band = 0; band < band_count; band++) {
+    band_checkpoints[band] = NO_CHECKPOINT;
+  }
+
+  /* Every rendering thread pins one band at a time, and the indexing pass
+   * another one. */
+  slot_count = CACHE_SIZE / ((size_t)band_rows * stored_row_size);
+  if (slot_count < thread_pool_size() + 2) {
+    slot_count = thread_pool_size() + 2;
+  }
+  if (slot_count > band_count) {
+    slot_count = band_count;
+  }
+  slots = calloc(slot_count, sizeof(*slots));
+  assert(slots != NULL);
+  for (uint32_t i = 0; i < slot_count; i++) {
+    slots[i].band = NO_BAND;
+  }
+}
+
+/* Least recently used slot that nobody reads, or NULL. Called with the mutex
+ * held. */
+static struct slot *evictable_slot(void) {
+  struct slot *evictable = NULL;
+  for (uint32_t i = 0; i < slot_count; i++) {
+    if (slots[i].pins == 0 && !slots[i].loading &&
+        (evictable == NULL || slots[i].last_use < evictable->last_use)) {
+      evictable = &slots[i];
+    }
+  }
+  if (evictable != NULL && evictable->data == NULL) {
+    evictable->data = aligned_alloc(64, (size_t)band_rows * stored_row_size);
+    assert(evictable->data != NULL);
+  }
+  return evictable;
+}
+
+static struct slot *find_slot(uint32_t band) {
+  for (uint32_t i = 0; i < slot_count; i++) {
+    if (slots[i].band == band) {
+      return &slots[i];
+    }
+  }
+  return NULL;
+}
+
+/* State of the indexing pass. */
+struct build {
+  struct unfilter rows;
+  uint32_t next_band;
+  /* Checkpoint that waits for the next block to start. */
+  struct checkpoint *pending;
+  /* Pinned slot of the band being decoded. */
+  struct slot *slot;
+};
+
+/* Gives the band starting at the current row a checkpoint and a slot. */
+static void build_start_band(struct build *build) {
+  if (build->pending == NULL) {
+    build->pending = &checkpoints[checkpoint_count++];
+    build->pending->row = build->rows.y;
+    build->pending->previous = malloc(raw_row_size + 1);
+    assert(build->pending->previous != NULL);
+    memcpy(build->pending->previous, build->rows.previous, raw_row_size + 1);
+  }
+
+  pthread_mutex_lock(&mutex);
+  band_checkpoints[build->next_band] = build->pending - checkpoints;
+  if (build->slot != NULL) {
+    build->slot->pins--;
+    pthread_cond_broadcast(&cache_changed);
+  }
+  struct slot *slot;
+  while ((slot = evictable_slot()) == NULL) {
+    pthread_cond_wait(&cache_changed, &mutex);
+  }
+  slot->band = build->next_band;
+  slot->pins = 1;
+  slot->last_use = ++cache_clock;
+  pthread_mutex_unlock(&mutex);
+  build->slot = slot;
+  build->next_band++;
+}
+
+static bool build_at_band_start(const struct build *build) {
+  return build->rows.filled == 0 &&
+         build->rows.y == build->next_band * band_rows &&
+         build->rows.y < image_height;
+}
+
+static void build_finish_checkpoint(struct build *build,
+                                    const z_stream *stream,
+                                    const uint8_t *window) {
+  struct checkpoint *checkpoint = build->pending;
+  checkpoint->stream_offset = stream->total_in;
+  checkpoint->bits = stream->data_type & 7;
+  /* window is a ring buffer that the inflated bytes wrap around. */
+  size_t position = stream->next_out - window;
+  checkpoint->window_size =
+      stream->total_out < WINDOW_SIZE ? stream->total_out : WINDOW_SIZE;
+  checkpoint->window = malloc(checkpoint->window_size);
+  assert(checkpoint->window_size == 0 || checkpoint->window != NULL);
+  if (stream->total_out < WINDOW_SIZE) {
+    memcpy(checkpoint->window, window, checkpoint->window_size);
+  } else {
+    memcpy(checkpoint->window, window + position, WINDOW_SIZE - position);
+    memcpy(checkpoint->window + WINDOW_SIZE - position, window, position);
+  }
+
+  pthread_mutex_lock(&mutex);
+  checkpoint->done = true;
+  pthread_cond_broadcast(&cache_changed);
+  pthread_mutex_unlock(&mutex);
+  build->pending = NULL;
+}
+
+static void build_add(struct build *build, const uint8_t *data, size_t size,
+                      void (*row_decoded)(uint32_t rows)) {
+  while (size != 0 && build->rows.y < image_height) {
+    if (build_at_band_start(build)) {
+      build_start_band(build);
+    }
+    size_t used = unfilter_fill(&build->rows, data, size);
+    struct checkpoint *pending = build->pending;
+    if (pending != NULL) {
+      if (pending->pending_size + used > pending->pending_capacity) {
+        pending->pending_capacity = (pending->pending_size + used) * 2;
+        pending->pending =
+            realloc(pending->pending, pending->pending_capacity);
+        assert(pending->pending != NULL);
+      }
+      memcpy(pending->pending + pending->pending_size, data, used);
+      pending->pending_size += used;
+    }
+    data += used;
+    size -= used;
+
+    if (unfilter_complete(&build->rows)) {
+      uint32_t y = build->rows.y;
+      store_row(build->slot->data + (size_t)(y % band_rows) * stored_row_size,
+                unfilter_next(&build->rows));
+      row_decoded(build->rows.y);
+    }
+  }
+}
+
+void row_index_build(void (*row_decoded)(uint32_t rows)) {
+#ifdef DEBUG
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+#endif
+  struct build build = {.next_band = 0, .pending = NULL, .slot = NULL};
+  unfilter_init(&build.rows, raw_row_size, raw_pixel_size, NULL, 0);
+  uint8_t *window = malloc(WINDOW_SIZE);
+  assert(window != NULL);
+  z_stream stream = {0};
+  int result = inflateInit(&stream);
+  assert(result == Z_OK);
+  stream.next_out = window;
+  stream.avail_out = WINDOW_SIZE;
+  struct idat_reader reader;
+  idat_reader_init(&reader, 0, SIZE_MAX);
+  while (build.rows.y < image_height) {
+    if (stream.avail_in == 0) {
+      bool read = idat_read(&reader, &stream);
+      assert(read);
+    }
+    if (stream.avail_out == 0) {
+      stream.next_out = window;
+      stream.avail_out = WINDOW_SIZE;
+    }
+    uint8_t *output = stream.next_out;
+    /* Z_BLOCK returns at every block boundary, where a checkpoint can
+     * resume without the preceding bit stream. */
+    result = inflate(&stream, Z_BLOCK);
+    assert(result == Z_OK || result == Z_STREAM_END || result == Z_BUF_ERROR);
+    build_add(&build, output, stream.next_out - output, row_decoded);
+    assert(result != Z_STREAM_END || build.rows.y == image_height);
+
+    if ((stream.data_type & 128) != 0 && (stream.data_type & 64) == 0) {
+      if (build.pending == NULL && build_at_band_start(&build)) {
+        build_start_band(&build);
+      }
+      if (build.pending != NULL) {
+        build_finish_checkpoint(&build, &stream, window);
+      }
+    }
+  }
+  /* The remaining rows are all in the pending bytes, so the checkpoint
+   * doesn't need to inflate anything. */
+  if (build.pending != NULL) {
+    pthread_mutex_lock(&mutex);
+    build.pending->done = true;
+    pthread_cond_broadcast(&cache_changed);
+    pthread_mutex_unlock(&mutex);
+  }
+  pthread_mutex_lock(&mutex);
+  build.slot->pins--;
+  pthread_cond_broadcast(&cache_changed);
+  pthread_mutex_unlock(&mutex);
+
+  inflateEnd(&stream);
+  free(window);
+  unfilter_finish(&build.rows);
+#ifdef DEBUG
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  size_t index_size = 0;
+  for (uint32_t i = 0; i < checkpoint_count; i++) {
+    index_size += checkpoints[i].window_size + raw_row_size + 1 +
+                  checkpoints[i].pending_capacity;
+  }
+  fprintf(stderr,
+          "Indexed %u bands of %u rows with %u checkpoints of %zu KiB in "
+          "%.3f ms\n",
+          band_count, band_rows, checkpoint_count, index_size >> 10,
+          (end.tv_sec - start.tv_sec) * 1e3 +
+              (end.tv_nsec - start.tv_nsec) / 1e6);
+#endif
+}
+
+/* Stores the rows of [first_row, end_row) that the bytes complete. */
+static void decode_rows(struct unfilter *rows, const uint8_t *data, size_t size,
+                        uint32_t first_row, uint32_t end_row,
+                        uint8_t *destination) {
+  while (size != 0 && rows->y < end_row) {
+    size_t used = unfilter_fill(rows, data, size);
+    data += used;
+    size -= used;
+    if (unfilter_complete(rows)) {
+      uint32_t y = rows->y;
+      const uint8_t *row = unfilter_next(rows);
+      /* Rows before the band only provide the filter state. */
+      if (y >= first_row) {
+        store_row(destination + (size_t)(y - first_row) * stored_row_size,
+                  row);
+      }
+    }
+  }
+}
+
+static void decode_band(uint32_t band, const struct checkpoint *checkpoint,
+                        uint8_t *destination) {
+#ifdef DEBUG
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+#endif
+  uint32_t first_row = band * band_rows;
+  uint32_t end_row = first_row + band_rows;
+  if (end_row > image_height) {
+    end_row = image_height;
+  }
+  struct unfilter rows;
+  unfilter_init(&rows, raw_row_size, raw_pixel_size, checkpoint->previous,
+                checkpoint->row);
+  decode_rows(&rows, checkpoint->pending, checkpoint->pending_size, first_row,
+              end_row, destination);
+
+  if (rows.y < end_row) {
+    z_stream stream = {0};
+    int result = inflateInit2(&stream, -15);
+    assert(result == Z_OK);
+    size_t offset = checkpoint->stream_offset;
+    if (checkpoint->bits != 0) {
+      result = inflatePrime(&stream, checkpoint->bits,
+                            idat_byte(offset - 1) >> (8 - checkpoint->bits));
+      assert(result == Z_OK);
+    }
+    if (checkpoint->window_size != 0) {
+      result = inflateSetDictionary(&stream, checkpoint->window,
+                                    checkpoint->window_size);
+      assert(result == Z_OK);
+    }
+    struct idat_reader reader;
+    idat_reader_init(&reader, offset, SIZE_MAX);
+    uint8_t *output = malloc(OUTPUT_SIZE);
+    assert(output != NULL);
+    while (rows.y < end_row) {
+      if (stream.avail_in == 0) {
+        bool read = idat_read(&reader, &stream);
+        assert(read);
+      }
+      stream.next_out = output;
+      stream.avail_out = OUTPUT_SIZE;
+      result = inflate(&stream, Z_NO_FLUSH);
+      assert(result == Z_OK || result == Z_STREAM_END ||
+             result == Z_BUF_ERROR);
+      decode_rows(&rows, output, stream.next_out - output, first_row, end_row,
+                  destination);
+      assert(result != Z_STREAM_END || rows.y == end_row);
+    }
+    free(output);
+    inflateEnd(&stream);
+  }
+  unfilter_finish(&rows);
+#ifdef DEBUG
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  fprintf(stderr, "Decoded band %u from row %u in %.3f ms\n", band,
+          checkpoint->row,
+          (end.tv_sec - start.tv_sec) * 1e3 +
+              (end.tv_nsec - start.tv_nsec) / 1e6);
+#endif
+}
+
+const uint8_t *row_index_lock(uint32_t y, uint32_t *end_row) {
+  uint32_t band = y / band_rows;
+  pthread_mutex_lock(&mutex);
+  struct slot *slot;
+  for (;;) {
+    slot = find_slot(band);
+    if (slot != NULL && !slot->loading) {
+      slot->pins++;
+      break;
+    }
+    /* Bands that were evicted before their checkpoint was done have to
+     * wait for the indexing pass. */
+    uint32_t checkpoint = band_checkpoints[band];
+    if (slot == NULL && checkpoint != NO_CHECKPOINT &&
+        checkpoints[checkpoint].done && (slot = evictable_slot()) != NULL) {
+      slot->band = band;
+      slot->pins = 1;
+      slot->loading = true;
+      pthread_mutex_unlock(&mutex);
+      decode_band(band, &checkpoints[checkpoint], slot->data);
+      pthread_mutex_lock(&mutex);
+      slot->loading = false;
+      pthread_cond_broadcast(&cache_changed);
+      break;
+    }
+    pthread_cond_wait(&cache_changed, &mutex);
+  }
+  slot->last_use = ++cache_clock;
+  pthread_mutex_unlock(&mutex);
+
+  *end_row = (band + 1) * band_rows;
+  if (*end_row > image_height) {
+    *end_row = image_height;
+  }
+  return slot->data + (size_t)(y - band * band_rows) * stored_row_size;
+}
+
+void row_index_unlock(uint32_t y) {
+  pthread_mutex_lock(&mutex);
+  struct slot *slot = find_slot(y / band_rows);
+  assert(slot != NULL && slot->pins != 0);
+  slot->pins--;
+  if (slot->pins == 0) {
+    pthread_cond_broadcast(&cache_changed);
+  }
+  pthread_mutex_unlock(&mutex);
+}
@@ -0,0 +1,190 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include <scale.h>
+
+static void scale_row_scalar(uint32_t *destination, const uint32_t *source,
+                             uint32_t width, uint32_t scale) {
+  if (scale == 1) {
+    memcpy(destination, source, width * 4);
+    return;
+  }
+  for (uint32_t x = 0; x < width; x++) {
+    uint32_t pixel = source[x];
+    for (uint32_t i = 0; i < scale; i++) {
+      *destination++ = pixel;
+    }
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2"))) static void
+scale_row_sse2(uint32_t *destination, const uint32_t *source, uint32_t width,
+               uint32_t scale) {
+  uint32_t x = 0;
+  if (scale == 2) {
+    for (; x + 4 <= width; x += 4) {
+      __m128i pixels = _mm_loadu_si128((const __m128i *)(source + x));
+      _mm_storeu_si128((__m128i *)destination,
+                       _mm_unpacklo_epi32(pixels, pixels));
+      _mm_storeu_si128((__m128i *)(destination + 4),
+                       _mm_unpackhi_epi32(pixels, pixels));
+      destination += 8;
+    }
+  } else if (scale == 3) {
+    for (; x + 4 <= width; x += 4) {
+      __m128i pixels = _mm_loadu_si128((const __m128i *)(source + x));
+      _mm_storeu_si128((__m128i *)destination,
+                       _mm_shuffle_epi32(pixels, _MM_SHUFFLE(1, 0, 0, 0)));
+      _mm_storeu_si128((__m128i *)(destination + 4),
+                       _mm_shuffle_epi32(pixels, _MM_SHUFFLE(2, 2, 1, 1)));
+      _mm_storeu_si128((__m128i *)(destination + 8),
+                       _mm_shuffle_epi32(pixels, _MM_SHUFFLE(3, 3, 3, 2)));
+      destination += 12;
+    }
+  } else if (scale == 4) {
+    for (; x + 4 <= width; x += 4) {
+      __m128i pixels = _mm_loadu_si128((const __m128i *)(source + x));
+      _mm_storeu_si128((__m128i *)destination,
+                       _mm_shuffle_epi32(pixels, _MM_SHUFFLE(0, 0, 0, 0)));
+      _mm_storeu_si128((__m128i *)(destination + 4),
+                       _mm_shuffle_epi32(pixels, _MM_SHUFFLE(1, 1, 1, 1)));
+      _mm_storeu_si128((__m128i *)(destination + 8),
+                       _mm_shuffle_epi32(pixels, _MM_SHUFFLE(2, 2, 2, 2)));
+      _mm_storeu_si128((__m128i *)(destination + 12),
+                       _mm_shuffle_epi32(pixels, _MM_SHUFFLE(3, 3, 3, 3)));
+      destination += 16;
+    }
+  } else if (scale > 4) {
+    for (; x < width; x++) {
+      __m128i pixel = _mm_set1_epi32(source[x]);
+      for (uint32_t i = 0; i + 4 <= scale; i += 4) {
+        _mm_storeu_si128((__m128i *)(destination + i), pixel);
+      }
+      if (scale % 4 != 0) {
+        /* Overlaps the previous store, which is harmless since it writes the
+         * same pixel. */
+        _mm_storeu_si128((__m128i *)(destination + scale - 4), pixel);
+      }
+      destination += scale;
+    }
+  }
+  scale_row_scalar(destination, source + x, width - x, scale);
+}
+
+__attribute__((target("avx2"))) static void
+scale_row_avx2(uint32_t *destination, const uint32_t *source, uint32_t width,
+               uint32_t scale) {
+  uint32_t x = 0;
+  if (scale == 2) {
+    const __m256i low = _mm256_setr_epi32(0, 0, 1, 1, 2, 2, 3, 3);
+    const __m256i high = _mm256_setr_epi32(4, 4, 5, 5, 6, 6, 7, 7);
+    for (; x + 8 <= width; x += 8) {
+      __m256i pixels = _mm256_loadu_si256((const __m256i *)(source + x));
+      _mm256_storeu_si256((__m256i *)destination,
+                          _mm256_permutevar8x32_epi32(pixels, low));
+      _mm256_storeu_si256((__m256i *)(destination + 8),
+                          _mm256_permutevar8x32_epi32(pixels, high));
+      destination += 16;
+    }
+  } else if (scale == 3) {
+    const __m256i first = _mm256_setr_epi32(0, 0, 0, 1, 1, 1, 2, 2);
+    const __m256i second = _mm256_setr_epi32(2, 3, 3, 3, 4, 4, 4, 5);
+    const __m256i third = _mm256_setr_epi32(5, 5, 6, 6, 6, 7, 7, 7);
+    for (; x + 8 <= width; x += 8) {
+      __m256i pixels = _mm256_loadu_si256((const __m256i *)(source + x));
+      _mm256_storeu_si256((__m256i *)destination,
+                          _mm256_permutevar8x32_epi32(pixels, first));
+      _mm256_storeu_si256((__m256i *)(destination + 8),
+                          _mm256_permutevar8x32_epi32(pixels, second));
+      _mm256_storeu_si256((__m256i *)(destination + 16),
+                          _mm256_permutevar8x32_epi32(pixels, third));
+      destination += 24;
+    }
+  } else if (scale == 4) {
+    const __m256i first = _mm256_setr_epi32(0, 0, 0, 0, 1, 1, 1, 1);
+    const __m256i second = _mm256_setr_epi32(2, 2, 2, 2, 3, 3, 3, 3);
+    const __m256i third = _mm256_setr_epi32(4, 4, 4, 4, 5, 5, 5, 5);
+    const __m256i fourth = _mm256_setr_epi32(6, 6, 6, 6, 7, 7, 7, 7);
+    for (; x + 8 <= width; x += 8) {
+      __m256i pixels = _mm256_loadu_si256((const __m256i *)(source + x));
+      _mm256_storeu_si256((__m256i *)destination,
+                          _mm256_permutevar8x32_epi32(pixels, first));
+      _mm256_storeu_si256((__m256i *)(destination + 8),
+                          _mm256_permutevar8x32_epi32(pixels, second));
+      _mm256_storeu_si256((__m256i *)(destination + 16),
+                          _mm256_permutevar8x32_epi32(pixels, third));
+      _mm256_storeu_si256((__m256i *)(destination + 24),
+                          _mm256_permutevar8x32_epi32(pixels, fourth));
+      destination += 32;
+    }
+  } else if (scale >= 8) {
+    for (; x < width; x++) {
+      __m256i pixel = _mm256_set1_epi32(source[x]);
+      for (uint32_t i = 0; i + 8 <= scale; i += 8) {
+        _mm256_storeu_si256((__m256i *)(destination + i), pixel);
+      }
+      if (scale % 8 != 0) {
+        _mm256_storeu_si256((__m256i *)(destination + scale - 8), pixel);
+      }
+      destination += scale;
+    }
+  }
+  scale_row_sse2(destination, source + x, width - x, scale);
+}
+#endif
+
+static void (*scale_row_impl)(uint32_t *, const uint32_t *, uint32_t,
+                              uint32_t) = scale_row_scalar;
+
+void scale_init(void) {
+  const char *name = "scalar";
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    scale_row_impl = scale_row_avx2;
+    name = "AVX2";
+  } else if (__builtin_cpu_supports("sse2")) {
+    scale_row_impl = scale_row_sse2;
+    name = "SSE2";
+  }
+#endif
+#ifdef DEBUG
+  fprintf(stderr, "Using %s row scaling\n", name);
+#else
+  (void)name;
+#endif
+}
+
+void scale_row(uint32_t *destination, const uint32_t *source, uint32_t width,
+               uint32_t scale) {
+  scale_row_impl(destination, source, width, scale);
+}
+
+/* Pixels looked up at once before scaling them, small enough to stay in the
+ * L1 cache. */
+#define INDEXED_CHUNK 256
+
+void scale_row_indexed(uint32_t *destination, const uint8_t *source,
+                       const uint32_t *palette, uint32_t width,
+                       uint32_t scale) {
+  if (scale == 1) {
+    for (uint32_t x = 0; x < width; x++) {
+      destination[x] = palette[source[x]];
+    }
+    return;
+  }
+  uint32_t pixels[INDEXED_CHUNK];
+  for (uint32_t x = 0; x < width; x += INDEXED_CHUNK) {
+    uint32_t count = width - x < INDEXED_CHUNK ? width - x : INDEXED_CHUNK;
+    for (uint32_t i = 0; i < count; i++) {
+      pixels[i] = palette[source[x + i]];
+    }
+    scale_row_impl(destination + (size_t)x * scale, pixels, count, scale);
+  }
+}
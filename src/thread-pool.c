@@ -0,0 +1,115 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <thread-pool.h>
+
+static uint32_t thread_count = 1;
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_available = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t work_done = PTHREAD_COND_INITIALIZER;
+
+static void (*job_function)(void *data, uint32_t task, uint32_t thread);
+static void *job_data;
+static uint32_t job_tasks;
+static _Atomic uint32_t job_next_task;
+static uint32_t job_generation = 0;
+static uint32_t job_busy_workers = 0;
+
+static void run_tasks(uint32_t thread) {
+  for (;;) {
+    uint32_t task = atomic_fetch_add_explicit(&job_next_task, 1,
+                                              memory_order_relaxed);
+    if (task >= job_tasks) {
+      return;
+    }
+    job_function(job_data, task, thread);
+  }
+}
+
+static void *worker_thread(void *data) {
+  uint32_t thread = (uintptr_t)data;
+  uint32_t generation = 0;
+  pthread_mutex_lock(&mutex);
+  for (;;) {
+    while (job_generation == generation) {
+      pthread_cond_wait(&work_available, &mutex);
+    }
+    generation = job_generation;
+    pthread_mutex_unlock(&mutex);
+
+    run_tasks(thread);
+
+    pthread_mutex_lock(&mutex);
+    job_busy_workers--;
+    if (job_busy_workers == 0) {
+      pthread_cond_signal(&work_done);
+    }
+  }
+  return NULL;
+}
+
+void thread_pool_init(void) {
+#ifdef THREAD_COUNT
+  /* The tests run on several threads however many cores there are. */
+  thread_count = THREAD_COUNT;
+#else
+  cpu_set_t cpu_set;
+  if (sched_getaffinity(0, sizeof(cpu_set), &cpu_set) == 0) {
+    thread_count = CPU_COUNT(&cpu_set);
+  } else {
+    thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+#endif
+  if (thread_count < 1) {
+    thread_count = 1;
+  }
+
+  for (uint32_t thread = 1; thread < thread_count; thread++) {
+    pthread_t worker;
+    int error = pthread_create(&worker, NULL, worker_thread,
+                               (void *)(uintptr_t)thread);
+    assert(error == 0);
+    pthread_detach(worker);
+  }
+#ifdef DEBUG
+  fprintf(stderr, "Rendering with %u threads\n", thread_count);
+#endif
+}
+
+uint32_t thread_pool_size(void) { return thread_count; }
+
+void thread_pool_run(void (*function)(void *data, uint32_t task,
+                                      uint32_t thread),
+                     void *data, uint32_t tasks) {
+  if (thread_count == 1 || tasks == 1) {
+    for (uint32_t task = 0; task < tasks; task++) {
+      function(data, task, 0);
+    }
+    return;
+  }
+
+  pthread_mutex_lock(&mutex);
+  job_function = function;
+  job_data = data;
+  job_tasks = tasks;
+  atomic_store_explicit(&job_next_task, 0, memory_order_relaxed);
+  job_busy_workers = thread_count - 1;
+  job_generation++;
+  pthread_cond_broadcast(&work_available);
+  pthread_mutex_unlock(&mutex);
+
+  run_tasks(0);
+
+  pthread_mutex_lock(&mutex);
+  while (job_busy_workers != 0) {
+    pthread_cond_wait(&work_done, &mutex);
+  }
+  pthread_mutex_unlock(&mutex);
+}
@@ -0,0 +1,277 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include <unfilter.h>
+
+void unfilter_init(struct unfilter *unfilter, uint32_t row_size,
+                   uint32_t pixel_size, const uint8_t *previous, uint32_t y) {
+  unfilter->current = malloc(row_size + 1);
+  assert(unfilter->current != NULL);
+  unfilter->previous = calloc(row_size + 1, 1);
+  assert(unfilter->previous != NULL);
+  if (previous != NULL) {
+    memcpy(unfilter->previous, previous, row_size + 1);
+  }
+  unfilter->filled = 0;
+  unfilter->y = y;
+  unfilter->row_size = row_size;
+  unfilter->pixel_size = pixel_size;
+}
+
+void unfilter_finish(struct unfilter *unfilter) {
+  free(unfilter->current);
+  free(unfilter->previous);
+}
+
+size_t unfilter_fill(struct unfilter *unfilter, const uint8_t *data,
+                     size_t size) {
+  size_t used = unfilter->row_size + 1 - unfilter->filled;
+  if (used > size) {
+    used = size;
+  }
+  memcpy(unfilter->current + unfilter->filled, data, used);
+  unfilter->filled += used;
+  return used;
+}
+
+static inline uint8_t paeth(uint8_t a, uint8_t b, uint8_t c) {
+  int p = a + b - c;
+  int pa = abs(p - a);
+  int pb = abs(p - b);
+  int pc = abs(p - c);
+  if (pa <= pb && pa <= pc) {
+    return a;
+  }
+  return pb <= pc ? b : c;
+}
+
+static void unfilter_row_scalar(uint8_t *row, const uint8_t *previous,
+                                uint32_t size, uint32_t bpp) {
+  uint8_t type = row[0];
+  row++;
+  previous++;
+  switch (type) {
+  case 0:
+    break;
+  case 1:
+    for (uint32_t i = bpp; i < size; i++) {
+      row[i] += row[i - bpp];
+    }
+    break;
+  case 2:
+    for (uint32_t i = 0; i < size; i++) {
+      row[i] += previous[i];
+    }
+    break;
+  case 3:
+    for (uint32_t i = 0; i < bpp; i++) {
+      row[i] += previous[i] >> 1;
+    }
+    for (uint32_t i = bpp; i < size; i++) {
+      row[i] += (row[i - bpp] + previous[i]) >> 1;
+    }
+    break;
+  case 4:
+    for (uint32_t i = 0; i < bpp; i++) {
+      row[i] += previous[i];
+    }
+    for (uint32_t i = bpp; i < size; i++) {
+      row[i] += paeth(row[i - bpp], previous[i], previous[i - bpp]);
+    }
+    break;
+  default:
+    assert(false);
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/* Pixels of 3 and 4 bytes are unfiltered a pixel at a time, as Sub, Avg and
+ * Paeth depend on the pixel before. A memcpy of 3 bytes would go through
+ * the stack, whose 4 byte reload can't be forwarded from the smaller
+ * stores, so those pixels are assembled in a register. */
+__attribute__((target("sse2"), always_inline)) static inline __m128i
+load_pixel(const uint8_t *pixel, uint32_t bpp) {
+  uint32_t value;
+  if (bpp == 4) {
+    memcpy(&value, pixel, 4);
+  } else {
+    uint16_t low;
+    memcpy(&low, pixel, 2);
+    value = low | (uint32_t)pixel[2] << 16;
+  }
+  return _mm_cvtsi32_si128(value);
+}
+
+__attribute__((target("sse2"), always_inline)) static inline void
+store_pixel(uint8_t *pixel, __m128i value, uint32_t bpp) {
+  uint32_t bytes = _mm_cvtsi128_si32(value);
+  if (bpp == 4) {
+    memcpy(pixel, &bytes, 4);
+  } else {
+    uint16_t low = bytes;
+    memcpy(pixel, &low, 2);
+    pixel[2] = bytes >> 16;
+  }
+}
+
+__attribute__((target("sse2"), always_inline)) static inline void
+unfilter_sub_sse2(uint8_t *row, uint32_t size, uint32_t bpp) {
+  __m128i a = _mm_setzero_si128();
+  for (uint32_t i = 0; i < size; i += bpp) {
+    a = _mm_add_epi8(a, load_pixel(row + i, bpp));
+    store_pixel(row + i, a, bpp);
+  }
+}
+
+__attribute__((target("sse2"))) static void
+unfilter_up_sse2(uint8_t *row, const uint8_t *previous, uint32_t size) {
+  uint32_t i = 0;
+  for (; i + 16 <= size; i += 16) {
+    __m128i b = _mm_loadu_si128((const __m128i *)(previous + i));
+    __m128i x = _mm_loadu_si128((const __m128i *)(row + i));
+    _mm_storeu_si128((__m128i *)(row + i), _mm_add_epi8(x, b));
+  }
+  for (; i < size; i++) {
+    row[i] += previous[i];
+  }
+}
+
+__attribute__((target("sse2"), always_inline)) static inline void
+unfilter_avg_sse2(uint8_t *row, const uint8_t *previous, uint32_t size,
+                  uint32_t bpp) {
+  const __m128i one = _mm_set1_epi8(1);
+  __m128i a = _mm_setzero_si128();
+  for (uint32_t i = 0; i < size; i += bpp) {
+    __m128i b = load_pixel(previous + i, bpp);
+    /* _mm_avg_epu8 rounds up, the filter rounds down. */
+    __m128i average = _mm_sub_epi8(_mm_avg_epu8(a, b),
+                                   _mm_and_si128(_mm_xor_si128(a, b), one));
+    a = _mm_add_epi8(average, load_pixel(row + i, bpp));
+    store_pixel(row + i, a, bpp);
+  }
+}
+
+__attribute__((target("sse2"), always_inline)) static inline __m128i
+abs_epi16(__m128i x) {
+  return _mm_max_epi16(x, _mm_sub_epi16(_mm_setzero_si128(), x));
+}
+
+__attribute__((target("sse2"), always_inline)) static inline __m128i
+select_epi16(__m128i mask, __m128i yes, __m128i no) {
+  return _mm_or_si128(_mm_and_si128(mask, yes), _mm_andnot_si128(mask, no));
+}
+
+__attribute__((target("sse2"), always_inline)) static inline void
+unfilter_paeth_sse2(uint8_t *row, const uint8_t *previous, uint32_t size,
+                    uint32_t bpp) {
+  /* a, b and c are the left, upper and upper left pixels in 16 bit lanes,
+   * so the predictor distances don't overflow. */
+  const __m128i zero = _mm_setzero_si128();
+  __m128i a = zero;
+  __m128i c = zero;
+  for (uint32_t i = 0; i < size; i += bpp) {
+    __m128i b = _mm_unpacklo_epi8(load_pixel(previous + i, bpp), zero);
+    __m128i x = _mm_unpacklo_epi8(load_pixel(row + i, bpp), zero);
+    __m128i pa = _mm_sub_epi16(b, c);
+    __m128i pb = _mm_sub_epi16(a, c);
+    __m128i pc = abs_epi16(_mm_add_epi16(pa, pb));
+    pa = abs_epi16(pa);
+    pb = abs_epi16(pb);
+    __m128i smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+    __m128i nearest =
+        select_epi16(_mm_cmpeq_epi16(smallest, pa), a,
+                     select_epi16(_mm_cmpeq_epi16(smallest, pb), b, c));
+    /* The high bytes stay zero. */
+    a = _mm_add_epi8(nearest, x);
+    store_pixel(row + i, _mm_packus_epi16(a, a), bpp);
+    c = b;
+  }
+}
+
+__attribute__((target("sse2"))) static void
+unfilter_row_sse2(uint8_t *row, const uint8_t *previous, uint32_t size,
+                  uint32_t bpp) {
+  uint8_t type = row[0];
+  row++;
+  previous++;
+  /* Constant pixel sizes let the loads and stores become single moves. */
+  switch (type * 2 + (bpp == 4)) {
+  case 0:
+  case 1:
+    break;
+  case 2:
+    unfilter_sub_sse2(row, size, 3);
+    break;
+  case 3:
+    unfilter_sub_sse2(row, size, 4);
+    break;
+  case 4:
+  case 5:
+    unfilter_up_sse2(row, previous, size);
+    break;
+  case 6:
+    unfilter_avg_sse2(row, previous, size, 3);
+    break;
+  case 7:
+    unfilter_avg_sse2(row, previous, size, 4);
+    break;
+  case 8:
+    unfilter_paeth_sse2(row, previous, size, 3);
+    break;
+  case 9:
+    unfilter_paeth_sse2(row, previous, size, 4);
+    break;
+  default:
+    assert(false);
+  }
+}
+#endif
+
+static void (*unfilter_row_vector)(uint8_t *, const uint8_t *, uint32_t,
+                                   uint32_t) = NULL;
+
+void unfilter_select(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse2")) {
+    unfilter_row_vector = unfilter_row_sse2;
+  }
+#endif
+#ifdef DEBUG
+  fprintf(stderr, "Using %s unfiltering\n",
+          unfilter_row_vector != NULL ? "SSE2" : "scalar");
+#endif
+}
+
+bool unfilter_is_vectorized(uint32_t pixel_size) {
+  return unfilter_row_vector != NULL && (pixel_size == 3 || pixel_size == 4);
+}
+
+static void unfilter_row(uint8_t *row, const uint8_t *previous, uint32_t size,
+                         uint32_t bpp) {
+  if (unfilter_is_vectorized(bpp)) {
+    unfilter_row_vector(row, previous, size, bpp);
+  } else {
+    unfilter_row_scalar(row, previous, size, bpp);
+  }
+}
+
+const uint8_t *unfilter_next(struct unfilter *unfilter) {
+  unfilter_row(unfilter->current, unfilter->previous, unfilter->row_size,
+               unfilter->pixel_size);
+  uint8_t *row = unfilter->current;
+  unfilter->current = unfilter->previous;
+  unfilter->previous = row;
+  unfilter->filled = 0;
+  unfilter->y++;
+  return row + 1;
+}
@@ -0,0 +1,650 @@
+#include <assert.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <apng.h>
+#include <corpus.h>
+#include <loader.h>
+#include <png.h>
+#include <thread-pool.h>
+
+/* Decodes generated PNGs with the loader and compares every pixel with
+ * libpng. The loader keeps one image per process, so every case runs in a
+ * child process. The rows are read back on all threads of the pool in a
+ * scrambled order, which makes the row index evict and decode its bands
+ * again. */
+
+#define MAX_CASES 1024
+/* Rows are read in the order of multiples of these, modulo the height. */
+#define ROW_STRIDE_FIRST 7919
+#define ROW_STRIDE_SECOND 104729
+#define MAX_REPORTED 8
+#define TIMEOUT_SECONDS 60
+/* Time without a new frame after which an animation counts as ended, many
+ * times the delays of the generated frames. */
+#define ANIMATION_IDLE_MILLISECONDS 1000
+
+struct loader_case {
+  struct corpus_image image;
+  bool share_pixels;
+  bool index_rows;
+  /* Feeds the file through a pipe on stdin, so that it can't be mapped. */
+  bool pipe;
+  /* Reduction for loader_start, 0 is the same as 1. */
+  uint32_t reduction;
+  /* Passes crop_x, crop_y, crop_width and crop_height to loader_crop. */
+  bool crop;
+  uint32_t crop_x;
+  uint32_t crop_y;
+  uint32_t crop_width;
+  uint32_t crop_height;
+};
+
+static struct loader_case cases[MAX_CASES];
+static uint32_t case_count = 0;
+
+static void add_case(const struct loader_case *loader_case) {
+  assert(case_count < MAX_CASES);
+  cases[case_count++] = *loader_case;
+}
+
+/* x / 255 rounded like the loader. */
+static inline uint32_t divide_by_255(uint32_t x) {
+  return (x + 1 + (x >> 8)) >> 8;
+}
+
+/* Decodes the file with libpng into premultiplied ARGB. */
+static uint32_t *decode_reference(FILE *file, uint32_t *width,
+                                  uint32_t *height) {
+  png_structp png =
+      png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+  assert(png != NULL);
+  png_infop info = png_create_info_struct(png);
+  assert(info != NULL);
+  png_init_io(png, file);
+  png_read_info(png, info);
+  png_set_expand(png);
+  png_set_scale_16(png);
+  png_set_gray_to_rgb(png);
+  png_set_filler(png, 0xFF, PNG_FILLER_AFTER);
+  png_set_interlace_handling(png);
+  png_read_update_info(png, info);
+  *width = png_get_image_width(png, info);
+  *height = png_get_image_height(png, info);
+  assert(png_get_rowbytes(png, info) == (size_t)*width * 4);
+
+  uint8_t *bytes = malloc((size_t)*width * *height * 4);
+  png_bytep *rows = malloc(*height * sizeof(*rows));
+  assert(bytes != NULL && rows != NULL);
+  for (uint32_t y = 0; y < *height; y++) {
+    rows[y] = bytes + (size_t)y * *width * 4;
+  }
+  png_read_image(png, rows);
+  png_read_end(png, NULL);
+  png_destroy_read_struct(&png, &info, NULL);
+
+  uint32_t *pixels = malloc((size_t)*width * *height * sizeof(*pixels));
+  assert(pixels != NULL);
+  for (size_t i = 0; i < (size_t)*width * *height; i++) {
+    const uint8_t *rgba = bytes + i * 4;
+    uint32_t alpha = rgba[3];
+    pixels[i] = alpha << 24 | divide_by_255(rgba[0] * alpha) << 16 |
+                divide_by_255(rgba[1] * alpha) << 8 |
+                divide_by_255(rgba[2] * alpha);
+  }
+  free(rows);
+  free(bytes);
+  return pixels;
+}
+
+/* Averages blocks of reduction x reduction pixels of the reference, those at
+ * the right and bottom edges being cut off, and rounds like the loader. */
+static uint32_t *reduce_reference(const uint32_t *pixels, uint32_t width,
+                                  uint32_t height, uint32_t reduction) {
+  uint32_t reduced_width = (width + reduction - 1) / reduction;
+  uint32_t reduced_height = (height + reduction - 1) / reduction;
+  uint32_t *reduced =
+      malloc((size_t)reduced_width * reduced_height * sizeof(*reduced));
+  assert(reduced != NULL);
+  for (uint32_t block_y = 0; block_y < reduced_height; block_y++) {
+    for (uint32_t block_x = 0; block_x < reduced_width; block_x++) {
+      uint32_t sums[4] = {0};
+      uint32_t count = 0;
+      for (uint32_t y = block_y * reduction;
+           y < height && y < (block_y + 1) * reduction; y++) {
+        for (uint32_t x = block_x * reduction;
+             x < width && x < (block_x + 1) * reduction; x++) {
+          uint32_t pixel = pixels[(size_t)y * width + x];
+          for (uint32_t c = 0; c < 4; c++) {
+            sums[c] += (pixel >> (24 - c * 8)) & 0xFF;
+          }
+          count++;
+        }
+      }
+      uint32_t pixel = 0;
+      for (uint32_t c = 0; c < 4; c++) {
+        pixel |= (sums[c] + count / 2) / count << (24 - c * 8);
+      }
+      reduced[(size_t)block_y * reduced_width + block_x] = pixel;
+    }
+  }
+  return reduced;
+}
+
+/* Copies the part of the reference inside a crop, clipped to the image like
+ * loader_crop does. */
+static uint32_t *crop_reference(const uint32_t *pixels, uint32_t width,
+                                uint32_t height,
+                                const struct loader_case *loader_case,
+                                uint32_t *crop_width, uint32_t *crop_height) {
+  uint32_t x = loader_case->crop_x;
+  uint32_t y = loader_case->crop_y;
+  *crop_width = loader_case->crop_width < width - x ? loader_case->crop_width
+                                                    : width - x;
+  *crop_height = loader_case->crop_height < height - y
+                     ? loader_case->crop_height
+                     : height - y;
+  uint32_t *cropped =
+      malloc((size_t)*crop_width * *crop_height * sizeof(*cropped));
+  assert(cropped != NULL);
+  for (uint32_t row = 0; row < *crop_height; row++) {
+    memcpy(cropped + (size_t)row * *crop_width,
+           pixels + (size_t)(y + row) * width + x,
+           *crop_width * sizeof(*cropped));
+  }
+  return cropped;
+}
+
+/* Composites the frames of an animated image, each decoded by libpng from
+ * a PNG of its own, onto a canvas of width x height pixels, and returns
+ * what the canvas shows after each of the frames up to the corrupt one. */
+static uint32_t **composite_reference(const struct corpus_image *image,
+                                      uint32_t width, uint32_t height,
+                                      uint32_t *count) {
+  *count = image->corrupt_frame != 0 ? image->corrupt_frame - 1
+                                     : image->frame_count;
+  uint32_t **frames = malloc(*count * sizeof(*frames));
+  uint32_t *canvas = calloc((size_t)width * height, sizeof(*canvas));
+  uint32_t *previous = malloc((size_t)width * height * sizeof(*previous));
+  assert(frames != NULL && canvas != NULL && previous != NULL);
+  for (uint32_t i = 0; i < *count; i++) {
+    struct corpus_frame frame;
+    corpus_frame(image, i, &frame);
+    size_t size;
+    uint8_t *data = corpus_encode_frame(image, i, &size);
+    FILE *file = fmemopen(data, size, "rb");
+    assert(file != NULL);
+    uint32_t frame_width;
+    uint32_t frame_height;
+    uint32_t *pixels = decode_reference(file, &frame_width, &frame_height);
+    fclose(file);
+    free(data);
+    assert(frame_width == frame.width && frame_height == frame.height);
+
+    /* The first frame restores the canvas it started from, which is
+     * transparent. */
+    uint8_t dispose = i == 0 && frame.dispose == 2 ? 1 : frame.dispose;
+    memcpy(previous, canvas, (size_t)width * height * sizeof(*canvas));
+    for (uint32_t y = 0; y < frame.height; y++) {
+      for (uint32_t x = 0; x < frame.width; x++) {
+        uint32_t source = pixels[(size_t)y * frame.width + x];
+        uint32_t *destination =
+            &canvas[(size_t)(frame.y + y) * width + frame.x + x];
+        if (frame.blend == 0) {
+          *destination = source;
+          continue;
+        }
+        /* Premultiplied source over destination. */
+        uint32_t alpha = source >> 24;
+        uint32_t pixel = 0;
+        for (uint32_t shift = 0; shift < 32; shift += 8) {
+          uint32_t channel = ((*destination >> shift) & 0xFF) * (255 - alpha) /
+                                 255 +
+                             ((source >> shift) & 0xFF);
+          pixel |= channel << shift;
+        }
+        *destination = pixel;
+      }
+    }
+    free(pixels);
+    frames[i] = malloc((size_t)width * height * sizeof(*canvas));
+    assert(frames[i] != NULL);
+    memcpy(frames[i], canvas, (size_t)width * height * sizeof(*canvas));
+
+    for (uint32_t y = 0; y < frame.height; y++) {
+      size_t offset = (size_t)(frame.y + y) * width + frame.x;
+      if (dispose == 1) {
+        memset(canvas + offset, 0, frame.width * sizeof(*canvas));
+      } else if (dispose == 2) {
+        memcpy(canvas + offset, previous + offset,
+               frame.width * sizeof(*canvas));
+      }
+    }
+  }
+  free(previous);
+  free(canvas);
+  return frames;
+}
+
+/* Returns whether the canvas of the animation matches the reference. */
+static bool compare_frame(const uint32_t *frame, const uint32_t *expected,
+                          uint32_t width, uint32_t height, bool report) {
+  uint32_t mismatches = 0;
+  for (uint32_t y = 0; y < height; y++) {
+    for (uint32_t x = 0; x < width; x++) {
+      uint32_t pixel = frame[(size_t)y * png_stride + x];
+      uint32_t expected_pixel = expected[(size_t)y * width + x];
+      if (pixel != expected_pixel && report &&
+          mismatches++ < MAX_REPORTED) {
+        fprintf(stderr, "  row %u column %u: expected %08x, got %08x\n", y,
+                x, expected_pixel, pixel);
+      }
+      if (pixel != expected_pixel && !report) {
+        return false;
+      }
+    }
+  }
+  return mismatches == 0;
+}
+
+/* Plays the animation once and returns whether every frame it shows is the
+ * next frame of the reference or a later one, the frames in between having
+ * been dropped as overdue, whether it ends at the last frame before the
+ * corrupt one, and whether it shows no frame after that. */
+static bool check_animation(const struct corpus_image *image, uint32_t width,
+                            uint32_t height) {
+  uint32_t count;
+  uint32_t **expected = composite_reference(image, width, height, &count);
+  bool matches = true;
+  /* Frames of the reference that were shown or dropped. */
+  uint32_t played = 0;
+  int idle_milliseconds = 0;
+  while (matches && idle_milliseconds < ANIMATION_IDLE_MILLISECONDS) {
+    int timeout = apng_timeout();
+    if (timeout == -1 || timeout > ANIMATION_IDLE_MILLISECONDS) {
+      timeout = ANIMATION_IDLE_MILLISECONDS;
+    }
+    struct pollfd pollfd = {apng_get_fd(), POLLIN, 0};
+    poll(&pollfd, 1, timeout);
+    const uint32_t *frame;
+    if (!apng_update(&frame)) {
+      idle_milliseconds += timeout;
+      continue;
+    }
+    idle_milliseconds = 0;
+    uint32_t next = played;
+    while (next < count &&
+           !compare_frame(frame, expected[next], width, height, false)) {
+      next++;
+    }
+    if (next == count) {
+      fprintf(stderr, "  frame %u of the animation is not one of frames %u "
+                      "to %u of the reference\n",
+              played + 1, played + 1, count);
+      if (played < count) {
+        compare_frame(frame, expected[played], width, height, true);
+      }
+      matches = false;
+    }
+    played = next + 1;
+  }
+  if (matches && played != count) {
+    fprintf(stderr, "  the animation stopped after %u of %u frames\n",
+            played, count);
+    matches = false;
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    free(expected[i]);
+  }
+  free(expected);
+  return matches;
+}
+
+struct compare_job {
+  const uint32_t *expected;
+  uint32_t width;
+  uint32_t height;
+  uint32_t stride;
+  _Atomic uint32_t mismatches;
+};
+
+static void compare_row(void *data, uint32_t task,
+                        __attribute__((unused)) uint32_t thread) {
+  struct compare_job *job = data;
+  uint32_t y = (uint64_t)task * job->stride % job->height;
+  uint32_t end_row;
+  const void *row = loader_lock_rows(y, &end_row);
+  assert(end_row > y && end_row <= png_height);
+  const uint32_t *expected = job->expected + (size_t)y * job->width;
+  for (uint32_t x = 0; x < job->width; x++) {
+    uint32_t pixel = png_pixel_size == 1
+                         ? png_palette[((const uint8_t *)row)[x]]
+                         : ((const uint32_t *)row)[x];
+    if (pixel != expected[x] &&
+        atomic_fetch_add(&job->mismatches, 1) < MAX_REPORTED) {
+      fprintf(stderr, "  row %u column %u: expected %08x, got %08x\n", y, x,
+              expected[x], pixel);
+    }
+  }
+  loader_unlock_rows(y);
+}
+
+/* Decodes the file of a case with the loader and returns whether it matches
+ * the reference. */
+static bool check_case(const struct loader_case *loader_case,
+                       const char *path) {
+  alarm(TIMEOUT_SECONDS);
+  thread_pool_init();
+  uint32_t width;
+  uint32_t height;
+  FILE *file = fopen(path, "rb");
+  assert(file != NULL);
+  uint32_t *expected = decode_reference(file, &width, &height);
+  fclose(file);
+
+  const char *loader_path = path;
+  if (loader_case->pipe) {
+    int fds[2];
+    int error = pipe(fds);
+    assert(error == 0);
+    if (fork() == 0) {
+      close(fds[0]);
+      int fd = open(path, O_RDONLY);
+      assert(fd != -1);
+      char buffer[4096];
+      ssize_t size;
+      while ((size = read(fd, buffer, sizeof(buffer))) > 0) {
+        ssize_t written = write(fds[1], buffer, size);
+        assert(written == size);
+      }
+      _exit(0);
+    }
+    close(fds[1]);
+    dup2(fds[0], STDIN_FILENO);
+    close(fds[0]);
+    loader_path = "-";
+  }
+
+  struct png_header header;
+  loader_probe(loader_path, &header);
+  assert(header.width == width && header.height == height);
+  if (loader_case->crop) {
+    loader_crop(loader_case->crop_x, loader_case->crop_y,
+                loader_case->crop_width, loader_case->crop_height);
+    uint32_t *cropped = crop_reference(expected, width, height, loader_case,
+                                       &width, &height);
+    free(expected);
+    expected = cropped;
+  }
+  uint32_t reduction = loader_case->reduction > 1 ? loader_case->reduction : 1;
+  if (reduction != 1) {
+    uint32_t *reduced = reduce_reference(expected, width, height, reduction);
+    free(expected);
+    expected = reduced;
+    width = (width + reduction - 1) / reduction;
+    height = (height + reduction - 1) / reduction;
+  }
+  loader_start(loader_case->share_pixels, loader_case->index_rows,
+               reduction);
+  loader_wait_open();
+  while (png_decoding) {
+    struct pollfd pollfd = {loader_get_fd(), POLLIN, 0};
+    poll(&pollfd, 1, -1);
+    uint32_t first_row;
+    uint32_t last_row;
+    loader_poll(&first_row, &last_row);
+  }
+  assert(png_width == width && png_height == height);
+  assert(png_rows_ready == png_height);
+
+  bool translucent = false;
+  for (size_t i = 0; i < (size_t)width * height; i++) {
+    translucent = translucent || expected[i] >> 24 != 0xFF;
+  }
+  bool matches = true;
+  if (translucent && png_opaque) {
+    fprintf(stderr, "  translucent pixels, but the image is opaque\n");
+    matches = false;
+  }
+
+  /* Twice, so that bands evicted by the first round are decoded again. */
+  const uint32_t strides[2] = {ROW_STRIDE_FIRST, ROW_STRIDE_SECOND};
+  for (uint32_t i = 0; i < 2; i++) {
+    struct compare_job job = {expected, width, height, strides[i], 0};
+    thread_pool_run(compare_row, &job, height);
+    matches = matches && job.mismatches == 0;
+  }
+  free(expected);
+  /* The animation plays from the mapped file. */
+  if (loader_case->image.frame_count != 0 && !loader_case->pipe) {
+    matches = check_animation(&loader_case->image, width, height) && matches;
+  }
+  return matches;
+}
+
+static void describe_case(const struct loader_case *loader_case, char *text,
+                          size_t size) {
+  char image[256];
+  corpus_describe(&loader_case->image, image, sizeof(image));
+  char reduction[32] = "";
+  if (loader_case->reduction > 1) {
+    snprintf(reduction, sizeof(reduction), ", reduced by %u",
+             loader_case->reduction);
+  }
+  char crop[64] = "";
+  if (loader_case->crop) {
+    snprintf(crop, sizeof(crop), ", cropped to %ux%u at %u,%u",
+             loader_case->crop_width, loader_case->crop_height,
+             loader_case->crop_x, loader_case->crop_y);
+  }
+  snprintf(text, size, "%s%s%s%s%s%s", image,
+           loader_case->share_pixels ? ", shared pixels" : "",
+           loader_case->index_rows ? ", row index" : "",
+           loader_case->pipe ? ", from a pipe" : "", reduction, crop);
+}
+
+/* Every format, interlaced or not, with and without tRNS, stored in every
+ * way. */
+static void add_format_cases(void) {
+  for (uint32_t i = 0; i < CORPUS_FORMAT_COUNT; i++) {
+    for (uint32_t variant = 0; variant < 4; variant++) {
+      struct loader_case loader_case = {0};
+      loader_case.image =
+          corpus_image(corpus_formats[i][0], corpus_formats[i][1]);
+      loader_case.image.interlaced = variant & 1;
+      loader_case.image.transparency = variant & 2;
+      loader_case.image.seed = i * 4 + variant + 1;
+      add_case(&loader_case);
+      loader_case.share_pixels = true;
+      add_case(&loader_case);
+      loader_case.share_pixels = false;
+      loader_case.pipe = true;
+      add_case(&loader_case);
+      loader_case.pipe = false;
+      loader_case.index_rows = true;
+      add_case(&loader_case);
+    }
+  }
+}
+
+/* Images with a band of a few rows and small deflate blocks, so that the
+ * row index has checkpoints in most bands and evicts them all the time. */
+static void add_row_index_cases(void) {
+  for (uint32_t i = 0; i < CORPUS_FORMAT_COUNT; i++) {
+    struct loader_case loader_case = {0};
+    loader_case.image =
+        corpus_image(corpus_formats[i][0], corpus_formats[i][1]);
+    loader_case.image.width = 203;
+    loader_case.image.height = 517;
+    loader_case.image.mem_level = 1;
+    loader_case.image.idat_size = 1000;
+    loader_case.image.seed = 100 + i;
+    loader_case.index_rows = true;
+    add_case(&loader_case);
+    /* Blocks that span several bands. */
+    loader_case.image.mem_level = 9;
+    loader_case.image.level = 9;
+    add_case(&loader_case);
+  }
+}
+
+/* Non-interlaced images of every format whose streams are inflated on
+ * several threads, split at full flushes, or at sync flushes that look the
+ * same but refer to the bytes before them. Tiny IDAT chunks split most
+ * markers between two chunks, and stored blocks may contain bytes that look
+ * like markers. */
+static void add_parallel_cases(void) {
+  for (uint32_t i = 0; i < CORPUS_FORMAT_COUNT; i++) {
+    struct loader_case loader_case = {0};
+    loader_case.image =
+        corpus_image(corpus_formats[i][0], corpus_formats[i][1]);
+    loader_case.image.width = 203;
+    loader_case.image.height = 517;
+    loader_case.image.flush_rows = 8;
+    loader_case.image.seed = 200 + i;
+    /* Rows are stored the same way whichever thread inflated them. */
+    loader_case.share_pixels = i % 2 == 1;
+    add_case(&loader_case);
+    loader_case.image.sync_flush = true;
+    add_case(&loader_case);
+    loader_case.image.sync_flush = false;
+    loader_case.image.level = 0;
+    loader_case.image.filter = 0;
+    add_case(&loader_case);
+    loader_case.image.level = 6;
+    loader_case.image.filter = -1;
+    loader_case.image.width = 61;
+    loader_case.image.flush_rows = 3;
+    loader_case.image.idat_size = 5;
+    add_case(&loader_case);
+    /* Without flushes the stream is inflated on one thread. */
+    loader_case.image.flush_rows = 0;
+    loader_case.image.idat_size = 8192;
+    add_case(&loader_case);
+  }
+}
+
+/* Reductions of every format, which libpng decodes if the file is
+ * interlaced, read from a pipe or not RGB or RGBA, and the in-tree code
+ * otherwise, also from streams with full flushes, which are still inflated
+ * on one thread. The sizes aren't multiples of the
+ * reductions, so the blocks at the edges are cut off. */
+static void add_reduction_cases(void) {
+  static const uint32_t reductions[] = {2, 3, 7};
+  for (uint32_t i = 0; i < CORPUS_FORMAT_COUNT; i++) {
+    for (uint32_t j = 0; j < sizeof(reductions) / sizeof(*reductions); j++) {
+      struct loader_case loader_case = {0};
+      loader_case.image =
+          corpus_image(corpus_formats[i][0], corpus_formats[i][1]);
+      loader_case.image.transparency = true;
+      loader_case.image.seed = 300 + i * 3 + j;
+      loader_case.reduction = reductions[j];
+      add_case(&loader_case);
+      loader_case.image.interlaced = true;
+      add_case(&loader_case);
+      loader_case.image.interlaced = false;
+      loader_case.pipe = true;
+      add_case(&loader_case);
+      loader_case.pipe = false;
+      loader_case.image.width = 203;
+      loader_case.image.height = 517;
+      loader_case.image.flush_rows = 8;
+      add_case(&loader_case);
+    }
+  }
+}
+
+/* Crops of every format inside the image, past its right and bottom edges,
+ * of whole rows and of a single pixel, decoded by libpng if the file is
+ * interlaced or read from a pipe, and by the in-tree code otherwise. The row
+ * index is asked for, but doesn't combine with a crop. */
+static void add_crop_cases(void) {
+  static const uint32_t crops[][4] = {
+      {10, 20, 30, 40}, {50, 90, 100, 100}, {0, 0, 61, 5}, {60, 96, 1, 1}};
+  for (uint32_t i = 0; i < CORPUS_FORMAT_COUNT; i++) {
+    for (uint32_t j = 0; j < sizeof(crops) / sizeof(*crops); j++) {
+      struct loader_case loader_case = {0};
+      loader_case.image =
+          corpus_image(corpus_formats[i][0], corpus_formats[i][1]);
+      loader_case.image.transparency = true;
+      loader_case.image.seed = 400 + i * 4 + j;
+      loader_case.crop = true;
+      loader_case.crop_x = crops[j][0];
+      loader_case.crop_y = crops[j][1];
+      loader_case.crop_width = crops[j][2];
+      loader_case.crop_height = crops[j][3];
+      loader_case.index_rows = true;
+      add_case(&loader_case);
+      loader_case.index_rows = false;
+      loader_case.image.interlaced = true;
+      add_case(&loader_case);
+      loader_case.image.interlaced = false;
+      loader_case.pipe = true;
+      add_case(&loader_case);
+      loader_case.pipe = false;
+      loader_case.share_pixels = true;
+      loader_case.image.flush_rows = 4;
+      add_case(&loader_case);
+    }
+  }
+}
+
+/* Animations of every format, with and without the image as their first
+ * frame, and with corrupt frames that they stop before. The frames are
+ * split into fdAT chunks and cover every dispose and blend operation. */
+static void add_animation_cases(void) {
+  for (uint32_t i = 0; i < CORPUS_FORMAT_COUNT; i++) {
+    struct loader_case loader_case = {0};
+    loader_case.image =
+        corpus_image(corpus_formats[i][0], corpus_formats[i][1]);
+    loader_case.image.transparency = true;
+    loader_case.image.idat_size = 500;
+    loader_case.image.frame_count = 7;
+    loader_case.image.default_frame = i % 2 == 0;
+    loader_case.image.seed = 500 + i;
+    add_case(&loader_case);
+    loader_case.image.default_frame = !loader_case.image.default_frame;
+    loader_case.image.corrupt_frame = 3 + i % 5;
+    add_case(&loader_case);
+  }
+}
+
+int main(void) {
+  add_format_cases();
+  add_row_index_cases();
+  add_parallel_cases();
+  add_reduction_cases();
+  add_crop_cases();
+  add_animation_cases();
+
+  uint32_t failures = 0;
+  for (uint32_t i = 0; i < case_count; i++) {
+    char path[64];
+    corpus_write_temporary(&cases[i].image, path);
+    pid_t child = fork();
+    assert(child != -1);
+    if (child == 0) {
+      _exit(check_case(&cases[i], path) ? 0 : 1);
+    }
+    int status;
+    waitpid(child, &status, 0);
+    unlink(path);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      char description[512];
+      describe_case(&cases[i], description, sizeof(description));
+      fprintf(stderr, "FAIL %s\n", description);
+      failures++;
+    }
+  }
+  printf("check-loader: %u of %u cases passed\n", case_count - failures,
+         case_count);
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,208 @@
+#include <assert.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <corpus.h>
+#include <loader.h>
+#include <thread-pool.h>
+
+/* Decodes large generated PNGs reduced to fit a memory budget, and checks
+ * that the peak resident memory of the process stays near the budget
+ * instead of growing with the file or the image. The mapped pages of the
+ * file count as resident as well. Then decodes a crop of the top rows of
+ * them from a cold page cache, and checks that only a prefix of the file
+ * was read into it. Every decode runs in a child process. */
+
+#define WIDTH 5000
+#define HEIGHT 5000
+#define BUDGET (8 << 20)
+/* Memory beyond the budget: the pages of the file that were read since
+ * they were last dropped, in steps of 8 MiB, and the buffers of libpng and
+ * zlib. Decodes take about 8 MiB of it. */
+#define SLACK (16 << 20)
+/* Rows of the crops, whose data is about 2% of the file. */
+#define CROP_HEIGHT 100
+/* Part of the file that the crops may read, with the readahead. */
+#define CROP_FILE_FRACTION 8
+#define TIMEOUT_SECONDS 120
+
+/* Value of a line of /proc/self/status, in bytes. */
+static size_t read_status(const char *name) {
+  FILE *file = fopen("/proc/self/status", "r");
+  assert(file != NULL);
+  char line[256];
+  size_t value = 0;
+  size_t length = strlen(name);
+  while (fgets(line, sizeof(line), file) != NULL) {
+    if (strncmp(line, name, length) == 0 && line[length] == ':') {
+      value = strtoull(line + length + 1, NULL, 10) * 1024;
+    }
+  }
+  fclose(file);
+  return value;
+}
+
+static void decode(void) {
+  loader_wait_open();
+  while (png_decoding) {
+    struct pollfd pollfd = {loader_get_fd(), POLLIN, 0};
+    poll(&pollfd, 1, -1);
+    uint32_t first_row;
+    uint32_t last_row;
+    loader_poll(&first_row, &last_row);
+  }
+}
+
+/* Decodes the file reduced to the budget and returns whether the peak
+ * resident memory stayed within it and the slack. */
+static bool check_reduction(const char *path) {
+  alarm(TIMEOUT_SECONDS);
+  /* Starts counting the peak from what the child inherited. */
+  int fd = open("/proc/self/clear_refs", O_WRONLY);
+  assert(fd != -1);
+  ssize_t written = write(fd, "5", 1);
+  assert(written == 1);
+  close(fd);
+  size_t resident = read_status("VmRSS");
+
+  thread_pool_init();
+  struct png_header header;
+  loader_probe(path, &header);
+  uint32_t reduction =
+      loader_pick_reduction(&header, BUDGET, header.width, header.height);
+  assert(reduction > 1);
+  loader_start(false, false, reduction);
+  decode();
+  size_t peak = read_status("VmHWM") - resident;
+  if (peak > BUDGET + SLACK) {
+    fprintf(stderr, "  peak resident memory grew by %zu MiB, reduced by %u\n",
+            peak >> 20, reduction);
+    return false;
+  }
+  return true;
+}
+
+static bool check_crop(const char *path) {
+  alarm(TIMEOUT_SECONDS);
+  thread_pool_init();
+  struct png_header header;
+  loader_probe(path, &header);
+  loader_crop(0, 0, header.width, CROP_HEIGHT);
+  loader_start(false, false, 1);
+  decode();
+  return png_height == CROP_HEIGHT;
+}
+
+/* Returns the offset past the last page of the file that is in the page
+ * cache, or 0 if none is, and stores the size of the file. */
+static size_t cached_end(const char *path, size_t *size) {
+  int fd = open(path, O_RDONLY);
+  assert(fd != -1);
+  *size = lseek(fd, 0, SEEK_END);
+  void *data = mmap(NULL, *size, PROT_READ, MAP_SHARED, fd, 0);
+  assert(data != MAP_FAILED);
+  close(fd);
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  size_t page_count = (*size + page_size - 1) / page_size;
+  unsigned char *pages = malloc(page_count);
+  assert(pages != NULL);
+  int error = mincore(data, *size, pages);
+  assert(error == 0);
+  size_t end = 0;
+  for (size_t i = 0; i < page_count; i++) {
+    if (pages[i] & 1) {
+      end = (i + 1) * page_size;
+    }
+  }
+  free(pages);
+  munmap(data, *size);
+  return end;
+}
+
+/* Drops the pages of the file from the page cache, returns false if they
+ * stay, as on file systems in memory. */
+static bool drop_cache(const char *path) {
+  int fd = open(path, O_RDONLY);
+  assert(fd != -1);
+  fdatasync(fd);
+  int error = posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  assert(error == 0);
+  close(fd);
+  size_t size;
+  return cached_end(path, &size) == 0;
+}
+
+/* Runs check in a child process and returns whether it passed. */
+static bool run_child(bool (*check)(const char *path), const char *path) {
+  pid_t child = fork();
+  assert(child != -1);
+  if (child == 0) {
+    _exit(check(path) ? 0 : 1);
+  }
+  int status;
+  waitpid(child, &status, 0);
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+int main(void) {
+  /* Inflated on this thread from the mapped file, by libpng from the mapped
+   * file, and with full flushes that could be inflated in parallel. */
+  struct corpus_image images[3] = {corpus_image(6, 8), corpus_image(0, 16),
+                                   corpus_image(2, 8)};
+  images[2].flush_rows = 64;
+  uint32_t image_count = sizeof(images) / sizeof(*images);
+
+  uint32_t case_count = 0;
+  uint32_t failures = 0;
+  for (uint32_t i = 0; i < image_count; i++) {
+    struct corpus_image *image = &images[i];
+    image->width = WIDTH;
+    image->height = HEIGHT;
+    image->level = 1;
+    image->idat_size = 1 << 16;
+    image->seed = 600 + i;
+    char path[64];
+    corpus_write_temporary(image, path);
+    char description[512];
+    corpus_describe(image, description, sizeof(description));
+
+    case_count++;
+    if (!run_child(check_reduction, path)) {
+      fprintf(stderr, "FAIL %s, reduced\n", description);
+      failures++;
+    }
+
+    if (!drop_cache(path)) {
+      fprintf(stderr, "SKIP %s, cropped, the page cache keeps the file\n",
+              description);
+      unlink(path);
+      continue;
+    }
+    case_count++;
+    bool passed = run_child(check_crop, path);
+    size_t size;
+    size_t end = cached_end(path, &size);
+    if (passed && end > size / CROP_FILE_FRACTION) {
+      fprintf(stderr, "  read the file up to %zu of %zu KiB\n", end >> 10,
+              size >> 10);
+      passed = false;
+    }
+    if (!passed) {
+      fprintf(stderr, "FAIL %s, cropped to the top %u rows\n", description,
+              CROP_HEIGHT);
+      failures++;
+    }
+    unlink(path);
+  }
+  printf("check-memory: %u of %u cases passed\n", case_count - failures,
+         case_count);
+  return failures == 0 ? 0 : 1;
+}
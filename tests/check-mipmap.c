@@ -0,0 +1,335 @@
+#include <assert.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <mipmap.h>
+#include <thread-pool.h>
+
+/* Builds the mipmap levels of random premultiplied images of odd and even
+ * sizes, and compares every level with a reference that averages the
+ * blocks of the level below it in linear light with floating point, and
+ * the resampled rows with a reference that samples the levels bilinearly
+ * and blends them with the exact weights. Each level is compared with the
+ * average of the level below as built, so that rounding doesn't add up
+ * over the levels. The levels keep one image per process, so every case
+ * runs in a child process. */
+
+/* Largest difference of a channel from the reference. The levels round
+ * linear light to 12 bits and colors to whole steps before they are
+ * premultiplied again, and the resampler rounds its weights to 1/256. */
+#define TOLERANCE 2
+#define MAX_REPORTED 8
+/* Rows of the image that become ready between updates of the levels. */
+#define READY_STEP 7
+#define TIMEOUT_SECONDS 60
+
+static const uint32_t sizes[][2] = {{2, 2},   {3, 5},    {37, 23},  {64, 1},
+                                    {1, 45},  {100, 67}, {257, 129}};
+
+static uint32_t *image;
+static uint32_t image_width;
+
+static uint32_t next_random(uint32_t *state) {
+  /* xorshift32 */
+  uint32_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  *state = x;
+  return x;
+}
+
+/* Mostly opaque pixels, with fully transparent and translucent ones. */
+static uint32_t random_pixel(uint32_t *random) {
+  uint32_t kind = next_random(random) % 4;
+  uint32_t alpha =
+      kind < 2 ? 0xFF : kind == 2 ? 0 : next_random(random) % 0xFF;
+  uint32_t pixel = alpha << 24;
+  for (uint32_t shift = 0; shift < 24; shift += 8) {
+    pixel |= next_random(random) % (alpha + 1) << shift;
+  }
+  return pixel;
+}
+
+static void read_image_row(uint32_t *destination, uint32_t y) {
+  memcpy(destination, image + (size_t)y * image_width,
+         image_width * sizeof(*image));
+}
+
+/* Row y of a level, level 0 being the image. */
+static const uint32_t *level_row(uint32_t level, uint32_t y) {
+  return level == 0 ? image + (size_t)y * image_width : mipmap_row(level, y);
+}
+
+static double to_linear(double color) {
+  return color <= 0.04045 ? color / 12.92 : pow((color + 0.055) / 1.055, 2.4);
+}
+
+static double to_srgb(double linear) {
+  return linear <= 0.0031308 ? linear * 12.92
+                             : 1.055 * pow(linear, 1 / 2.4) - 0.055;
+}
+
+/* Averages count premultiplied pixels in linear light, weighting their
+ * colors by their alpha. */
+static uint32_t average_reference(const uint32_t *pixels, uint32_t count) {
+  uint32_t alpha_sum = 0;
+  double sums[3] = {0, 0, 0};
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t alpha = pixels[i] >> 24;
+    alpha_sum += alpha;
+    for (uint32_t channel = 0; channel < 3 && alpha != 0; channel++) {
+      double color = ((pixels[i] >> (16 - channel * 8)) & 0xFF) / (double)alpha;
+      sums[channel] += to_linear(color < 1 ? color : 1) * alpha;
+    }
+  }
+  if (alpha_sum == 0) {
+    return 0;
+  }
+  uint32_t alpha = (alpha_sum + count / 2) / count;
+  uint32_t pixel = alpha << 24;
+  for (uint32_t channel = 0; channel < 3; channel++) {
+    double color = to_srgb(sums[channel] / alpha_sum) * 255;
+    pixel |= (uint32_t)lround(round(color) * alpha / 255)
+             << (16 - channel * 8);
+  }
+  return pixel;
+}
+
+/* Returns the largest difference of a channel of the pixels. */
+static uint32_t difference(uint32_t pixel, uint32_t expected) {
+  uint32_t largest = 0;
+  for (uint32_t shift = 0; shift < 32; shift += 8) {
+    int32_t channel_difference =
+        (int32_t)((pixel >> shift) & 0xFF) - (int32_t)((expected >> shift) & 0xFF);
+    uint32_t size = abs(channel_difference);
+    largest = size > largest ? size : largest;
+  }
+  return largest;
+}
+
+/* Compares a pixel with the reference, reporting the first mismatches. */
+static bool compare_pixel(const char *what, uint32_t level, uint32_t x,
+                          uint32_t y, uint32_t pixel, uint32_t expected,
+                          uint32_t *mismatches) {
+  if (difference(pixel, expected) <= TOLERANCE) {
+    return true;
+  }
+  if ((*mismatches)++ < MAX_REPORTED) {
+    fprintf(stderr, "  %s level %u row %u column %u: expected %08x, got %08x\n",
+            what, level, y, x, expected, pixel);
+  }
+  return false;
+}
+
+/* Compares every level above 0 with the average of the blocks of up to 2x2
+ * pixels of the one below, which are cut off at odd sizes. */
+static bool check_levels(void) {
+  uint32_t mismatches = 0;
+  for (uint32_t level = 1; level < mipmap_level_count(); level++) {
+    uint32_t width = mipmap_width(level);
+    uint32_t height = mipmap_height(level);
+    uint32_t source_width = mipmap_width(level - 1);
+    uint32_t source_height = mipmap_height(level - 1);
+    if (width != (source_width + 1) / 2 || height != (source_height + 1) / 2) {
+      fprintf(stderr, "  level %u is %ux%u pixels\n", level, width, height);
+      return false;
+    }
+    if (mipmap_rows_ready(level) != height) {
+      fprintf(stderr, "  level %u has %u of %u rows\n", level,
+              mipmap_rows_ready(level), height);
+      return false;
+    }
+    for (uint32_t y = 0; y < height; y++) {
+      for (uint32_t x = 0; x < width; x++) {
+        uint32_t pixels[4];
+        uint32_t count = 0;
+        for (uint32_t source_y = y * 2;
+             source_y < y * 2 + 2 && source_y < source_height; source_y++) {
+          for (uint32_t source_x = x * 2;
+               source_x < x * 2 + 2 && source_x < source_width; source_x++) {
+            pixels[count++] = level_row(level - 1, source_y)[source_x];
+          }
+        }
+        compare_pixel("mipmap", level, x, y, mipmap_row(level, y)[x],
+                      average_reference(pixels, count), &mismatches);
+      }
+    }
+  }
+  return mismatches == 0;
+}
+
+/* Position in a level of size pixels that output pixel i samples, at scale
+ * pixels of level 0 per output pixel, clamped to the first and last
+ * pixels. */
+static double sample_position(uint32_t i, double scale, uint32_t level,
+                              uint32_t size) {
+  double position = (i + 0.5) * scale / (1u << level) - 0.5;
+  if (position < 0) {
+    return 0;
+  }
+  return position < size - 1 ? position : size - 1;
+}
+
+/* Channel at shift of a level sampled bilinearly at x, y. */
+static double sample_level(uint32_t level, double x, double y,
+                           uint32_t shift) {
+  uint32_t left = x;
+  uint32_t top = y;
+  uint32_t right = left + 1 < mipmap_width(level) ? left + 1 : left;
+  uint32_t bottom = top + 1 < mipmap_height(level) ? top + 1 : top;
+  double fraction_x = x - left;
+  double fraction_y = y - top;
+  double values[2];
+  for (uint32_t i = 0; i < 2; i++) {
+    const uint32_t *row = level_row(level, i == 0 ? top : bottom);
+    values[i] = ((row[left] >> shift) & 0xFF) * (1 - fraction_x) +
+                ((row[right] >> shift) & 0xFF) * fraction_x;
+  }
+  return values[0] * (1 - fraction_y) + values[1] * fraction_y;
+}
+
+/* Resamples the image to width x height pixels and compares every row with
+ * bilinear samples of the level whose scale is the next power of 2 below
+ * that of the larger axis, blended with the level above it by how far the
+ * scale is from it with trilinear. Then checks which rows
+ * mipmap_resample_rows finds for rows of the image that changed. */
+static bool check_resample(uint32_t width, uint32_t height, bool trilinear) {
+  uint32_t highest = mipmap_set_resample_size(width, height, trilinear);
+  bool pending;
+  mipmap_update(highest, mipmap_height(0), UINT64_MAX, &pending);
+
+  double scale_x = (double)mipmap_width(0) / width;
+  double scale_y = (double)mipmap_height(0) / height;
+  double detail = log2(scale_x > scale_y ? scale_x : scale_y);
+  uint32_t levels[2];
+  levels[0] = detail;
+  double blend = trilinear ? detail - levels[0] : 0;
+  if (levels[0] >= mipmap_level_count() - 1) {
+    levels[0] = mipmap_level_count() - 1;
+    blend = 0;
+  }
+  levels[1] = blend != 0 ? levels[0] + 1 : levels[0];
+
+  uint32_t *row = malloc(width * sizeof(*row));
+  assert(row != NULL);
+  uint32_t mismatches = 0;
+  for (uint32_t y = 0; y < height; y++) {
+    if (!mipmap_resample_row(row, y, 0)) {
+      fprintf(stderr, "  resampled row %u is not ready\n", y);
+      free(row);
+      return false;
+    }
+    for (uint32_t x = 0; x < width; x++) {
+      uint32_t expected = 0;
+      for (uint32_t shift = 0; shift < 32; shift += 8) {
+        double values[2];
+        for (uint32_t i = 0; i < 2; i++) {
+          uint32_t level = levels[i];
+          values[i] = sample_level(
+              level, sample_position(x, scale_x, level, mipmap_width(level)),
+              sample_position(y, scale_y, level, mipmap_height(level)),
+              shift);
+        }
+        expected |= (uint32_t)lround(values[0] * (1 - blend) +
+                                     values[1] * blend)
+                    << shift;
+      }
+      compare_pixel(trilinear ? "trilinear" : "bilinear", levels[0], x, y,
+                    row[x], expected, &mismatches);
+    }
+  }
+
+  /* The rows before those that read levels built from the rows of the image
+   * from first_row on still render once those are invalidated, and the
+   * first that reads them doesn't, unless it reads the image itself. */
+  uint32_t first_row = mipmap_height(0) / 3;
+  uint32_t first_y;
+  uint32_t last_y;
+  mipmap_resample_rows(first_row, mipmap_height(0), &first_y, &last_y);
+  mipmap_invalidate(first_row);
+  bool ready = true;
+  for (uint32_t y = 0; y < first_y; y++) {
+    ready = mipmap_resample_row(row, y, 0) && ready;
+  }
+  if (!ready || last_y != height ||
+      (levels[0] != 0 && mipmap_resample_row(row, first_y, 0))) {
+    fprintf(stderr, "  rows [%u, %u) read rows from %u on\n", first_y, last_y,
+            first_row);
+    mismatches++;
+  }
+
+  free(row);
+  if (mismatches != 0) {
+    fprintf(stderr, "  resampled to %ux%u\n", width, height);
+  }
+  return mismatches == 0;
+}
+
+static bool check_case(uint32_t width, uint32_t height, uint32_t seed) {
+  alarm(TIMEOUT_SECONDS);
+  thread_pool_init();
+  image_width = width;
+  image = malloc((size_t)width * height * sizeof(*image));
+  assert(image != NULL);
+  uint32_t random = seed * 2654435761u + 1;
+  for (size_t i = 0; i < (size_t)width * height; i++) {
+    image[i] = random_pixel(&random);
+  }
+  mipmap_init(width, height, read_image_row);
+
+  /* The rows of the image become ready a few at a time, like while they are
+   * decoded. */
+  uint32_t ready_rows = 0;
+  bool pending = true;
+  while (ready_rows < height || pending) {
+    ready_rows = ready_rows + READY_STEP < height ? ready_rows + READY_STEP
+                                                 : height;
+    mipmap_update(mipmap_level_count() - 1, ready_rows, UINT64_MAX,
+                  &pending);
+  }
+  bool passed = check_levels();
+
+  /* Halves, odd fractions, a single pixel, and one pixel less than the
+   * image, each with and without trilinear filtering. */
+  const uint32_t targets[][2] = {
+      {(width + 1) / 2, (height + 1) / 2},
+      {width * 2 / 3 + 1, height * 3 / 4 + 1},
+      {width / 5 + 1, height / 7 + 1},
+      {1, 1},
+      {width > 1 ? width - 1 : 1, height > 1 ? height - 1 : 1}};
+  for (uint32_t i = 0; i < sizeof(targets) / sizeof(*targets); i++) {
+    uint32_t target_width = targets[i][0] < width ? targets[i][0] : width;
+    uint32_t target_height = targets[i][1] < height ? targets[i][1] : height;
+    passed = check_resample(target_width, target_height, false) && passed;
+    passed = check_resample(target_width, target_height, true) && passed;
+  }
+  return passed;
+}
+
+int main(void) {
+  uint32_t case_count = sizeof(sizes) / sizeof(*sizes);
+  uint32_t failures = 0;
+  for (uint32_t i = 0; i < case_count; i++) {
+    pid_t child = fork();
+    assert(child != -1);
+    if (child == 0) {
+      _exit(check_case(sizes[i][0], sizes[i][1], 700 + i) ? 0 : 1);
+    }
+    int status;
+    waitpid(child, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      fprintf(stderr, "FAIL %ux%u\n", sizes[i][0], sizes[i][1]);
+      failures++;
+    }
+  }
+  printf("check-mipmap: %u of %u cases passed\n", case_count - failures,
+         case_count);
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,177 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <corpus.h>
+#include <png.h>
+#include <unfilter.h>
+#include <zlib.h>
+
+/* Inflates the IDAT chunks of generated PNGs of every format and filter
+ * type, unfilters them with the scalar code and then with the vectorized
+ * one, and compares the rows with those that libpng reads without any
+ * transforms. */
+
+#define MAX_REPORTED 8
+
+static const uint32_t widths[] = {1, 2, 5, 16, 61, 203};
+
+struct memory_file {
+  const uint8_t *data;
+  size_t size;
+  size_t offset;
+};
+
+static void read_memory(png_structp png, png_bytep data, size_t length) {
+  struct memory_file *file = png_get_io_ptr(png);
+  if (length > file->size - file->offset) {
+    png_error(png, "read past the end");
+  }
+  memcpy(data, file->data + file->offset, length);
+  file->offset += length;
+}
+
+/* Rows of the file as libpng reads them, row_size bytes each. */
+static uint8_t *decode_reference(const uint8_t *data, size_t size,
+                                 uint32_t height, size_t row_size) {
+  png_structp png =
+      png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+  assert(png != NULL);
+  png_infop info = png_create_info_struct(png);
+  assert(info != NULL);
+  struct memory_file file = {data, size, 0};
+  png_set_read_fn(png, &file, read_memory);
+  png_read_info(png, info);
+  assert(png_get_rowbytes(png, info) == row_size);
+  uint8_t *rows = malloc(row_size * height);
+  assert(rows != NULL);
+  for (uint32_t y = 0; y < height; y++) {
+    png_read_row(png, rows + y * row_size, NULL);
+  }
+  png_destroy_read_struct(&png, &info, NULL);
+  return rows;
+}
+
+static uint32_t read_uint32(const uint8_t *bytes) {
+  return (uint32_t)bytes[0] << 24 | bytes[1] << 16 | bytes[2] << 8 | bytes[3];
+}
+
+/* Inflates the concatenated IDAT chunks of the file. */
+static uint8_t *inflate_idat(const uint8_t *data, size_t size,
+                             size_t inflated_size) {
+  z_stream stream = {0};
+  int result = inflateInit(&stream);
+  assert(result == Z_OK);
+  uint8_t *inflated = malloc(inflated_size);
+  assert(inflated != NULL);
+  stream.next_out = inflated;
+  stream.avail_out = inflated_size;
+  for (size_t offset = 8; offset + 12 <= size;) {
+    uint32_t length = read_uint32(data + offset);
+    if (memcmp(data + offset + 4, "IDAT", 4) == 0) {
+      stream.next_in = (Bytef *)data + offset + 8;
+      stream.avail_in = length;
+      result = inflate(&stream, Z_NO_FLUSH);
+      assert(result == Z_OK || result == Z_STREAM_END);
+    }
+    offset += 12 + (size_t)length;
+  }
+  assert(result == Z_STREAM_END && stream.avail_out == 0);
+  inflateEnd(&stream);
+  return inflated;
+}
+
+/* Unfilters an image in pieces of odd sizes and returns whether every row
+ * matches libpng. */
+static bool check_image(const struct corpus_image *image) {
+  size_t size;
+  uint8_t *data = corpus_encode(image, &size);
+  uint32_t bits_per_pixel =
+      image->bit_depth * (image->color_type == 2   ? 3
+                          : image->color_type == 4 ? 2
+                          : image->color_type == 6 ? 4
+                                                   : 1);
+  uint32_t pixel_size = bits_per_pixel < 8 ? 1 : bits_per_pixel / 8;
+  size_t row_size = ((size_t)image->width * bits_per_pixel + 7) / 8;
+  uint8_t *expected = decode_reference(data, size, image->height, row_size);
+  uint8_t *inflated =
+      inflate_idat(data, size, (row_size + 1) * image->height);
+
+  struct unfilter rows;
+  unfilter_init(&rows, row_size, pixel_size, NULL, 0);
+  uint32_t mismatches = 0;
+  size_t offset = 0;
+  size_t piece = 1;
+  while (rows.y < image->height) {
+    size_t left = (row_size + 1) * image->height - offset;
+    offset += unfilter_fill(&rows, inflated + offset,
+                            piece < left ? piece : left);
+    piece = piece * 3 % 1021 + 1;
+    if (!unfilter_complete(&rows)) {
+      continue;
+    }
+    uint32_t y = rows.y;
+    const uint8_t *row = unfilter_next(&rows);
+    const uint8_t *expected_row = expected + y * row_size;
+    for (size_t x = 0; x < row_size; x++) {
+      /* libpng leaves the padding bits of the last byte alone. */
+      uint8_t mask = 0xFF;
+      if (x == row_size - 1 && image->width * bits_per_pixel % 8 != 0) {
+        mask <<= 8 - image->width * bits_per_pixel % 8;
+      }
+      if (((row[x] ^ expected_row[x]) & mask) != 0 &&
+          mismatches++ < MAX_REPORTED) {
+        fprintf(stderr, "  row %u byte %zu: expected %02x, got %02x\n", y, x,
+                expected_row[x], row[x]);
+      }
+    }
+  }
+  unfilter_finish(&rows);
+  free(inflated);
+  free(expected);
+  free(data);
+  return mismatches == 0;
+}
+
+/* Checks every format and width with every filter type, and with a random
+ * one per row. */
+static uint32_t check_images(const char *unfiltering) {
+  uint32_t failures = 0;
+  uint32_t count = 0;
+  for (uint32_t i = 0; i < CORPUS_FORMAT_COUNT; i++) {
+    for (size_t j = 0; j < sizeof(widths) / sizeof(*widths); j++) {
+      for (int filter = -1; filter < 5; filter++) {
+        struct corpus_image image =
+            corpus_image(corpus_formats[i][0], corpus_formats[i][1]);
+        image.width = widths[j];
+        image.height = 19;
+        image.transparency = true;
+        image.filter = filter;
+        image.seed = count + 1;
+        count++;
+        if (!check_image(&image)) {
+          char description[256];
+          corpus_describe(&image, description, sizeof(description));
+          fprintf(stderr, "FAIL %s, %s\n", description, unfiltering);
+          failures++;
+        }
+      }
+    }
+  }
+  printf("check-unfilter: %u of %u %s images passed\n", count - failures,
+         count, unfiltering);
+  return failures;
+}
+
+int main(void) {
+  /* Rows are unfiltered by the scalar code until unfilter_select picks the
+   * vector instructions. */
+  uint32_t failures = check_images("scalar");
+  unfilter_select();
+  failures += check_images(unfilter_is_vectorized(4) ? "vectorized"
+                                                       : "scalar again");
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,495 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <corpus.h>
+#include <zlib.h>
+
+const uint8_t corpus_formats[CORPUS_FORMAT_COUNT][2] = {
+    {0, 1}, {0, 2}, {0, 4}, {0, 8}, {0, 16}, {2, 8},  {2, 16}, {3, 1},
+    {3, 2}, {3, 4}, {3, 8}, {4, 8}, {4, 16}, {6, 8}, {6, 16}};
+
+/* Adam7 pass origins and steps. */
+static const uint8_t pass_x[7] = {0, 4, 0, 2, 0, 1, 0};
+static const uint8_t pass_y[7] = {0, 0, 4, 0, 2, 0, 1};
+static const uint8_t pass_dx[7] = {8, 8, 4, 4, 2, 2, 1};
+static const uint8_t pass_dy[7] = {8, 8, 8, 4, 4, 2, 2};
+
+struct corpus_image corpus_image(uint8_t color_type, uint8_t bit_depth) {
+  struct corpus_image image = {.width = 61,
+                               .height = 97,
+                               .bit_depth = bit_depth,
+                               .color_type = color_type,
+                               .interlaced = false,
+                               .transparency = false,
+                               .filter = -1,
+                               .level = 6,
+                               .mem_level = 8,
+                               .flush_rows = 0,
+                               .sync_flush = false,
+                               .idat_size = 8192,
+                               .frame_count = 0,
+                               .default_frame = false,
+                               .corrupt_frame = 0,
+                               .seed = 1};
+  return image;
+}
+
+static uint32_t next_random(uint32_t *state) {
+  /* xorshift32 */
+  uint32_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  *state = x;
+  return x;
+}
+
+static uint32_t channel_count(uint8_t color_type) {
+  static const uint8_t counts[7] = {1, 0, 3, 1, 2, 0, 4};
+  return counts[color_type];
+}
+
+/* Value of the samples that tRNS makes transparent in gray and truecolor
+ * images. */
+static uint32_t transparent_sample(const struct corpus_image *image) {
+  return image->bit_depth == 16 ? 0x1234 : 5 & ((1u << image->bit_depth) - 1);
+}
+
+/* Samples of every pixel, before packing them into bytes. */
+static uint32_t *generate_samples(const struct corpus_image *image,
+                                  uint32_t *random) {
+  uint32_t channels = channel_count(image->color_type);
+  uint32_t max = (1u << image->bit_depth) - 1;
+  bool alpha = (image->color_type & 4) != 0;
+  uint32_t *samples =
+      malloc((size_t)image->width * image->height * channels * 4);
+  assert(samples != NULL);
+  uint32_t *sample = samples;
+  for (uint32_t y = 0; y < image->height; y++) {
+    for (uint32_t x = 0; x < image->width; x++) {
+      uint32_t kind = next_random(random) % 8;
+      for (uint32_t c = 0; c < channels; c++) {
+        uint32_t value;
+        if (kind < 5) {
+          value = (x * (c + 3) * 7 + y * 5 + c * 50) * (max / 255 + 1);
+        } else {
+          value = next_random(random);
+        }
+        value &= max;
+        if (alpha && c == channels - 1) {
+          /* Mostly opaque, with fully transparent and translucent
+           * pixels. */
+          value = kind < 4 ? max : kind == 4 ? 0 : value;
+        }
+        *sample++ = value;
+      }
+      if (image->transparency && image->color_type != 3 && kind == 7) {
+        for (uint32_t c = 0; c < channels; c++) {
+          (sample - channels)[c] = transparent_sample(image);
+        }
+      }
+    }
+  }
+  return samples;
+}
+
+/* Packs width samples of channels each, from samples step pixels apart,
+ * into a row of the file. */
+static void pack_row(const struct corpus_image *image, uint8_t *row,
+                     const uint32_t *samples, uint32_t width, uint32_t step) {
+  uint32_t channels = channel_count(image->color_type);
+  uint32_t bits = image->bit_depth;
+  memset(row, 0, ((size_t)width * channels * bits + 7) / 8);
+  size_t bit = 0;
+  for (uint32_t x = 0; x < width; x++) {
+    const uint32_t *pixel = samples + (size_t)x * step * channels;
+    for (uint32_t c = 0; c < channels; c++) {
+      if (bits == 16) {
+        row[bit / 8] = pixel[c] >> 8;
+        row[bit / 8 + 1] = pixel[c] & 0xFF;
+      } else {
+        row[bit / 8] |= pixel[c] << (8 - bits - bit % 8);
+      }
+      bit += bits;
+    }
+  }
+}
+
+static uint8_t paeth(uint8_t a, uint8_t b, uint8_t c) {
+  int p = a + b - c;
+  int pa = abs(p - a);
+  int pb = abs(p - b);
+  int pc = abs(p - c);
+  if (pa <= pb && pa <= pc) {
+    return a;
+  }
+  return pb <= pc ? b : c;
+}
+
+/* Filters row, whose previous row is previous, into filtered with the
+ * filter type byte in front. */
+static void filter_row(uint8_t *filtered, const uint8_t *row,
+                       const uint8_t *previous, size_t size, uint32_t bpp,
+                       uint8_t type) {
+  filtered[0] = type;
+  for (size_t i = 0; i < size; i++) {
+    uint8_t a = i >= bpp ? row[i - bpp] : 0;
+    uint8_t b = previous[i];
+    uint8_t c = i >= bpp ? previous[i - bpp] : 0;
+    uint8_t prediction = type == 1   ? a
+                         : type == 2 ? b
+                         : type == 3 ? (a + b) / 2
+                         : type == 4 ? paeth(a, b, c)
+                                     : 0;
+    filtered[i + 1] = row[i] - prediction;
+  }
+}
+
+struct output {
+  uint8_t *data;
+  size_t size;
+  size_t capacity;
+};
+
+static void output_reserve(struct output *output, size_t size) {
+  if (output->size + size > output->capacity) {
+    output->capacity = (output->size + size) * 2;
+    output->data = realloc(output->data, output->capacity);
+    assert(output->data != NULL);
+  }
+}
+
+static void output_bytes(struct output *output, const void *data,
+                         size_t size) {
+  output_reserve(output, size);
+  memcpy(output->data + output->size, data, size);
+  output->size += size;
+}
+
+static void output_uint32(struct output *output, uint32_t value) {
+  uint8_t bytes[4] = {value >> 24, value >> 16, value >> 8, value};
+  output_bytes(output, bytes, 4);
+}
+
+static void output_chunk(struct output *output, const char *type,
+                         const uint8_t *data, size_t size) {
+  output_uint32(output, size);
+  output_bytes(output, type, 4);
+  uLong crc = crc32(0, (const Bytef *)type, 4);
+  /* crc32 returns 0 for NULL data. */
+  if (size != 0) {
+    output_bytes(output, data, size);
+    crc = crc32(crc, data, size);
+  }
+  output_uint32(output, crc);
+}
+
+/* Deflates size bytes with flush into output. */
+static void deflate_bytes(z_stream *stream, struct output *output,
+                          const uint8_t *data, size_t size, int flush) {
+  stream->next_in = (Bytef *)data;
+  stream->avail_in = size;
+  for (;;) {
+    output_reserve(output, 65536);
+    stream->next_out = output->data + output->size;
+    stream->avail_out = output->capacity - output->size;
+    int result = deflate(stream, flush);
+    assert(result == Z_OK || result == Z_STREAM_END || result == Z_BUF_ERROR);
+    output->size = stream->next_out - output->data;
+    if (stream->avail_in == 0 && stream->avail_out != 0 &&
+        (flush != Z_FINISH || result == Z_STREAM_END)) {
+      return;
+    }
+  }
+}
+
+/* Deflates the filtered rows of the image, whose samples are drawn from
+ * random, into stream. */
+static void encode_rows(const struct corpus_image *image, uint32_t *random,
+                        struct output *stream) {
+  uint32_t channels = channel_count(image->color_type);
+  assert(channels != 0);
+  uint32_t bits_per_pixel = channels * image->bit_depth;
+  uint32_t bpp = bits_per_pixel < 8 ? 1 : bits_per_pixel / 8;
+  size_t row_size = ((size_t)image->width * bits_per_pixel + 7) / 8;
+  uint32_t *samples = generate_samples(image, random);
+
+  z_stream deflater = {0};
+  int result = deflateInit2(&deflater, image->level, Z_DEFLATED, 15,
+                            image->mem_level, Z_DEFAULT_STRATEGY);
+  assert(result == Z_OK);
+  uint8_t *row = malloc(row_size);
+  uint8_t *previous = malloc(row_size);
+  uint8_t *filtered = malloc(row_size + 1);
+  assert(row != NULL && previous != NULL && filtered != NULL);
+  uint32_t rows = 0;
+  for (uint32_t pass = 0; pass < (image->interlaced ? 7u : 1u); pass++) {
+    uint32_t first_x = image->interlaced ? pass_x[pass] : 0;
+    uint32_t first_y = image->interlaced ? pass_y[pass] : 0;
+    uint32_t step_x = image->interlaced ? pass_dx[pass] : 1;
+    uint32_t step_y = image->interlaced ? pass_dy[pass] : 1;
+    if (first_x >= image->width || first_y >= image->height) {
+      continue;
+    }
+    uint32_t width = (image->width - first_x + step_x - 1) / step_x;
+    size_t pass_row_size = ((size_t)width * bits_per_pixel + 7) / 8;
+    memset(previous, 0, pass_row_size);
+    for (uint32_t y = first_y; y < image->height; y += step_y) {
+      pack_row(image, row,
+               samples + ((size_t)y * image->width + first_x) * channels,
+               width, step_x);
+      uint8_t type = image->filter >= 0 ? (uint32_t)image->filter
+                                        : next_random(random) % 5;
+      filter_row(filtered, row, previous, pass_row_size, bpp, type);
+      memcpy(previous, row, pass_row_size);
+      rows++;
+      int flush = Z_NO_FLUSH;
+      if (image->flush_rows != 0 && rows % image->flush_rows == 0) {
+        flush = image->sync_flush ? Z_SYNC_FLUSH : Z_FULL_FLUSH;
+      }
+      deflate_bytes(&deflater, stream, filtered, pass_row_size + 1, flush);
+    }
+  }
+  deflate_bytes(&deflater, stream, NULL, 0, Z_FINISH);
+  deflateEnd(&deflater);
+  free(row);
+  free(previous);
+  free(filtered);
+  free(samples);
+}
+
+void corpus_frame(const struct corpus_image *image, uint32_t index,
+                  struct corpus_frame *frame) {
+  assert(index < image->frame_count);
+  if (index == 0 && image->default_frame) {
+    frame->x = 0;
+    frame->y = 0;
+    frame->width = image->width;
+    frame->height = image->height;
+  } else {
+    uint32_t random = (image->seed + index * 7919) * 2654435761u + 1;
+    frame->width = 1 + next_random(&random) % image->width;
+    frame->height = 1 + next_random(&random) % image->height;
+    frame->x = next_random(&random) % (image->width - frame->width + 1);
+    frame->y = next_random(&random) % (image->height - frame->height + 1);
+  }
+  /* Every combination once every 6 frames. */
+  frame->dispose = index % 3;
+  frame->blend = index / 3 % 2;
+}
+
+/* Deflates the rows of frame index into stream. */
+static void encode_frame_rows(const struct corpus_image *image,
+                              uint32_t index, struct output *stream) {
+  struct corpus_frame frame;
+  corpus_frame(image, index, &frame);
+  struct corpus_image frame_image = *image;
+  frame_image.width = frame.width;
+  frame_image.height = frame.height;
+  frame_image.seed = image->seed + (index + 1) * 104729;
+  uint32_t random = frame_image.seed * 2654435761u + 1;
+  encode_rows(&frame_image, &random, stream);
+}
+
+/* Writes the stream as chunks of the type of at most idat_size bytes of it
+ * each, those of fdAT after a sequence number. */
+static void output_stream(struct output *png, const char *type,
+                          const struct output *stream, size_t idat_size,
+                          uint32_t *sequence) {
+  uint8_t *chunk = malloc(idat_size + 4);
+  assert(chunk != NULL);
+  for (size_t offset = 0; offset < stream->size; offset += idat_size) {
+    size_t size =
+        stream->size - offset < idat_size ? stream->size - offset : idat_size;
+    if (sequence != NULL) {
+      uint8_t number[4] = {*sequence >> 24, *sequence >> 16, *sequence >> 8,
+                           *sequence};
+      memcpy(chunk, number, 4);
+      memcpy(chunk + 4, stream->data + offset, size);
+      output_chunk(png, type, chunk, size + 4);
+      ++*sequence;
+    } else {
+      output_chunk(png, type, stream->data + offset, size);
+    }
+  }
+  free(chunk);
+}
+
+static void output_frame_control(struct output *png,
+                                 const struct corpus_image *image,
+                                 uint32_t index, uint32_t *sequence) {
+  struct corpus_frame frame;
+  corpus_frame(image, index, &frame);
+  const uint32_t values[5] = {*sequence, frame.width, frame.height, frame.x,
+                              frame.y};
+  uint8_t control[26];
+  for (uint32_t i = 0; i < 5; i++) {
+    control[i * 4] = values[i] >> 24;
+    control[i * 4 + 1] = values[i] >> 16;
+    control[i * 4 + 2] = values[i] >> 8;
+    control[i * 4 + 3] = values[i];
+  }
+  /* Delays of 2/100 s. */
+  control[20] = 0;
+  control[21] = 2;
+  control[22] = 0;
+  control[23] = 100;
+  control[24] = frame.dispose;
+  control[25] = frame.blend;
+  output_chunk(png, "fcTL", control, sizeof(control));
+  ++*sequence;
+}
+
+/* Encodes the image, or with still_frame frame index of it as a PNG of the
+ * size of the frame without the animation. */
+static uint8_t *encode(const struct corpus_image *image, bool still_frame,
+                       uint32_t index, size_t *size) {
+  /* Frames are never interlaced, so neither is a default image among
+   * them. */
+  assert(image->frame_count == 0 ||
+         !(image->interlaced && image->default_frame));
+  uint32_t random = image->seed * 2654435761u + 1;
+  uint32_t channels = channel_count(image->color_type);
+  struct output idat = {0};
+  encode_rows(image, &random, &idat);
+
+  struct output png = {0};
+  output_bytes(&png, "\x89PNG\r\n\x1a\n", 8);
+  uint32_t width = image->width;
+  uint32_t height = image->height;
+  if (still_frame) {
+    struct corpus_frame frame;
+    corpus_frame(image, index, &frame);
+    width = frame.width;
+    height = frame.height;
+  }
+  uint8_t header[13];
+  header[0] = width >> 24;
+  header[1] = width >> 16;
+  header[2] = width >> 8;
+  header[3] = width;
+  header[4] = height >> 24;
+  header[5] = height >> 16;
+  header[6] = height >> 8;
+  header[7] = height;
+  header[8] = image->bit_depth;
+  header[9] = image->color_type;
+  header[10] = 0;
+  header[11] = 0;
+  header[12] = image->interlaced && !still_frame;
+  output_chunk(&png, "IHDR", header, sizeof(header));
+  if (image->color_type == 3) {
+    uint32_t entries = 1u << image->bit_depth;
+    uint8_t palette[256 * 3];
+    for (uint32_t i = 0; i < entries * 3; i++) {
+      palette[i] = next_random(&random);
+    }
+    output_chunk(&png, "PLTE", palette, entries * 3);
+    if (image->transparency) {
+      /* Fewer alphas than entries, the others stay opaque. */
+      uint8_t alphas[256];
+      uint32_t count = (entries + 1) / 2;
+      for (uint32_t i = 0; i < count; i++) {
+        uint32_t kind = next_random(&random) % 3;
+        alphas[i] = kind == 0 ? 0 : kind == 1 ? 0xFF : next_random(&random);
+      }
+      output_chunk(&png, "tRNS", alphas, count);
+    }
+  } else if (image->transparency && (image->color_type & 4) == 0) {
+    uint8_t color[6];
+    uint32_t sample = transparent_sample(image);
+    for (uint32_t c = 0; c < channels; c++) {
+      color[c * 2] = sample >> 8;
+      color[c * 2 + 1] = sample & 0xFF;
+    }
+    output_chunk(&png, "tRNS", color, channels * 2);
+  }
+
+  if (still_frame) {
+    struct output stream = {0};
+    if (index == 0 && image->default_frame) {
+      output_bytes(&stream, idat.data, idat.size);
+    } else {
+      encode_frame_rows(image, index, &stream);
+    }
+    output_stream(&png, "IDAT", &stream, image->idat_size, NULL);
+    free(stream.data);
+  } else if (image->frame_count != 0) {
+    /* Played once. */
+    uint8_t control[8] = {image->frame_count >> 24, image->frame_count >> 16,
+                          image->frame_count >> 8, image->frame_count,
+                          0, 0, 0, 1};
+    output_chunk(&png, "acTL", control, sizeof(control));
+    uint32_t sequence = 0;
+    if (image->default_frame) {
+      output_frame_control(&png, image, 0, &sequence);
+    }
+    output_stream(&png, "IDAT", &idat, image->idat_size, NULL);
+    for (uint32_t i = image->default_frame ? 1 : 0; i < image->frame_count;
+         i++) {
+      output_frame_control(&png, image, i, &sequence);
+      struct output stream = {0};
+      encode_frame_rows(image, i, &stream);
+      if (i + 1 == image->corrupt_frame) {
+        stream.size /= 2;
+      }
+      output_stream(&png, "fdAT", &stream, image->idat_size, &sequence);
+      free(stream.data);
+    }
+  } else {
+    output_stream(&png, "IDAT", &idat, image->idat_size, NULL);
+  }
+  output_chunk(&png, "IEND", NULL, 0);
+  free(idat.data);
+  *size = png.size;
+  return png.data;
+}
+
+uint8_t *corpus_encode(const struct corpus_image *image, size_t *size) {
+  return encode(image, false, 0, size);
+}
+
+uint8_t *corpus_encode_frame(const struct corpus_image *image, uint32_t index,
+                             size_t *size) {
+  return encode(image, true, index, size);
+}
+
+void corpus_write_temporary(const struct corpus_image *image, char *path) {
+  const char *directory = getenv("TMPDIR");
+  snprintf(path, 64, "%s/corpus-XXXXXX",
+           directory != NULL && strlen(directory) < 40 ? directory : "/tmp");
+  int fd = mkstemp(path);
+  assert(fd != -1);
+  size_t size;
+  uint8_t *data = corpus_encode(image, &size);
+  ssize_t written = write(fd, data, size);
+  assert(written == (ssize_t)size);
+  close(fd);
+  free(data);
+}
+
+void corpus_describe(const struct corpus_image *image, char *text,
+                     size_t size) {
+  char frames[96] = "";
+  if (image->frame_count != 0) {
+    snprintf(frames, sizeof(frames), ", %u frames%s", image->frame_count,
+             image->default_frame ? " starting with the image" : "");
+  }
+  char corrupt[32] = "";
+  if (image->corrupt_frame != 0) {
+    snprintf(corrupt, sizeof(corrupt), ", frame %u corrupt",
+             image->corrupt_frame);
+  }
+  snprintf(text, size,
+           "%ux%u color type %u, %u bits%s%s, filter %d, level %d, memory "
+           "level %d, %s flush every %u rows, IDAT size %zu%s%s, seed %u",
+           image->width, image->height, image->color_type, image->bit_depth,
+           image->interlaced ? ", interlaced" : "",
+           image->transparency ? ", tRNS" : "", image->filter, image->level,
+           image->mem_level, image->sync_flush ? "sync" : "full",
+           image->flush_rows, image->idat_size, frames, corrupt,
+           image->seed);
+}
@@ -0,0 +1,80 @@
+#ifndef CORPUS_H
+#define CORPUS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Describes a generated PNG. The pixels are pseudo-random from seed, with
+ * runs of gradients so that every filter type has something to predict,
+ * and alpha and tRNS values that cover fully transparent, translucent and
+ * opaque pixels. */
+struct corpus_image {
+  uint32_t width;
+  uint32_t height;
+  uint8_t bit_depth;
+  uint8_t color_type;
+  bool interlaced;
+  /* Adds a tRNS chunk to gray, truecolor and palette images. */
+  bool transparency;
+  /* Filter type of every row, or -1 for a random one per row. */
+  int filter;
+  /* zlib compression level and memory level, where small memory levels
+   * end a deflate block every few hundred bytes. */
+  int level;
+  int mem_level;
+  /* Rows between full flushes, or sync flushes with sync_flush, 0 for
+   * none. */
+  uint32_t flush_rows;
+  bool sync_flush;
+  /* Largest size of an IDAT or fdAT chunk. */
+  size_t idat_size;
+  /* Frames of an APNG that plays once, or 0 for a still image. With
+   * default_frame the image is the first of them, otherwise it is not part
+   * of the animation. Frames are never interlaced. */
+  uint32_t frame_count;
+  bool default_frame;
+  /* Frame whose stream is cut in half, counted from 1, or 0 for none. */
+  uint32_t corrupt_frame;
+  uint32_t seed;
+};
+
+/* Area of the canvas that a frame covers, and its fcTL operations. */
+struct corpus_frame {
+  uint32_t x;
+  uint32_t y;
+  uint32_t width;
+  uint32_t height;
+  uint8_t dispose;
+  uint8_t blend;
+};
+
+/* Color types and bit depths that PNG allows. */
+#define CORPUS_FORMAT_COUNT 15
+extern const uint8_t corpus_formats[CORPUS_FORMAT_COUNT][2];
+
+/* Returns an image of the format with the defaults for the other fields. */
+struct corpus_image corpus_image(uint8_t color_type, uint8_t bit_depth);
+
+/* Encodes the image as a PNG file in memory, which the caller frees. */
+uint8_t *corpus_encode(const struct corpus_image *image, size_t *size);
+
+/* Stores the area and operations of frame index of an animated image. They
+ * go through every combination of dispose and blend operations. */
+void corpus_frame(const struct corpus_image *image, uint32_t index,
+                  struct corpus_frame *frame);
+
+/* Encodes the pixels of frame index of an animated image as a still PNG of
+ * the size of the frame, which the caller frees. */
+uint8_t *corpus_encode_frame(const struct corpus_image *image, uint32_t index,
+                             size_t *size);
+
+/* Writes the encoded image to a new temporary file, whose path is stored in
+ * path, which has room for at least 64 bytes. */
+void corpus_write_temporary(const struct corpus_image *image, char *path);
+
+/* Describes the image for messages. */
+void corpus_describe(const struct corpus_image *image, char *text,
+                     size_t size);
+
+#endif